@@ -0,0 +1,96 @@
+// Replaces the global allocation functions, see alloc.hpp. Compiled into
+// every executable when SHAPEZX_TRACK_ALLOCATIONS is on.
+#include "alloc.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace shapezx::alloc {
+
+thread_local Site current = Site::Other;
+
+namespace {
+
+std::array<std::atomic<std::uint64_t>, SITES> counts{};
+std::array<std::atomic<std::uint64_t>, SITES> sizes{};
+
+void note(std::size_t n) {
+  auto s = static_cast<std::size_t>(current);
+  counts[s].fetch_add(1, std::memory_order_relaxed);
+  sizes[s].fetch_add(n, std::memory_order_relaxed);
+}
+
+void *allocate(std::size_t n, std::size_t align) {
+  note(n);
+  if (align <= alignof(std::max_align_t)) {
+    return std::malloc(n ? n : 1);
+  }
+  // aligned_alloc wants a multiple of the alignment
+  return std::aligned_alloc(align, (n + align - 1) / align * align);
+}
+
+void *allocate_or_throw(std::size_t n, std::size_t align) {
+  if (auto *p = allocate(n, align); p) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+} // namespace
+
+Stats stats() {
+  Stats res;
+  for (std::size_t s = 0; s < SITES; ++s) {
+    res.count[s] = counts[s].load(std::memory_order_relaxed);
+    res.bytes[s] = sizes[s].load(std::memory_order_relaxed);
+  }
+  return res;
+}
+
+} // namespace shapezx::alloc
+
+using shapezx::alloc::allocate;
+using shapezx::alloc::allocate_or_throw;
+
+constexpr auto DEFAULT = alignof(std::max_align_t);
+
+void *operator new(std::size_t n) { return allocate_or_throw(n, DEFAULT); }
+
+void *operator new[](std::size_t n) { return allocate_or_throw(n, DEFAULT); }
+
+void *operator new(std::size_t n, const std::nothrow_t &) noexcept {
+  return allocate(n, DEFAULT);
+}
+
+void *operator new[](std::size_t n, const std::nothrow_t &) noexcept {
+  return allocate(n, DEFAULT);
+}
+
+void *operator new(std::size_t n, std::align_val_t a) {
+  return allocate_or_throw(n, static_cast<std::size_t>(a));
+}
+
+void *operator new[](std::size_t n, std::align_val_t a) {
+  return allocate_or_throw(n, static_cast<std::size_t>(a));
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete[](void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
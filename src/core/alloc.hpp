@@ -0,0 +1,100 @@
+#ifndef SHAPEZX_CORE_ALLOC
+#define SHAPEZX_CORE_ALLOC
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Counts heap allocations by where they come from. Only built with the
+// SHAPEZX_TRACK_ALLOCATIONS CMake option, which replaces the global
+// operator new; otherwise scopes do nothing and stats() stays empty.
+namespace shapezx::alloc {
+
+enum class Site : std::size_t {
+  Other,
+  // Map::update outside of the sites below
+  Map,
+  // Building::input_positons
+  Positions,
+  // transport capabilities and merging them
+  Capability,
+  // State::take_item
+  Tasks,
+  // building and parsing JSON for saves and loads, see memory::Staging
+  Json,
+};
+
+inline constexpr std::size_t SITES = 6;
+
+inline constexpr std::array<const char *, SITES> SITE_NAMES{
+    "other", "map", "positions", "capability", "tasks", "json",
+};
+
+struct Stats {
+  std::array<std::uint64_t, SITES> count{};
+  std::array<std::uint64_t, SITES> bytes{};
+
+  std::uint64_t total_count() const {
+    std::uint64_t res = 0;
+    for (auto n : this->count) {
+      res += n;
+    }
+    return res;
+  }
+
+  std::uint64_t total_bytes() const {
+    std::uint64_t res = 0;
+    for (auto n : this->bytes) {
+      res += n;
+    }
+    return res;
+  }
+
+  Stats operator-(const Stats &other) const {
+    auto res = *this;
+    for (std::size_t s = 0; s < SITES; ++s) {
+      res.count[s] -= other.count[s];
+      res.bytes[s] -= other.bytes[s];
+    }
+    return res;
+  }
+};
+
+#ifdef SHAPEZX_TRACK_ALLOCATIONS
+
+inline constexpr bool TRACKED = true;
+
+// site of the allocations the current thread makes
+extern thread_local Site current;
+
+// Attributes allocations of the current thread to site while it exists.
+struct Scope {
+  Site saved;
+
+  explicit Scope(Site site) : saved(current) { current = site; }
+  Scope(const Scope &) = delete;
+  ~Scope() { current = this->saved; }
+};
+
+// allocations of all threads so far
+Stats stats();
+
+inline Site site() { return current; }
+
+#else
+
+inline constexpr bool TRACKED = false;
+
+struct Scope {
+  explicit Scope(Site) {}
+};
+
+inline Stats stats() { return {}; }
+
+inline Site site() { return Site::Other; }
+
+#endif
+
+} // namespace shapezx::alloc
+
+#endif
@@ -0,0 +1,46 @@
+#include "command.hpp"
+
+#include <array>
+#include <cstddef>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <variant>
+
+namespace shapezx {
+
+// indexed like the alternatives of Action
+static constexpr std::array<const char *, std::variant_size_v<Action>> KINDS{
+    "place", "remove", "upgrade", "purchase"};
+
+template <std::size_t I = 0>
+Action action_from_json(std::size_t kind, const json &j) {
+  if constexpr (I < std::variant_size_v<Action>) {
+    if (kind == I) {
+      return j.get<std::variant_alternative_t<I, Action>>();
+    }
+    return action_from_json<I + 1>(kind, j);
+  } else {
+    throw std::invalid_argument(std::format("unknown command {}", kind));
+  }
+}
+
+void to_json(json &j, const Command &p) {
+  j = json::array({
+      p.tick,
+      KINDS[p.action.index()],
+      std::visit([](auto const &a) { return json(a); }, p.action),
+  });
+}
+
+void from_json(const json &j, Command &p) {
+  j.at(0).get_to(p.tick);
+  auto name = j.at(1).get<std::string>();
+  std::size_t kind = 0;
+  while (kind < KINDS.size() && name != KINDS[kind]) {
+    kind += 1;
+  }
+  p.action = action_from_json(kind, j.at(2));
+}
+
+} // namespace shapezx
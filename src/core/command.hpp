@@ -0,0 +1,82 @@
+#ifndef SHAPEZX_CORE_COMMAND
+#define SHAPEZX_CORE_COMMAND
+
+#include "../vec/vec.hpp"
+#include "machine.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <cstdint>
+#include <variant>
+#include <vector>
+
+namespace shapezx {
+
+using nlohmann::json;
+
+// Player actions. Everything that changes a running game outside of
+// State::update goes through one of these so that it can be recorded and
+// replayed.
+struct Place {
+  struct Entry {
+    vec::Vec2<> pos;
+    BuildingType type;
+    Direction direction;
+  };
+
+  // placed as one batch, see Map::place
+  std::vector<Entry> entries;
+};
+
+struct Remove {
+  // any chunk covered by the building
+  vec::Vec2<> pos;
+};
+
+struct Upgrade {
+  enum class Target { Miner, Belt, Cutter };
+
+  Target target;
+};
+
+struct Purchase {
+  enum class Offer { Center, Map, Value };
+
+  Offer offer;
+};
+
+using Action = std::variant<Place, Remove, Upgrade, Purchase>;
+
+struct Command {
+  // ticks the game had run when the action was taken
+  std::uint64_t tick;
+  Action action;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Place::Entry, pos, type, direction);
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Place, entries);
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Remove, pos);
+
+NLOHMANN_JSON_SERIALIZE_ENUM(Upgrade::Target,
+                             {
+                                 {Upgrade::Target::Miner, "miner"},
+                                 {Upgrade::Target::Belt, "belt"},
+                                 {Upgrade::Target::Cutter, "cutter"},
+                             })
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Upgrade, target);
+
+NLOHMANN_JSON_SERIALIZE_ENUM(Purchase::Offer,
+                             {
+                                 {Purchase::Offer::Center, "center"},
+                                 {Purchase::Offer::Map, "map"},
+                                 {Purchase::Offer::Value, "value"},
+                             })
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Purchase, offer);
+
+void to_json(json &j, const Command &p);
+
+void from_json(const json &j, Command &p);
+
+} // namespace shapezx
+
+#endif
@@ -1,124 +1,836 @@
 #include "core.hpp"
+#include "alloc.hpp"
+#include "jobs.hpp"
 #include "machine.hpp"
+#include "memory.hpp"
+#include "noise.hpp"
 
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <nlohmann/json.hpp>
 #include <ranges>
+#include <unordered_set>
+#include <utility>
 
 namespace shapezx {
 
-void Chunk::update(MapAccessor m) {
-  if (this->building) {
-    auto &b = *this->building;
-    b->update(m);
+Slot &Tile::claim(size_t i, std::uint32_t owner, vec::Vec2<> anchor) {
+  auto it = std::ranges::find(this->slots, owner, &Slot::owner);
+  if (it == this->slots.end()) {
+    it = std::ranges::find_if(this->slots, &Slot::empty);
   }
+  if (it == this->slots.end()) {
+    it = this->slots.insert(it, Slot{});
+  }
+
+  it->owner = owner;
+  it->anchor = anchor;
+  it->cells += 1;
+  this->cells[i].slot =
+      static_cast<std::uint16_t>(it - this->slots.begin() + 1);
+  return *it;
+}
+
+void Tile::release(size_t i) {
+  auto &slot = this->slots[this->cells[i].slot - 1];
+  this->cells[i].slot = 0;
+  slot.cells -= 1;
+  if (slot.cells == 0) {
+    slot = Slot{};
+  }
+}
+
+void Tile::add_belt(size_t i, std::uint32_t progress, bool busy) {
+  auto k = std::ranges::lower_bound(this->belts.cells, i) -
+           this->belts.cells.begin();
+  this->belts.cells.insert(this->belts.cells.begin() + k, std::uint16_t(i));
+  this->belts.progress.insert(this->belts.progress.begin() + k, progress);
+  this->belts.busy.insert(this->belts.busy.begin() + k, busy);
+  this->belts.at.set(i);
+}
+
+std::uint32_t Tile::remove_belt(size_t i) {
+  auto k = *this->belts.find(i);
+  auto progress = this->belts.progress[k];
+  this->belts.cells.erase(this->belts.cells.begin() + k);
+  this->belts.progress.erase(this->belts.progress.begin() + k);
+  this->belts.busy.erase(this->belts.busy.begin() + k);
+  this->belts.at.reset(i);
+  return progress;
+}
+
+void Tile::index_belts() {
+  this->belts = {};
+  for (auto const &slot : this->slots) {
+    if (auto const *belt = dynamic_cast<const Belt *>(slot.building.get());
+        belt) {
+      auto i = slot.anchor[0] % SIZE * SIZE + slot.anchor[1] % SIZE;
+      this->add_belt(i, belt->progress, !belt->buffer.empty());
+    }
+  }
+}
+
+std::uint64_t Tile::advance_belts(size_t t, std::uint32_t scale,
+                                  vector<std::uint16_t> &fired) {
+  auto &[cells, progress, busy, at] = this->belts;
+  auto const n = progress.size();
+  auto const step = 10 * scale;
+
+  // Plain passes over the arrays, no belt objects are touched. Most belts
+  // end up doing nothing else this tick.
+  for (size_t k = 0; k < n; ++k) {
+    progress[k] += step * busy[k];
+  }
+
+  std::uint64_t delta = 0;
+  for (size_t k = 0; k < n; ++k) {
+    if (busy[k]) {
+      delta ^= progress_hash(t, cells[k], progress[k] - step) ^
+               progress_hash(t, cells[k], progress[k]);
+    }
+  }
+
+  auto count = fired.size();
+  fired.resize(count + n);
+  for (size_t k = 0; k < n; ++k) {
+    fired[count] = std::uint16_t(k);
+    count += progress[k] >= 100;
+  }
+  fired.resize(count);
+  return delta;
 }
 
-void Map::update(State &ctx) {
-  for (auto const [r, row] : this->chunks |
-                                 std::ranges::views::chunk(this->width) |
-                                 std::ranges::views::enumerate) {
-    for (auto const [c, chunk] : row | std::ranges::views::enumerate) {
-      auto acc = MapAccessor(vec::Vec2<>(r, c), *this, ctx);
-      chunk.update(acc);
+json Tile::building_json(const Slot &slot) const {
+  json res;
+  slot.building->to_json(res);
+  auto i = slot.anchor[0] % SIZE * SIZE + slot.anchor[1] % SIZE;
+  if (auto k = this->belts.find(i); k) {
+    res["progress"] = this->belts.progress[*k];
+  }
+  return res;
+}
+
+namespace {
+
+// Ore ids of the N chunks of row r from column c0, see Map::ore_at().
+template <size_t N>
+void ore_row(std::uint64_t seed, size_t r, size_t c0,
+             array<std::uint8_t, N> &out) {
+  array<std::uint32_t, N> coarse, fine, kind;
+  noise::row<4>(hash::combine(seed, 0), r, c0, coarse);
+  noise::row<2>(hash::combine(seed, 1), r, c0, fine);
+  noise::row<3>(hash::combine(seed, 2), r, c0, kind);
+
+  static const auto IRON_ID = ore_id(IRON_ORE);
+  static const auto GOLD_ID = ore_id(GOLD);
+  for (size_t j = 0; j < N; ++j) {
+    auto density = (2 * coarse[j] + fine[j]) / 3;
+    auto ore = kind[j] < Map::GOLD_THRESHOLD ? IRON_ID : GOLD_ID;
+    out[j] = density < Map::ORE_THRESHOLD ? 0 : ore;
+  }
+}
+
+} // namespace
+
+std::uint8_t Map::ore_at(std::uint64_t seed, size_t r, size_t c) {
+  array<std::uint8_t, 1> res;
+  ore_row(seed, r, c, res);
+  return res[0];
+}
+
+void Map::generate(size_t h, size_t w) {
+  vector<size_t> todo;
+  for (size_t t = 0; t < this->tiles.size(); ++t) {
+    auto origin = this->tile_origin(t);
+    if (origin[0] + Tile::SIZE > h || origin[1] + Tile::SIZE > w) {
+      todo.push_back(t);
+    }
+  }
+
+  auto fill = [&](size_t t) {
+    auto origin = this->tile_origin(t);
+    auto &tile = this->tile_mut(t);
+    array<std::uint8_t, Tile::SIZE> ores;
+    for (size_t dr = 0; dr < Tile::SIZE; ++dr) {
+      auto r = origin[0] + dr;
+      ore_row(this->seed, r, origin[1], ores);
+      for (size_t dc = 0; dc < Tile::SIZE; ++dc) {
+        auto c = origin[1] + dc;
+        if (r < this->height && c < this->width && (r >= h || c >= w)) {
+          tile.cells[dr * Tile::SIZE + dc].ore = ores[dc];
+        }
+      }
+    }
+  };
+
+  // every tile is written by one job only
+  Jobs::shared().parallel_for(0, todo.size(), 64,
+                              [&](size_t i) { fill(todo[i]); });
+}
+
+void Map::share_tiles(const Map &other) {
+  this->tiles.resize(other.tiles.size());
+  Jobs::shared().parallel_for(0, other.tiles.size(), 1 << 14, [&](size_t t) {
+    this->tiles[t] = other.tiles[t];
+  });
+}
+
+void Map::grow(size_t h, size_t w) {
+  h = std::max(h, this->height);
+  w = std::max(w, this->width);
+  if (h == this->height && w == this->width) {
+    return;
+  }
+
+  // regions are laid out by tile_cols(), so a paged map is loaded
+  // completely and paged again afterwards
+  auto pager = this->paging ? this->paging->pager : nullptr;
+  if (this->paging) {
+    for (size_t t = 0; t < this->tiles.size(); ++t) {
+      this->resident(t);
     }
+    this->paging.reset();
+  }
+
+  // existing tiles keep their place in the grid, only the pointers move
+  auto const old_cols = this->tile_cols();
+  auto const old_tiles = std::exchange(this->tiles, {});
+  auto const old_h = std::exchange(this->height, h);
+  auto const old_w = std::exchange(this->width, w);
+
+  this->tiles.resize(this->tile_rows() * this->tile_cols());
+  for (size_t t = 0; t < this->tiles.size(); ++t) {
+    auto tr = t / this->tile_cols();
+    auto tc = t % this->tile_cols();
+    if (tc < old_cols && tr * old_cols + tc < old_tiles.size()) {
+      this->tiles[t] = old_tiles[tr * old_cols + tc];
+    } else {
+      this->tiles[t] = std::make_shared<Tile>();
+    }
+  }
+
+  this->generate(old_h, old_w);
+  // positions are hashed by their index, which depends on the width
+  this->rebuild_hash();
+  if (pager) {
+    this->page_to(pager);
+  }
+}
+
+void Map::occupy(vec::Vec2<> pos, vec::Vec2<ssize_t> rect,
+                 unique_ptr<Building> &&building) {
+  auto const owner = building->info().id;
+  for (auto [r, c] : rect_iter(rect)) {
+    auto [t, i] = this->locate(pos + vec::Vec2<ssize_t>(r, c));
+    this->tile_mut(t).claim(i, owner, pos);
+  }
+
+  auto [t, i] = this->locate(pos);
+  auto &tile = this->tile_mut(t);
+  if (auto const *belt = dynamic_cast<const Belt *>(building.get()); belt) {
+    tile.add_belt(i, belt->progress, !belt->buffer.empty());
+    this->hash_ ^= Tile::progress_hash(t, i, belt->progress);
+  }
+  tile.slots[tile.cells[i].slot - 1].building = std::move(building);
+  tile.buildings += 1;
+  if (this->multi_rate) {
+    this->multi_rate->stale = true;
+  }
+}
+
+void Map::vacate(vec::Vec2<> pos, vec::Vec2<ssize_t> rect) {
+  auto [t, i] = this->locate(pos);
+  auto &tile = this->tile_mut(t);
+  tile.buildings -= 1;
+  if (this->multi_rate) {
+    this->multi_rate->stale = true;
+  }
+  if (tile.belts.at[i]) {
+    this->hash_ ^= Tile::progress_hash(t, i, tile.remove_belt(i));
+  }
+  for (auto [r, c] : rect_iter(rect)) {
+    auto [t, i] = this->locate(pos + vec::Vec2<ssize_t>(r, c));
+    this->tile_mut(t).release(i);
   }
 }
 
-void to_json(json &j, const Chunk &p) {
-  if (p.ore) {
-    j["ore"] = *p.ore;
-  } else {
-    j["ore"] = nullptr;
+std::uint32_t Map::region_scale(size_t r, std::uint64_t tick) {
+  if (!this->multi_rate) {
+    return 1;
   }
-  if (p.building) {
-    json b;
-    auto &building = *p.building;
-    building->to_json(b);
-    std::cout << b << '\n';
-    j["building"] = b;
-  } else {
-    j["building"] = nullptr;
+  auto &mr = *this->multi_rate;
+  if (mr.done.size() != this->regions()) {
+    mr.done.assign(this->regions(), tick);
+  }
+
+  auto const span = Pager::REGION * Tile::SIZE;
+  auto near = [=](size_t i, size_t lo, size_t hi) {
+    return i * span < hi + span && (i + 2) * span > lo;
+  };
+  auto const rr = r / this->region_cols();
+  auto const rc = r % this->region_cols();
+  auto const behind = tick + 1 - mr.done[r];
+  auto const stride = std::clamp(mr.stride, 1u, MultiRate::MAX_STRIDE);
+  // an empty view has nothing in focus
+  auto const focus = mr.from != mr.to && near(rr, mr.from[0], mr.to[0]) &&
+                     near(rc, mr.from[1], mr.to[1]);
+  // coarse regions take turns so that not all of them update on one tick
+  if (behind < stride && (tick + r) % stride != 0 && !focus &&
+      !mr.feeds[r]) {
+    return 0;
+  }
+  mr.done[r] = tick + 1;
+  return std::uint32_t(behind);
+}
+
+void Map::find_feeders(State &ctx) {
+  auto &mr = *this->multi_rate;
+  mr.feeds.assign(this->regions(), 0);
+  mr.stale = false;
+
+  vector<vec::Vec2<>> todo;
+  for (size_t t = 0; t < this->tiles.size(); ++t) {
+    if (!this->has_buildings(t)) {
+      continue;
+    }
+    auto const origin = this->tile_origin(t);
+    auto const &tile = this->tile(t);
+    for (size_t i = 0; i < tile.cells.size(); ++i) {
+      auto pos = origin + vec::Vec2<>(i / Tile::SIZE, i % Tile::SIZE);
+      if (auto const *b = tile.anchored(i, pos);
+          b && b->info().type == BuildingType::TaskCenter) {
+        todo.push_back(pos);
+      }
+    }
   }
 
-  std::cout << j << '\n';
+  // back from the TaskCenters to every building next to an input of one
+  // already found, whether or not it faces that input
+  std::unordered_set<size_t> seen;
+  while (!todo.empty()) {
+    auto const pos = todo.back();
+    todo.pop_back();
+    if (!seen.insert(pos[0] * this->width + pos[1]).second) {
+      continue;
+    }
+    mr.feeds[this->region_of(this->locate(pos).first)] = 1;
+    MapAccessor m(pos, *this, ctx);
+    for (auto from : this->read(pos).building->input_positons(m)) {
+      if (auto anchor = this->anchor_of(from); anchor) {
+        todo.push_back(*anchor);
+      }
+    }
+  }
 }
 
-void from_json(const json &j, Chunk &p) {
-  std::cout << "t1\n";
-  try {
-    Item it;
-    j.at("ore").get_to(it);
-    p.ore = it;
-  } catch (const json::exception &) {
-    p.ore = nullopt;
+Buffer Map::update(State &ctx) {
+  auto const regions = this->regions();
+  if (this->multi_rate &&
+      (this->multi_rate->stale || this->multi_rate->feeds.size() != regions)) {
+    this->find_feeders(ctx);
   }
-  std::cout << "t2\n";
-  try {
-    std::cout << j << '\n';
-    BuildingInfo info;
-    j.at("/building/info"_json_pointer).get_to(info);
-    std::cout << "info\n";
-    auto serialize_building = [&](std::unique_ptr<Building> &&b) {
-      b->from_json(j["building"]);
-      std::cout << "building set\n";
-      p.building = std::move(b);
-      std::cout << "building set\n";
+  alloc::Scope scope(alloc::Site::Map);
+  auto &scales = this->scratch.scales;
+  scales.resize(regions);
+  for (size_t r = 0; r < regions; ++r) {
+    scales[r] = this->region_scale(r, ctx.tick);
+  }
+
+  trace::Span span(this->traced, "map update");
+  auto &outcomes = this->scratch.outcomes;
+  outcomes.resize(regions);
+  for (auto &out : outcomes) {
+    out.hash = 0;
+    // keeps its buckets
+    out.delivered.clear();
+  }
+  auto *profile = ctx.profile.get();
+  auto *heatmap = ctx.heatmap.get();
+  if (heatmap && (heatmap->height != this->height ||
+                  heatmap->width != this->width)) {
+    *heatmap = Heatmap(this->height, this->width);
+  }
+  auto const sampled = heatmap && Heatmap::sampling(ctx.tick);
+  auto run = [&](size_t r) {
+    // on whichever thread runs the region
+    alloc::Scope scope(alloc::Site::Map);
+    trace::Span span(this->traced, "region", "region", r);
+    auto &out = outcomes[r];
+    vector<std::uint16_t> fired;
+    Profile::PerType counted;
+    auto start = [&]() {
+      return profile ? Counters::now() : std::nullopt;
     };
-    switch (info.type) {
-    case BuildingType::Miner:
-      serialize_building(std::make_unique<Miner>());
-      break;
-    case BuildingType::Belt:
-      serialize_building(std::make_unique<Belt>());
-      break;
-    case BuildingType::Cutter:
-      serialize_building(std::make_unique<Cutter>());
-      break;
-    case BuildingType::TrashCan:
-      serialize_building(std::make_unique<TrashCan>());
+    // calls f with where to count transfers, timing it on sampled ticks
+    auto timed = [&](vec::Vec2<> pos, auto &&f) {
+      if (!sampled) {
+        f(nullptr);
+        return;
+      }
+      std::uint32_t transfers = 0;
+      auto const begin = trace::now();
+      f(&transfers);
+      heatmap->add(pos, ctx.tick, trace::now() - begin, transfers);
+    };
+    for (auto t : this->region_tiles(r)) {
+      if (!this->has_buildings(t)) {
+        continue;
+      }
+      auto origin = this->tile_origin(t);
+      auto &tile = this->tile_mut(t);
+      auto at = [&](size_t i) {
+        return origin + vec::Vec2<>(i / Tile::SIZE, i % Tile::SIZE);
+      };
+
+      fired.clear();
+      auto const belts = start();
+      out.hash ^= tile.advance_belts(t, scales[r], fired);
+      for (auto k : fired) {
+        auto const i = tile.belts.cells[k];
+        auto &progress = tile.belts.progress[k];
+        auto const moves = progress / 100;
+        out.hash ^= Tile::progress_hash(t, i, progress) ^
+                    Tile::progress_hash(t, i, progress % 100);
+        progress %= 100;
+
+        auto pos = at(i);
+        auto *belt = static_cast<Belt *>(tile.anchored(i, pos));
+        timed(pos, [&](std::uint32_t *transfers) {
+          belt->transfer(MapAccessor(pos, *this, ctx, scales[r],
+                                     &out.delivered, &out.hash, transfers),
+                         moves);
+        });
+        tile.belts.busy[k] = !belt->buffer.empty();
+      }
+      if (profile && !tile.belts.cells.empty()) {
+        counted.add(BuildingType::Belt, belts);
+      }
+
+      for (size_t i = 0; i < tile.cells.size(); ++i) {
+        if (tile.belts.at[i]) {
+          continue;
+        }
+        auto pos = at(i);
+        if (auto *b = tile.anchored(i, pos); b) {
+          auto const before = start();
+          timed(pos, [&](std::uint32_t *transfers) {
+            b->update(MapAccessor(pos, *this, ctx, scales[r], &out.delivered,
+                                  &out.hash, transfers));
+          });
+          if (profile) {
+            counted.add(b->info().type, before);
+          }
+        }
+      }
+    }
+    if (profile) {
+      profile->add(counted);
+    }
+  };
+
+  // Regions are updated in four phases by the parity of their row and
+  // column. Regions of one phase are a whole region apart, further than any
+  // building reaches, so they run in parallel. The order only depends on
+  // the map, and so does the outcome. Faulting regions in is not thread
+  // safe, so on paged maps whatever a phase reaches is faulted in first.
+  // Recorded logs replay this order, changing it means bumping
+  // CommandLog::VERSION.
+  auto const cols = this->region_cols();
+  auto &jobs = ctx.jobs ? *ctx.jobs : Jobs::shared();
+  auto &todo = this->scratch.todo;
+  for (size_t phase = 0; phase < 4; ++phase) {
+    todo.clear();
+    for (size_t r = 0; r < regions; ++r) {
+      if (scales[r] != 0 && r / cols % 2 * 2 + r % cols % 2 == phase) {
+        todo.push_back(r);
+      }
+    }
+    if (this->paging) {
+      this->prefault(todo);
+    }
+    jobs.parallel_for(0, todo.size(), 1, [&](size_t i) { run(todo[i]); });
+  }
+
+  Buffer delivered;
+  for (auto &out : outcomes) {
+    this->hash_ ^= out.hash;
+    for (auto const &[item, num] : out.delivered.items) {
+      delivered.increase(item, num);
+    }
+  }
+  if (this->paging && this->paging->pager) {
+    this->page_out();
+  }
+  return delivered;
+}
+
+optional<ChangeSet> Map::place(vector<Placement> &&batch) {
+  vector<size_t> claimed;
+  for (auto const &[pos, machine] : batch) {
+    for (auto [r, c] : rect_iter(machine->relative_rect())) {
+      auto p = pos + vec::Vec2<ssize_t>(r, c);
+      if (!this->contains(p) || this->cell(p).slot != 0) {
+        return nullopt;
+      }
+      claimed.push_back(p[0] * this->width + p[1]);
+    }
+  }
+  std::ranges::sort(claimed);
+  if (std::ranges::adjacent_find(claimed) != claimed.end()) {
+    return nullopt;
+  }
+
+  ChangeSet res;
+  res.placed.reserve(batch.size());
+  for (auto &[pos, machine] : batch) {
+    auto rect = machine->relative_rect();
+    auto &placed = res.placed.emplace_back();
+    placed.building = machine.get();
+    for (auto [r, c] : rect_iter(rect)) {
+      placed.chunks.push_back(pos + vec::Vec2<ssize_t>(r, c));
+    }
+
+    this->occupy(pos, rect, std::move(machine));
+    this->rehash(pos);
+  }
+
+  return res;
+}
+
+vector<vec::Vec2<>> Map::remove(vec::Vec2<> pos) {
+  auto *building = (*this)[pos].building;
+  auto rect = building->relative_rect();
+  this->hash_ ^= building->hashed_;
+  this->vacate(pos, rect);
+
+  vector<vec::Vec2<>> res;
+  for (auto [r, c] : rect_iter(rect)) {
+    res.push_back(pos + vec::Vec2<ssize_t>(r, c));
+  }
+  return res;
+}
+
+std::uint64_t Map::rebuild_hash() {
+  this->hash_ = 0;
+  for (size_t t = 0; t < this->tiles.size(); ++t) {
+    if (!this->has_buildings(t)) {
+      continue;
+    }
+
+    auto origin = this->tile_origin(t);
+    auto &tile = this->tile_mut(t);
+    for (size_t i = 0; i < tile.cells.size(); ++i) {
+      auto pos = origin + vec::Vec2<>(i / Tile::SIZE, i % Tile::SIZE);
+      if (auto *b = tile.anchored(i, pos); b) {
+        b->reindex();
+        b->hashed_ = hash::combine(pos[0] * this->width + pos[1], b->digest());
+        this->hash_ ^= b->hashed_;
+      }
+    }
+    for (auto [i, progress] :
+         std::views::zip(tile.belts.cells, tile.belts.progress)) {
+      this->hash_ ^= Tile::progress_hash(t, i, progress);
+    }
+  }
+  return this->hash_;
+}
+
+// Saves keep one object per chunk, {"ore": Item?, "building": Building?}.
+void to_json(json &j, const Map &p) {
+  if (p.paging && p.paging->pager) {
+    p.save_pages(j);
+    return;
+  }
+
+  json::array_t chunks(p.height * p.width);
+  // tiles of maps loaded from an image are read from there, not loaded
+  auto tile = [&](size_t t, const Tile *held) {
+    auto const origin = p.tile_origin(t);
+    for (size_t i = 0; i < held->cells.size(); ++i) {
+      auto pos = origin + vec::Vec2<>(i / Tile::SIZE, i % Tile::SIZE);
+      if (!p.contains(pos)) {
+        continue;
+      }
+      auto const *ore = ore_item(held->cells[i].ore);
+      json building = nullptr;
+      if (held->anchored(i, pos)) {
+        building = held->building_json(held->slots[held->cells[i].slot - 1]);
+      }
+      chunks[pos[0] * p.width + pos[1]] = json{
+          {"ore", ore ? json(*ore) : json(nullptr)},
+          {"building", std::move(building)},
+      };
+    }
+  };
+  Jobs::shared().parallel_for(0, p.regions(), 1, [&](size_t r) {
+    auto const held = p.peek_region(r);
+    for (auto const [k, t] : std::views::enumerate(p.region_tiles(r))) {
+      tile(t, held[k].get());
+    }
+  });
+  j = {
+      {"chunks", std::move(chunks)},
+      {"height", p.height},
+      {"width", p.width},
+      {"seed", p.seed},
+  };
+}
+
+void from_json(const json &j, Map &p) {
+  if (j.contains("regions")) {
+    p.load_pages(j);
+    return;
+  }
+
+  auto const w = j.at("width").get<size_t>();
+  p = Map(j.at("height").get<size_t>(), w);
+  p.seed = j.value("seed", std::uint64_t(0));
+
+  // decoded in parallel, placed in order
+  auto const &chunks = j.at("chunks");
+  vector<std::uint8_t> ores(chunks.size());
+  vector<unique_ptr<Building>> buildings(chunks.size());
+  Jobs::shared().parallel_for(0, chunks.size(), 1024, [&](size_t i) {
+    auto const &chunk = chunks[i];
+    if (auto it = chunk.find("ore"); it != chunk.end() && !it->is_null()) {
+      ores[i] = ore_id(it->get<Item>());
+    }
+    if (auto it = chunk.find("building");
+        it != chunk.end() && !it->is_null()) {
+      buildings[i] = load_building(*it);
+    }
+  });
+
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    vec::Vec2<> pos(i / w, i % w);
+    if (ores[i] != 0) {
+      p.set_ore(pos, ores[i]);
+    }
+    if (auto &b = buildings[i]; b) {
+      if (auto rect = b->relative_rect(); p.can_place(pos, rect)) {
+        p.occupy(pos, rect, std::move(b));
+      }
+    }
+  }
+  p.rebuild_hash();
+}
+
+Blueprint Blueprint::capture(Map &map, vec::Vec2<> from, vec::Vec2<> to) {
+  Blueprint res;
+  for (auto r = from[0]; r < std::min(to[0], map.height); ++r) {
+    for (auto c = from[1]; c < std::min(to[1], map.width); ++c) {
+      if (auto const *building = map.read({r, c}).building; building) {
+        auto info = building->info();
+        res.entries.push_back({
+            .type = info.type,
+            .direction = info.direction,
+            .offset = {static_cast<ssize_t>(r - from[0]),
+                       static_cast<ssize_t>(c - from[1])},
+        });
+      }
+    }
+  }
+  return res;
+}
+
+Place Blueprint::paste_at(vec::Vec2<> origin) const {
+  Place res;
+  res.entries.reserve(this->entries.size());
+  for (auto const &entry : this->entries) {
+    res.entries.push_back({
+        .pos = origin + entry.offset,
+        .type = entry.type,
+        .direction = entry.direction,
+    });
+  }
+  return res;
+}
+
+bool Global::purchase(Purchase::Offer offer) {
+  switch (offer) {
+  case Purchase::Offer::Center:
+    if (this->value < this->price.center()) {
+      return false;
+    }
+    this->value -= this->price.center();
+    this->price.center_ += 1;
+    this->center_size += {1, 1};
+    return true;
+  case Purchase::Offer::Map:
+    if (this->value < this->price.map()) {
+      return false;
+    }
+    this->value -= this->price.map();
+    this->price.map_ += 1;
+    this->max_height += 10;
+    this->max_width += 10;
+    return true;
+  case Purchase::Offer::Value:
+    if (this->value < this->price.value()) {
+      return false;
+    }
+    this->value -= this->price.value();
+    this->price.value_ += 1;
+    this->value_factor += 1;
+    return true;
+  }
+  return false;
+}
+
+ChangeSet State::execute(const Action &action) {
+  if (this->on_command) {
+    this->on_command({this->tick, action});
+  }
+
+  ChangeSet res;
+  if (auto place = std::get_if<Place>(&action); place) {
+    vector<Placement> batch;
+    for (auto const &e : place->entries) {
+      if (auto machine = make_building(e.type, this->id_.gen(), e.direction);
+          machine) {
+        batch.emplace_back(e.pos, std::move(machine));
+      }
+    }
+    if (auto changes = this->map.place(std::move(batch)); changes) {
+      res = std::move(*changes);
+    }
+    if (this->metrics) {
+      for (auto const &p : res.placed) {
+        this->metrics->building_added(p.building->info().type);
+      }
+    }
+  } else if (auto remove = std::get_if<Remove>(&action); remove) {
+    if (auto anchor = this->map.anchor_of(remove->pos); anchor) {
+      auto id = this->map.occupant(*anchor).owner;
+      if (this->metrics) {
+        auto const &b = *this->map.read(*anchor).building;
+        this->metrics->building_added(b.info().type, -1);
+      }
+      if (this->heatmap) {
+        this->heatmap->clear(*anchor);
+      }
+      auto chunks = this->create_accessor_at(*anchor).remove_machine();
+      res.removed.push_back({.chunks = std::move(chunks), .id = id});
+    }
+  } else if (auto upgrade = std::get_if<Upgrade>(&action); upgrade) {
+    switch (upgrade->target) {
+    case Upgrade::Target::Miner:
+      this->eff.miner += 1;
       break;
-    case BuildingType::TaskCenter:
-      serialize_building(std::make_unique<TaskCenter>());
+    case Upgrade::Target::Belt:
+      this->eff.belt += 1;
       break;
-    case BuildingType::PlaceHolder:
-      serialize_building(std::make_unique<PlaceHolder>());
+    case Upgrade::Target::Cutter:
+      this->eff.cutter += 1;
       break;
     }
-  } catch (const json::exception &e) {
-    // std::cout << e.what() << '\n';
-    p.building = nullopt;
   }
-  std::cout << "t3\n";
+
+  return res;
+}
+
+std::uint64_t State::recompute_hash() {
+  this->map.rebuild_hash();
+  this->store.reindex();
+  this->completed_hash_ = 0;
+  for (size_t i = 0; i < this->tasks.size(); ++i) {
+    if (this->tasks[i].completed_) {
+      this->completed_hash_ ^= hash::mix(i);
+    }
+  }
+  return this->hash();
+}
+
+void State::take_item(const Item &item, size_t num) {
+  alloc::Scope scope(alloc::Site::Tasks);
+  auto before = this->store.get(item);
+  auto after = this->store.increase(item, num);
+  this->value += item.value * num;
+
+  if (auto it = this->task_index_.find(item); it != this->task_index_.end()) {
+    auto &waiting = it->second;
+    auto completed = false;
+    for (auto i : waiting) {
+      if (this->tasks[i].progress(item, before, after)) {
+        completed = true;
+        this->complete_task(i);
+      }
+    }
+    if (completed) {
+      std::erase_if(waiting,
+                    [this](auto i) { return this->tasks[i].completed_; });
+    }
+  }
+}
+
+void State::index_task(size_t i) {
+  auto &task = this->tasks[i];
+  if (task.completed_) {
+    this->completed_hash_ ^= hash::mix(i);
+    return;
+  }
+
+  auto missing = task.missing(this->store);
+  if (missing.empty()) {
+    task.completed_ = true;
+    this->complete_task(i);
+  }
+  for (auto const &item : missing) {
+    this->task_index_[item].push_back(i);
+  }
+}
+
+void State::complete_task(size_t i) {
+  this->completed_hash_ ^= hash::mix(i);
+  if (this->on_task_complete) {
+    this->on_task_complete();
+  }
 }
 
 Global Global::load(const std::string &p) noexcept try {
+  trace::Span span("load global");
   if (!std::filesystem::exists(p)) {
     return {};
   }
   std::ifstream f(p);
-  auto j = json::parse(f);
+  auto j = [&]() {
+    memory::Staging staging(memory::Stage::GlobalLoad);
+    return json::parse(f);
+  }();
   f.close();
   return j.get<Global>();
 } catch (...) {
   return {};
 }
 
+// Returns the bytes written.
 template <typename T>
-void save_json(const T &obj, const std::string &p) {
+std::uint64_t save_json(const T &obj, const std::string &p,
+                        memory::Stage stage) {
+  trace::Span span("save");
   std::ofstream f(p);
-  auto j = json(obj);
-  f << j;
+  {
+    memory::Staging staging(stage);
+    f << json(obj);
+  }
+  auto const bytes = f.tellp();
   f.close();
+  return bytes < 0 ? 0 : std::uint64_t(bytes);
 }
 
 void Global::save_to(const std::string &p) const {
-  save_json(*this, p);
+  save_json(*this, p, memory::Stage::GlobalSave);
 }
 
-void State::save_to(const std::string &p) const {
-  save_json(*this, p);
+void State::save_to(const std::string &p) {
+  auto const begin = trace::now();
+  if (this->map.paging && this->map.paging->pager) {
+    this->map.flush();
+  }
+  auto const bytes = save_json(*this, p, memory::Stage::StateSave);
+  if (this->metrics) {
+    this->metrics->saved(trace::now() - begin, bytes);
+  }
 }
 } // namespace shapezx
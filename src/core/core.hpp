@@ -2,17 +2,27 @@
 #define SHAPEZX_CORE_HPP
 
 #include "../vec/vec.hpp"
+#include "command.hpp"
+#include "hash.hpp"
+#include "heatmap.hpp"
 #include "machine.hpp"
+#include "metrics.hpp"
 #include "ore.hpp"
+#include "perf.hpp"
+#include "region.hpp"
 #include "task.hpp"
+#include "trace.hpp"
 
 #include <nlohmann/detail/exceptions.hpp>
 #include <nlohmann/detail/macro_scope.hpp>
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <bitset>
 #include <cstddef>
 #include <cstdint>
-#include <exception>
+#include <filesystem>
 #include <format>
 #include <functional>
 #include <iostream>
@@ -22,8 +32,10 @@
 #include <random>
 #include <ranges>
 #include <span>
+#include <stdexcept>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -39,23 +51,37 @@ using std::vector;
 
 using ssize_t = std::make_signed_t<size_t>;
 
-struct Chunk {
-  optional<Item> ore;
-  optional<unique_ptr<Building>> building;
+// A chunk of the map as stored: the ore under it and which building covers
+// it, in 4 bytes.
+struct Cell {
+  // index into ORES plus one, 0 for no ore
+  std::uint8_t ore = 0;
+  std::uint8_t reserved_ = 0;
+  // index into Tile::slots plus one, 0 if no building covers the cell
+  std::uint16_t slot = 0;
+};
 
-  Chunk() = default;
-  Chunk(const Chunk &chunk)
-      : ore(chunk.ore), building(chunk.building.transform(
-                            [](const auto &b) { return b->clone(); })) {}
+static_assert(sizeof(Cell) == 4);
 
-  Chunk &operator=(Chunk &&other) = default;
+inline const Item *ore_item(std::uint8_t id) {
+  return id == 0 ? nullptr : &ORES[id - 1];
+}
 
-  void update(MapAccessor);
-};
+// 0 for items that are not ores
+inline std::uint8_t ore_id(const Item &item) {
+  auto it = std::ranges::find(ORES, item);
+  return it == ORES.end() ? 0 : std::uint8_t(it - ORES.begin() + 1);
+}
 
-void to_json(json &j, const Chunk &p);
+// A decoded cell: the ore under it and the building anchored on it, null if
+// there is none. Only valid until the map is modified.
+template <typename B> struct BasicChunk {
+  const Item *ore = nullptr;
+  B *building = nullptr;
+};
 
-void from_json(const json &j, Chunk &p);
+using Chunk = BasicChunk<Building>;
+using ConstChunk = BasicChunk<const Building>;
 
 struct Efficiency {
   std::int32_t miner = 1;
@@ -66,71 +92,562 @@ struct Efficiency {
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Efficiency, miner, belt, cutter);
 
 struct State;
+struct Jobs;
 
-struct Map {
-  static constexpr double HAS_ORE_PROBALITY = 0.3;
-  static constexpr array<double, 2> DISTRIBUTION{0.9, 0.1};
+// Which building covers a chunk and the chunk's offset from its anchor.
+struct Occupant {
+  static constexpr std::uint32_t NONE = 0;
 
-  vector<Chunk> chunks;
-  size_t height;
-  size_t width;
+  std::uint32_t owner = NONE;
+  std::int16_t dr = 0;
+  std::int16_t dc = 0;
 
-  Map() = default;
-  Map(size_t h, size_t w, size_t seed) : chunks(h * w), height(h), width(w) {
-    std::mt19937_64 gen{seed};
-    std::bernoulli_distribution has_ore(HAS_ORE_PROBALITY);
-    std::discrete_distribution<size_t> ore_distribution(DISTRIBUTION.begin(),
-                                                        DISTRIBUTION.end());
-
-    for (auto &chk : this->chunks) {
-      if (has_ore(gen)) {
-        chk.ore = ORES[ore_distribution(gen)];
+  bool empty() const { return this->owner == NONE; }
+
+  vec::Vec2<ssize_t> offset() const { return {this->dr, this->dc}; }
+};
+
+struct Placement {
+  vec::Vec2<> pos;
+  unique_ptr<Building> machine;
+};
+
+// What a committed placement changed, so the UI can refresh in one pass.
+struct ChangeSet {
+  struct Placed {
+    // covered chunks, anchor first
+    vector<vec::Vec2<>> chunks;
+    Building *building;
+  };
+
+  struct Removed {
+    vector<vec::Vec2<>> chunks;
+    std::uint32_t id;
+  };
+
+  vector<Placed> placed;
+  vector<Removed> removed;
+};
+
+// A building covering cells of a tile. A building reaching into other tiles
+// has a slot in each of them, only the one in the tile of its anchor owns it.
+struct Slot {
+  std::uint32_t owner = Occupant::NONE;
+  // cells of the tile referring to this slot, it is free again at 0
+  std::uint16_t cells = 0;
+  vec::Vec2<> anchor = {0, 0};
+  unique_ptr<Building> building;
+
+  Slot() = default;
+  Slot(const Slot &other)
+      : owner(other.owner), cells(other.cells), anchor(other.anchor),
+        building(other.building ? other.building->clone() : nullptr) {}
+  Slot(Slot &&) = default;
+
+  Slot &operator=(Slot &&) = default;
+
+  bool empty() const { return this->owner == Occupant::NONE; }
+};
+
+// Square page of the map. Copies of a Map share their tiles until one of
+// them writes to a tile, so copying a Map costs one pointer per tile.
+struct Tile {
+  static constexpr size_t SIZE = 16;
+
+  // row-major
+  array<Cell, SIZE * SIZE> cells{};
+  vector<Slot> slots;
+  // buildings anchored in this tile, empty tiles are skipped by Map::update
+  size_t buildings = 0;
+
+  // Progress of the belts anchored in this tile, by anchor cell. It changes
+  // every tick, so it lives in arrays that one branch-free pass advances
+  // for all belts; only belts that move their items are visited. Belt
+  // objects only carry their progress while the tile is saved or loaded.
+  struct Belts {
+    // sorted
+    vector<std::uint16_t> cells;
+    vector<std::uint32_t> progress;
+    // 1 while the buffer of the belt has items
+    vector<std::uint8_t> busy;
+    std::bitset<SIZE * SIZE> at;
+
+    // index of the belt anchored at cell i
+    optional<size_t> find(size_t i) const {
+      if (!this->at[i]) {
+        return nullopt;
       }
+      return std::ranges::lower_bound(this->cells, i) - this->cells.begin();
+    }
+  };
+  Belts belts;
+
+  // What the progress of the belt anchored at cell i of tile t adds to
+  // Map::hash_.
+  static std::uint64_t progress_hash(size_t t, size_t i,
+                                     std::uint32_t progress) {
+    return hash::combine(t * SIZE * SIZE + i, progress);
+  }
+
+  // The building anchored at cell i, which is at pos.
+  Building *anchored(size_t i, vec::Vec2<> pos) const {
+    auto const s = this->cells[i].slot;
+    if (s == 0 || this->slots[s - 1].anchor != pos) {
+      return nullptr;
     }
+    return this->slots[s - 1].building.get();
   }
 
-  // caller must guarantee that chks.size() == h * w
-  Map(const vector<Chunk> &chks, size_t h, size_t w)
-      : chunks(chks), height(h), width(w) {}
-  Map(size_t h, size_t w) : chunks(h * w), height(h), width(w) {}
+  // Makes cell i refer to the slot of the given building, adding the slot if
+  // the building has none in this tile yet.
+  Slot &claim(size_t i, std::uint32_t owner, vec::Vec2<> anchor);
 
-  auto &operator[](this auto &&self, size_t x, size_t y) {
-    return self.chunks.at(x * self.width + y);
+  // Clears cell i, freeing its slot once no other cell refers to it.
+  void release(size_t i);
+
+  void add_belt(size_t i, std::uint32_t progress, bool busy);
+
+  // Returns the progress the removed belt had.
+  std::uint32_t remove_belt(size_t i);
+
+  // Rebuilds belts from the buildings, after the tile was loaded.
+  void index_belts();
+
+  // Advances every busy belt by scale ticks and appends the belts that move
+  // their items now to fired. Returns the change to Map::hash_.
+  std::uint64_t advance_belts(size_t t, std::uint32_t scale,
+                              vector<std::uint16_t> &fired);
+
+  // The building of slot as saved, with the progress of belts filled in.
+  json building_json(const Slot &slot) const;
+};
+
+struct Map {
+  // noise levels above which a chunk has ore (about 30% of them) and that
+  // ore is gold rather than iron (about 10% of it)
+  static constexpr std::uint32_t ORE_THRESHOLD = 38680;
+  static constexpr std::uint32_t GOLD_THRESHOLD = 51870;
+
+  // row-major, tile_cols() per row. Null for tiles that are paged out,
+  // which only the non-const accessors load again: const readers see the
+  // resident tiles and skip or peek at the rest.
+  vector<std::shared_ptr<Tile>> tiles;
+  size_t height = 0;
+  size_t width = 0;
+  // ore of every chunk is a function of the seed and its position, so the
+  // map can grow later on
+  std::uint64_t seed = 0;
+  // XOR of Building::hashed_ over all buildings, kept up to date by rehash()
+  std::uint64_t hash_ = 0;
+  // set if the map keeps its regions in files, see page_to()
+  optional<Paging> paging;
+
+  // Regions away from the viewport only update every stride ticks, each of
+  // their buildings doing stride ticks of work at once. Regions with
+  // buildings that items can flow from into a TaskCenter always run at full
+  // rate, so the store and the tasks match a full rate run exactly. The
+  // rest of the map does not, and replays only match at full rate.
+  struct MultiRate {
+    static constexpr std::uint32_t MAX_STRIDE = 10;
+
+    std::uint32_t stride = 1;
+    // chunks in view, regions touching them or next to them run at full rate
+    vec::Vec2<> from;
+    vec::Vec2<> to;
+    // ticks each region has been updated for
+    vector<std::uint64_t> done;
+    // per region: whether it feeds a TaskCenter, see Map::find_feeders()
+    vector<char> feeds;
+    // buildings were placed or removed since feeds was found
+    bool stale = true;
+  };
+  optional<MultiRate> multi_rate;
+  // update() and paging record trace spans while set, see State::traced
+  bool traced = false;
+
+  // What updating a region changed outside of the map.
+  struct Outcome {
+    std::uint64_t hash = 0;
+    Buffer delivered;
+  };
+
+  // Kept by update() from one tick to the next, so that once they have
+  // grown a tick allocates nothing for them. Copies start out empty.
+  struct Scratch {
+    vector<std::uint32_t> scales;
+    vector<Outcome> outcomes;
+    // regions of the phase being run
+    vector<size_t> todo;
+  };
+  Scratch scratch;
+
+  Map() = default;
+  Map(size_t h, size_t w, std::uint64_t seed_) : Map(h, w) {
+    this->seed = seed_;
+    this->generate(0, 0);
   }
+  Map(size_t h, size_t w) : height(h), width(w) {
+    this->tiles.resize(this->tile_rows() * this->tile_cols());
+    for (auto &tile : this->tiles) {
+      tile = std::make_shared<Tile>();
+    }
+  }
+  // Shares every tile with other until either side writes to it.
+  Map(const Map &other)
+      : height(other.height), width(other.width), seed(other.seed),
+        hash_(other.hash_), paging(other.paging),
+        multi_rate(other.multi_rate) {
+    this->share_tiles(other);
+  }
+  Map(Map &&) = default;
+
+  Map &operator=(const Map &other) { return *this = Map(other); }
+  Map &operator=(Map &&) = default;
+
+  // ore id of the chunk at (r, c) in a map generated from seed
+  static std::uint8_t ore_at(std::uint64_t seed, size_t r, size_t c);
+
+  // Fills in the ore of every chunk outside of the first h rows and w
+  // columns, one job per few tiles.
+  void generate(size_t h, size_t w);
 
-  auto &operator[](this auto &&self, vec::Vec2<std::size_t> pos) {
-    return self[pos[0], pos[1]];
+  // Makes tiles refer to the tiles of other, on all workers.
+  void share_tiles(const Map &other);
+
+  // Enlarges the map to h rows and w columns, keeping everything on it. The
+  // new chunks get their ore from the seed. Never shrinks.
+  void grow(size_t h, size_t w);
+
+  size_t tile_rows() const {
+    return (this->height + Tile::SIZE - 1) / Tile::SIZE;
   }
 
-  void update(State &ctx);
+  size_t tile_cols() const {
+    return (this->width + Tile::SIZE - 1) / Tile::SIZE;
+  }
+
+  // index of the tile holding pos and the index of pos inside that tile
+  pair<size_t, size_t> locate(vec::Vec2<> pos) const {
+    if (!this->contains(pos)) {
+      throw std::out_of_range(std::format("{} is outside of the map", pos));
+    }
+    return {pos[0] / Tile::SIZE * this->tile_cols() + pos[1] / Tile::SIZE,
+            pos[0] % Tile::SIZE * Tile::SIZE + pos[1] % Tile::SIZE};
+  }
+
+  vec::Vec2<> tile_origin(size_t t) const {
+    return {t / this->tile_cols() * Tile::SIZE,
+            t % this->tile_cols() * Tile::SIZE};
+  }
+
+  size_t region_cols() const {
+    return (this->tile_cols() + Pager::REGION - 1) / Pager::REGION;
+  }
+
+  size_t regions() const {
+    return (this->tile_rows() + Pager::REGION - 1) / Pager::REGION *
+           this->region_cols();
+  }
+
+  size_t region_of(size_t t) const {
+    auto const cols = this->tile_cols();
+    return t / cols / Pager::REGION * this->region_cols() +
+           t % cols / Pager::REGION;
+  }
+
+  // tiles of region r, row-major
+  vector<size_t> region_tiles(size_t r) const;
+
+  // tiles[t], loading its region first if it is paged out
+  std::shared_ptr<Tile> &resident(size_t t) {
+    auto &tile = this->tiles.at(t);
+    if (this->paging && !tile) {
+      this->fault(this->region_of(t));
+    }
+    return tile;
+  }
+
+  // Whether tile t has buildings, without loading it.
+  bool has_buildings(size_t t) const {
+    if (auto const &tile = this->tiles.at(t); tile) {
+      return tile->buildings > 0;
+    }
+    return this->paged_buildings(t) > 0;
+  }
+
+  // anchors in the page or image tile t would be loaded from
+  size_t paged_buildings(size_t t) const;
+
+  // tile t, null while it is paged out. Never loads anything.
+  const Tile *loaded(size_t t) const { return this->tiles.at(t).get(); }
+
+  // Tile t without loading it: the resident tile, or else a copy read from
+  // where it would be loaded from.
+  std::shared_ptr<const Tile> peek_tile(size_t t) const;
+
+  // peek_tile() for all tiles of region r, in region_tiles() order. A page
+  // is parsed once for all of them, prefer it over peeking tile by tile.
+  vector<std::shared_ptr<const Tile>> peek_region(size_t r) const;
+
+  const Tile &tile(size_t t) { return *this->resident(t); }
+
+  // Tile t, which must be resident. Only maps that are not paged out have
+  // all of them.
+  const Tile &tile(size_t t) const {
+    if (auto const *tile = this->loaded(t); tile) {
+      return *tile;
+    }
+    throw std::logic_error(std::format("tile {} is paged out", t));
+  }
+
+  // Tile t for writing, copied first if another Map still shares it.
+  Tile &tile_mut(size_t t) {
+    auto &tile = this->resident(t);
+    if (this->paging) {
+      this->paging->dirty[t] = 1;
+    }
+    if (tile.use_count() > 1) {
+      tile = std::make_shared<Tile>(*tile);
+    }
+    // the previous co-owners must be done reading before we write
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return *tile;
+  }
+
+  // The readers taking self load the tiles they need when called on a
+  // mutable map, and require them to be resident on a const one.
+
+  const Cell &cell(this auto &self, vec::Vec2<> pos) {
+    auto [t, i] = self.locate(pos);
+    return self.tile(t).cells[i];
+  }
+
+  // The chunk at pos for reading, which unlike operator[] does not unshare
+  // its tile.
+  ConstChunk read(this auto &self, vec::Vec2<> pos) {
+    auto [t, i] = self.locate(pos);
+    auto const &tile = self.tile(t);
+    return {ore_item(tile.cells[i].ore), tile.anchored(i, pos)};
+  }
+
+  ConstChunk operator[](vec::Vec2<std::size_t> pos) const {
+    return this->read(pos);
+  }
+
+  Chunk operator[](vec::Vec2<std::size_t> pos) {
+    auto [t, i] = this->locate(pos);
+    auto const &tile = this->tile_mut(t);
+    return {ore_item(tile.cells[i].ore), tile.anchored(i, pos)};
+  }
+
+  ConstChunk operator[](size_t x, size_t y) const {
+    return (*this)[vec::Vec2<>(x, y)];
+  }
+
+  Chunk operator[](size_t x, size_t y) { return (*this)[vec::Vec2<>(x, y)]; }
+
+  // The chunk at pos without loading its tile if that is still in the image:
+  // the ore comes from there and the building is null, as none of the
+  // buildings of the tile are loaded. Tiles in pages are loaded.
+  ConstChunk peek(vec::Vec2<> pos);
+
+  void set_ore(vec::Vec2<> pos, std::uint8_t ore) {
+    auto [t, i] = this->locate(pos);
+    this->tile_mut(t).cells[i].ore = ore;
+  }
+
+  bool contains(vec::Vec2<> pos) const {
+    return pos[0] < this->height && pos[1] < this->width;
+  }
+
+  Occupant occupant(this auto &self, vec::Vec2<> pos) {
+    auto [t, i] = self.locate(pos);
+    auto const &tile = self.tile(t);
+    auto const s = tile.cells[i].slot;
+    if (s == 0) {
+      return {};
+    }
+    auto const &slot = tile.slots[s - 1];
+    return {
+        .owner = slot.owner,
+        .dr = static_cast<std::int16_t>(pos[0] - slot.anchor[0]),
+        .dc = static_cast<std::int16_t>(pos[1] - slot.anchor[1]),
+    };
+  }
+
+  // Anchor chunk of the building covering pos, if any.
+  optional<vec::Vec2<>> anchor_of(this auto &self, vec::Vec2<> pos) {
+    if (!self.contains(pos)) {
+      return nullopt;
+    }
+    auto [t, i] = self.locate(pos);
+    auto const &tile = self.tile(t);
+    if (auto const s = tile.cells[i].slot; s != 0) {
+      return tile.slots[s - 1].anchor;
+    }
+    return nullopt;
+  }
+
+  // Whether a building anchored at pos and spanning rect fits on free chunks.
+  bool can_place(this auto &self, vec::Vec2<> pos, vec::Vec2<ssize_t> rect) {
+    return std::ranges::all_of(rect_iter(rect), [&](auto const rc) {
+      auto p = pos + vec::Vec2<ssize_t>(std::get<0>(rc), std::get<1>(rc));
+      return self.contains(p) && self.cell(p).slot == 0;
+    });
+  }
+
+  // Covers rect with the building anchored at pos and hands it to the slot
+  // in the anchor's tile.
+  void occupy(vec::Vec2<> pos, vec::Vec2<ssize_t> rect,
+              unique_ptr<Building> &&building);
+
+  // Uncovers rect, destroying the building anchored at pos.
+  void vacate(vec::Vec2<> pos, vec::Vec2<ssize_t> rect);
+
+  // Refreshes the contribution of the building anchored at pos to hash_.
+  // Must be called whenever its state may have changed, which is cheap as
+  // buildings keep the digests of their buffers up to date.
+  void rehash(vec::Vec2<> pos) { this->rehash(pos, this->hash_); }
+
+  // rehash(), applying the change to hash instead of hash_
+  void rehash(vec::Vec2<> pos, std::uint64_t &hash) {
+    auto *b = (*this)[pos].building;
+    hash ^= b->hashed_;
+    b->hashed_ = hash::combine(pos[0] * this->width + pos[1], b->digest());
+    hash ^= b->hashed_;
+  }
+
+  // Updates the busy flag of the belt anchored at pos after its buffer
+  // changed, if there is a belt.
+  void refresh_belt(vec::Vec2<> pos) {
+    auto [t, i] = this->locate(pos);
+    if (!this->tile(t).belts.at[i]) {
+      return;
+    }
+    auto &tile = this->tile_mut(t);
+    auto const *belt = static_cast<const Belt *>(tile.anchored(i, pos));
+    tile.belts.busy[*tile.belts.find(i)] = !belt->buffer.empty();
+  }
+
+  // Recomputes hash_ from every building, for loading and for checking the
+  // incremental updates. Returns the new value.
+  std::uint64_t rebuild_hash();
+
+  // Places every machine of the batch or none of them. Fails if a footprint
+  // leaves the map, covers an occupied chunk or overlaps another placement of
+  // the same batch.
+  optional<ChangeSet> place(vector<Placement> &&batch);
+
+  // Removes the building anchored at pos and returns the chunks it covered.
+  vector<vec::Vec2<>> remove(vec::Vec2<> pos);
+
+  // Keeps the map in region files under dir from now on, with about budget
+  // bytes of tiles resident. A map loaded from an image keeps loading the
+  // regions it has not written from there. Saves then write the regions
+  // there and only an index into the save itself.
+  void page_to(std::filesystem::path dir, size_t budget);
+  void page_to(std::shared_ptr<Pager> pager);
+
+  // Tile t as it is in the image. A damaged tile is rejected and replaced
+  // by an empty one.
+  Tile image_tile(size_t t) const;
+
+  // The tiles of region r as they are in its page, or else in the image.
+  vector<Tile> load_region(size_t r) const;
+
+  // Loads region r from its page.
+  void fault(size_t r);
+
+  // Whether a tile of region r changed since the region was last written.
+  bool region_dirty(size_t r) const;
+
+  // Faults in every tile the buildings of the regions in todo can reach, so
+  // that updating them in parallel loads nothing.
+  void prefault(std::span<const size_t> todo);
+
+  // Writes the tiles of region r as they are now to a new page.
+  std::shared_ptr<Page> write_page(size_t r) const;
+
+  // Writes region r to a new page, which becomes its backing file.
+  void write_region(size_t r);
+
+  // Pages out the least recently used regions until the resident tiles fit
+  // into the budget. Run by update() after every tick, when nothing refers
+  // into the tiles.
+  void page_out();
+
+  size_t resident_bytes() const;
+
+  // Writes every changed region to the page it is then loaded from.
+  void flush();
+
+  // Writes an index of all regions into j, along with the regions changed
+  // since the last flush(), which stay changed for this map.
+  void save_pages(json &j) const;
+
+  // Reads an index written by save_pages(), no region is loaded yet.
+  void load_pages(const json &j);
+
+  // Updates every building, returns what reached the task centers.
+  Buffer update(State &ctx);
+
+  // Ticks region r stands for in the update of tick, 0 if it skips it.
+  std::uint32_t region_scale(size_t r, std::uint64_t tick);
+
+  // Marks the regions of every building that can output into a TaskCenter,
+  // directly or through other buildings, in MultiRate::feeds.
+  void find_feeders(State &ctx);
 };
 
-NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Map, chunks, height, width);
+void to_json(json &j, const Tile &p);
+
+void from_json(const json &j, Tile &p);
+
+void to_json(json &j, const Map &p);
+
+void from_json(const json &j, Map &p);
 
 struct MapAccessor {
   vec::Vec2<size_t> pos;
   std::reference_wrapper<Map> map;
   std::reference_wrapper<State> ctx;
-
-  MapAccessor(vec::Vec2<size_t> p, Map &m, State &ctx_)
-      : pos(p), map(m), ctx(ctx_) {}
-
-  auto &current_chunk(this auto &&self) {
-    return self.map.get()[self.pos[0], self.pos[1]];
+  // ticks this update stands for, more than 1 for regions ticked at a
+  // coarse rate, see Map::MultiRate
+  std::uint32_t scale = 1;
+  // set while regions update in parallel, items for the task center go
+  // here instead of State::take_item()
+  Buffer *delivered = nullptr;
+  // set with delivered, changes to Map::hash_ are XORed into it instead
+  std::uint64_t *hash = nullptr;
+  // counts the outputs a neighbour accepted while set, see Heatmap
+  std::uint32_t *transfers = nullptr;
+
+  MapAccessor(vec::Vec2<size_t> p, Map &m, State &ctx_,
+              std::uint32_t scale_ = 1, Buffer *delivered_ = nullptr,
+              std::uint64_t *hash_ = nullptr,
+              std::uint32_t *transfers_ = nullptr)
+      : pos(p), map(m), ctx(ctx_), scale(scale_), delivered(delivered_),
+        hash(hash_), transfers(transfers_) {}
+
+  ConstChunk current_chunk() const {
+    return this->map.get().read(this->pos);
   }
 
-  auto &get_chunk(this auto &&self, vec::Vec2<ssize_t> r) {
-    return self.map.get()[self.relative_pos_by(r)];
-  }
+  Occupant occupant() const { return this->map.get().occupant(this->pos); }
 
-  MapAccessor relocate(vec::Vec2<> p) const {
-    return {p, this->map, this->ctx};
+  // Refreshes what the building anchored at the current chunk adds to the
+  // map hash. Buildings call it whenever they change their own state.
+  void rehash() const {
+    if (this->hash) {
+      this->map.get().rehash(this->pos, *this->hash);
+    } else {
+      this->map.get().rehash(this->pos);
+    }
   }
 
-  std::pair<Chunk &, MapAccessor> get_chunk_and_accessor(this auto &&self,
-                                                         vec::Vec2<ssize_t> r) {
-    return {self.map.get()[self.relative_pos_by(r)],
-            MapAccessor(self.pos + r, self.map, self.ctx)};
+  MapAccessor relocate(vec::Vec2<> p) const {
+    return {p, this->map, this->ctx, this->scale, this->delivered, this->hash,
+            this->transfers};
   }
 
   // Returns r + current position .
@@ -138,40 +655,31 @@ struct MapAccessor {
     return this->pos + r;
   }
 
-  // returns modified chunks
+  vector<vec::Vec2<>> footprint(vec::Vec2<ssize_t> rect) const {
+    return rect_iter(rect) | std::views::transform([this](auto const rc) {
+             return this->relative_pos_by(
+                 {std::get<0>(rc), std::get<1>(rc)});
+           }) |
+           std::ranges::to<vector>();
+  }
+
+  // Places machine with its anchor at the current chunk and returns the
+  // chunks it covers, anchor first. If the footprint leaves the map or
+  // overlaps another building nothing is placed and the result is empty.
   vector<vec::Vec2<>>
   add_machine(std::unique_ptr<shapezx::Building> &&machine) {
-    auto &m = this->map.get();
-    auto rect = machine->relative_rect();
-    vector<vec::Vec2<>> res{this->pos};
-    if (!m[this->pos].building) {
-      for (auto [r, c] : rect_iter(rect) | std::views::drop(1)) {
-        auto [chk, acc] = this->get_chunk_and_accessor({r, c});
-        res.push_back(acc.pos);
-        if (chk.building) {
-          throw std::exception();
-        }
-        chk.building = std::make_unique<PlaceHolder>(
-            machine->info().id, machine->info().direction, this->pos);
-      }
-
-      m[pos].building = std::make_optional(std::move(machine));
+    vector<Placement> batch;
+    batch.emplace_back(this->pos, std::move(machine));
+    auto changes = this->map.get().place(std::move(batch));
+    if (!changes) {
+      return {};
     }
-
-    return res;
+    return std::move(changes->placed.front().chunks);
   }
 
+  // current chunk must be the anchor of a building
   vector<vec::Vec2<>> remove_machine() {
-    auto &machine = this->current_chunk().building.value();
-    auto rect = machine->relative_rect();
-    vector<vec::Vec2<>> res;
-    for (auto [r, c] : rect_iter(rect)) {
-      auto [chk, acc] = this->get_chunk_and_accessor({r, c});
-      res.push_back(acc.pos);
-      chk.building.reset();
-    }
-
-    return res;
+    return this->map.get().remove(this->pos);
   }
 };
 
@@ -190,7 +698,8 @@ NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Price, center_, map_, value_)
 struct Global {
   static Global load(const std::string &p) noexcept;
 
-  std::uint32_t value = 0;
+  // 64 bits, as batch runs credit the coins of many saves at once
+  std::uint64_t value = 0;
   std::uint32_t value_factor = 1;
   vec::Vec2<> center_size = {2, 2};
 
@@ -203,6 +712,10 @@ struct Global {
 
   std::vector<std::string> saves;
 
+  // Spends value on an offer of the store, returns false if it is not
+  // affordable.
+  bool purchase(Purchase::Offer offer);
+
   std::string &create_save() {
     auto n = this->saves.size();
     return saves.emplace_back(std::format("./saves/{}.json", n));
@@ -255,6 +768,26 @@ struct IdGenerator {
 
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(IdGenerator, cur);
 
+// Buildings relative to an origin chunk, for pasting layouts saved earlier.
+struct Blueprint {
+  struct Entry {
+    BuildingType type;
+    Direction direction;
+    vec::Vec2<ssize_t> offset;
+  };
+
+  vector<Entry> entries;
+
+  // Copies the buildings anchored in the rectangle [from, to).
+  static Blueprint capture(Map &map, vec::Vec2<> from, vec::Vec2<> to);
+
+  // The action pasting the blueprint with its origin at origin.
+  Place paste_at(vec::Vec2<> origin) const;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Blueprint::Entry, type, direction, offset);
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Blueprint, entries);
+
 struct State {
   Map map;
   Efficiency eff;
@@ -262,6 +795,28 @@ struct State {
   std::uint32_t value = 0;
   vector<Task> tasks;
   IdGenerator id_;
+  // number of updates since the game was created
+  std::uint64_t tick = 0;
+
+  // unfinished tasks by the items they still wait for, see index_tasks()
+  std::unordered_map<Item, vector<size_t>> task_index_;
+  // XOR of hash::mix(i) over completed tasks i
+  std::uint64_t completed_hash_ = 0;
+  // fired from take_item() as soon as a task is completed
+  std::function<void()> on_task_complete;
+  // fired from execute() before the command is applied
+  std::function<void(const Command &)> on_command;
+  // hardware counters of update() are collected while this is set
+  std::shared_ptr<Profile> profile;
+  // counted into while set, see Metrics::count_buildings() for attaching it
+  std::shared_ptr<Metrics> metrics;
+  // sampled into by update() while set
+  std::shared_ptr<Heatmap> heatmap;
+  // regions are updated on it while set, on Jobs::shared() otherwise
+  Jobs *jobs = nullptr;
+  // Ticks are recorded into the trace, and slow ones dump it, while set.
+  // Only the live game and the daemon set it.
+  bool traced = false;
 
   State() = default;
   State(size_t height, size_t width, size_t seed) : map(height, width, seed) {}
@@ -271,35 +826,124 @@ struct State {
 
   State(Map &&map_) : map(std::move(map_)) {}
 
+  // Copy sharing every map tile with this state until either side writes to
+  // it. Callbacks are not copied.
+  State snapshot() const {
+    auto res = *this;
+    res.on_task_complete = nullptr;
+    res.on_command = nullptr;
+    res.profile = nullptr;
+    res.metrics = nullptr;
+    res.heatmap = nullptr;
+    res.jobs = nullptr;
+    res.traced = false;
+    return res;
+  }
+
   MapAccessor create_accessor_at(shapezx::vec::Vec2<std::size_t> pos) {
     return {pos, this->map, *this};
   }
 
-  void update(std::function<void()> on_task_complete, Global &global_state) {
-    // std::cout << "updating\n";
-    this->map.update(*this);
-    global_state.value += this->value * global_state.value_factor;
-    this->value = 0;
-
-    for (auto &task : this->tasks) {
-      if (task.update(*this)) {
-        on_task_complete();
+  void update(Global &global_state) {
+    auto const begin = trace::now();
+    auto *profile = this->profile.get();
+    Buffer delivered;
+    {
+      Profile::Scope scope(profile, Profile::MapUpdate);
+      this->map.traced = this->traced;
+      delivered = this->map.update(*this);
+    }
+    {
+      Profile::Scope scope(profile, Profile::Tasks);
+      for (auto const &[item, num] : delivered.items) {
+        this->take_item(item, num);
+        if (this->metrics) {
+          this->metrics->deliver(item, num);
+        }
       }
     }
+    {
+      Profile::Scope scope(profile, Profile::Value);
+      auto const gained =
+          std::uint64_t(this->value) * global_state.value_factor;
+      global_state.value += gained;
+      this->value = 0;
+      if (this->metrics) {
+        this->metrics->value.fetch_add(gained, std::memory_order_relaxed);
+      }
+    }
+    this->tick += 1;
+    if (profile) {
+      profile->ticks += 1;
+    }
+    if (this->metrics) {
+      this->metrics->tick(trace::now() - begin);
+    }
+    if (this->traced) {
+      trace::end_tick(this->tick - 1, begin);
+    }
   }
 
-  void take_item(const Item &item, size_t num) {
-    std::cout << std::format("take {} {}\n", num, item.name);
-    this->store.increase(item, num);
-    this->value += item.value * num;
+  // Applies a player action. Purchases only concern Global and are merely
+  // passed to on_command.
+  ChangeSet execute(const Action &action);
+
+  // Digest of everything that evolves while the game runs, used to check
+  // that a replay matches the recording. The map part is maintained as
+  // buildings change, so this is cheap enough to call every tick.
+  std::uint64_t hash() const {
+    return hash::combine(this->map.hash_ ^ this->completed_hash_,
+                         this->store.digest(), this->value, this->id_.cur,
+                         this->tick, this->eff.miner, this->eff.belt,
+                         this->eff.cutter);
   }
 
-  void add_task(Task &&task) { this->tasks.push_back(std::move(task)); }
+  // hash() computed from scratch, down to the digests of the buffers, to
+  // verify the incremental one
+  std::uint64_t recompute_hash();
 
-  void save_to(const std::string &) const;
+  void take_item(const Item &item, size_t num);
+
+  void add_task(Task &&task) {
+    this->tasks.push_back(std::move(task));
+    this->index_task(this->tasks.size() - 1);
+  }
+
+  // Rebuilds task_index_ from tasks, e.g. after loading.
+  void index_tasks() {
+    this->task_index_.clear();
+    this->completed_hash_ = 0;
+    for (size_t i = 0; i < this->tasks.size(); ++i) {
+      this->index_task(i);
+    }
+  }
+
+  // Not const, as a paged map first writes its changed regions.
+  void save_to(const std::string &);
+
+  void index_task(size_t i);
+  void complete_task(size_t i);
 };
 
-NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(State, map, eff, store, value, tasks, id_);
+inline void to_json(nlohmann::json &j, const State &s) {
+  j = {
+      {"map", s.map},     {"eff", s.eff},     {"store", s.store},
+      {"value", s.value}, {"tasks", s.tasks}, {"id_", s.id_},
+      {"tick", s.tick},
+  };
+}
+
+inline void from_json(const nlohmann::json &j, State &s) {
+  trace::Span span("load state");
+  j.at("map").get_to(s.map);
+  j.at("eff").get_to(s.eff);
+  j.at("store").get_to(s.store);
+  j.at("value").get_to(s.value);
+  j.at("tasks").get_to(s.tasks);
+  j.at("id_").get_to(s.id_);
+  s.tick = j.value("tick", std::uint64_t(0));
+  s.index_tasks();
+}
 
 } // namespace shapezx
 
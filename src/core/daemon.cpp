@@ -0,0 +1,267 @@
+#include "daemon.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <variant>
+
+namespace shapezx {
+
+namespace {
+
+std::optional<sockaddr_un> address_of(const std::string &path) {
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return std::nullopt;
+  }
+  addr.sun_family = AF_UNIX;
+  path.copy(addr.sun_path, path.size());
+  return addr;
+}
+
+bool write_line(int fd, const json &j) {
+  auto line = j.dump() + "\n";
+  for (std::size_t done = 0; done < line.size();) {
+    auto n = ::send(fd, line.data() + done, line.size() - done, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+} // namespace
+
+Daemon::~Daemon() {
+  for (auto const &c : this->clients) {
+    close(c.fd);
+  }
+  if (this->listener >= 0) {
+    close(this->listener);
+  }
+}
+
+bool Daemon::open(const std::string &socket_path,
+                  const std::string &view_name) {
+  this->view = SharedView::create(view_name, this->state.map);
+  auto addr = address_of(socket_path);
+  if (!this->view || !addr) {
+    return false;
+  }
+
+  this->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (this->listener < 0) {
+    return false;
+  }
+  // left over by a daemon that did not shut down
+  std::filesystem::remove(socket_path);
+  if (bind(this->listener, reinterpret_cast<const sockaddr *>(&*addr),
+           sizeof(*addr)) != 0 ||
+      listen(this->listener, 16) != 0) {
+    return false;
+  }
+  this->view->publish(this->state, this->global);
+  return true;
+}
+
+void Daemon::run(const std::atomic<bool> &stop) {
+  using Clock = std::chrono::steady_clock;
+  auto next = Clock::now() + this->interval;
+
+  while (!stop) {
+    // wait for clients until the next tick is due
+    std::vector<pollfd> fds{{this->listener, POLLIN, 0}};
+    for (auto const &c : this->clients) {
+      fds.push_back({c.fd, POLLIN, 0});
+    }
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+        next - Clock::now());
+    if (poll(fds.data(), fds.size(), std::max(wait.count(), 0L)) > 0) {
+      if (fds[0].revents & POLLIN) {
+        this->accept();
+      }
+      // backwards, so that dropping a client keeps the other indices
+      for (auto i = fds.size() - 1; i > 0; --i) {
+        if (fds[i].revents && !this->receive(i - 1)) {
+          close(this->clients[i - 1].fd);
+          this->clients.erase(this->clients.begin() + (i - 1));
+        }
+      }
+    }
+
+    if (Clock::now() >= next) {
+      this->state.update(this->global);
+      this->log.record_tick(this->state);
+      this->view->publish(this->state, this->global);
+      next += this->interval;
+    }
+  }
+  this->save();
+}
+
+void Daemon::save() {
+  this->state.save_to(this->save_path);
+  this->global.save_to(this->global_path);
+  this->log.save_to(std::filesystem::path(this->save_path)
+                        .replace_extension(".log.json")
+                        .string());
+}
+
+void Daemon::accept() {
+  for (int fd; (fd = ::accept4(this->listener, nullptr, nullptr,
+                               SOCK_NONBLOCK)) >= 0;) {
+    if (write_line(fd, {{"view", this->view->name},
+                        {"tick", this->state.tick}})) {
+      this->clients.push_back({fd, {}});
+    } else {
+      close(fd);
+    }
+  }
+}
+
+bool Daemon::receive(std::size_t i) {
+  auto &c = this->clients[i];
+  char buf[4096];
+  for (;;) {
+    auto n = ::recv(c.fd, buf, sizeof(buf), 0);
+    if (n == 0) {
+      return false;
+    }
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    c.pending.append(buf, n);
+    for (auto end = c.pending.find('\n'); end != std::string::npos;
+         end = c.pending.find('\n')) {
+      auto line = c.pending.substr(0, end);
+      c.pending.erase(0, end + 1);
+      if (!write_line(c.fd, this->handle(line))) {
+        return false;
+      }
+    }
+  }
+}
+
+json Daemon::handle(const std::string &line) {
+  auto ok = true;
+  try {
+    auto j = json::parse(line);
+    if (j == "save") {
+      this->save();
+    } else if (j.is_object() && j.contains("trace")) {
+      ok = trace::dump(j.at("trace").get<std::string>());
+    } else {
+      auto cmd = j.get<Command>();
+      cmd.tick = this->state.tick;
+      this->log.record(cmd);
+      if (auto p = std::get_if<Purchase>(&cmd.action); p) {
+        ok = this->global.purchase(p->offer);
+      } else {
+        // placing and removing fail if they change nothing
+        auto changes = this->state.execute(cmd.action);
+        if (std::holds_alternative<Place>(cmd.action)) {
+          ok = !changes.placed.empty();
+        } else if (std::holds_alternative<Remove>(cmd.action)) {
+          ok = !changes.removed.empty();
+        }
+      }
+    }
+  } catch (const std::exception &e) {
+    std::cerr << std::format("bad request {}: {}\n", line, e.what());
+    ok = false;
+  }
+  return {{"ok", ok}, {"tick", this->state.tick}};
+}
+
+Client::~Client() {
+  if (this->fd >= 0) {
+    close(this->fd);
+  }
+}
+
+std::unique_ptr<Client> Client::connect(const std::string &socket_path) {
+  auto addr = address_of(socket_path);
+  if (!addr) {
+    return nullptr;
+  }
+  auto res = std::make_unique<Client>();
+  res->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (res->fd < 0 ||
+      ::connect(res->fd, reinterpret_cast<const sockaddr *>(&*addr),
+                sizeof(*addr)) != 0) {
+    return nullptr;
+  }
+  auto hello = res->read_line();
+  if (!hello || !hello->contains("view")) {
+    return nullptr;
+  }
+  res->view_name = hello->at("view").get<std::string>();
+  return res;
+}
+
+std::optional<std::uint64_t> Client::send(const Action &action) {
+  auto res = this->request(Command{0, action});
+  if (!res || !res->value("ok", false)) {
+    return std::nullopt;
+  }
+  return res->at("tick").get<std::uint64_t>();
+}
+
+bool Client::save() {
+  auto res = this->request("save");
+  return res && res->value("ok", false);
+}
+
+bool Client::dump_trace(const std::string &path) {
+  auto res = this->request({{"trace", path}});
+  return res && res->value("ok", false);
+}
+
+bool Client::closed(std::chrono::milliseconds timeout) {
+  pollfd fd{this->fd, POLLIN, 0};
+  if (poll(&fd, 1, timeout.count()) <= 0) {
+    return false;
+  }
+  if (fd.revents & (POLLHUP | POLLERR)) {
+    return true;
+  }
+  // the daemon only writes in reply, so anything readable is its end
+  char c;
+  return ::recv(this->fd, &c, 1, MSG_PEEK) <= 0;
+}
+
+std::optional<json> Client::request(const json &j) {
+  if (!write_line(this->fd, j)) {
+    return std::nullopt;
+  }
+  return this->read_line();
+}
+
+std::optional<json> Client::read_line() {
+  char buf[4096];
+  auto end = this->pending.find('\n');
+  while (end == std::string::npos) {
+    auto n = ::recv(this->fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      return std::nullopt;
+    }
+    this->pending.append(buf, n);
+    end = this->pending.find('\n');
+  }
+  auto line = this->pending.substr(0, end);
+  this->pending.erase(0, end + 1);
+  if (auto j = json::parse(line, nullptr, false); !j.is_discarded()) {
+    return j;
+  }
+  return std::nullopt;
+}
+
+} // namespace shapezx
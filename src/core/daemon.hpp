@@ -0,0 +1,111 @@
+#ifndef SHAPEZX_CORE_DAEMON
+#define SHAPEZX_CORE_DAEMON
+
+#include "command.hpp"
+#include "core.hpp"
+#include "replay.hpp"
+#include "shared_view.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace shapezx {
+
+using nlohmann::json;
+
+// Runs a game on its own, publishing it to a SharedView after every tick
+// and taking actions from clients over a Unix socket.
+//
+// The protocol is one JSON value per line. On connecting, a client gets
+// {"view": <shared memory name>, "tick": <tick>}. It then sends actions as
+// commands (the tick is ignored, actions are applied before the next tick),
+// "save" or {"trace": <path>} to dump the daemon's trace::recent() there,
+// and gets {"ok": <bool>, "tick": <tick>} for each line. Places and removes
+// that change nothing are not ok.
+struct Daemon {
+  struct Connection {
+    int fd;
+    std::string pending;
+  };
+
+  State state;
+  Global global;
+  std::string save_path;
+  std::string global_path;
+  // everything since the daemon started, written next to the save
+  CommandLog log;
+  std::unique_ptr<SharedView> view;
+  int listener = -1;
+  std::vector<Connection> clients;
+  std::chrono::milliseconds interval{50};
+
+  Daemon(State &&state_, const Global &global_, const std::string &save,
+         const std::string &global_path_)
+      : state(std::move(state_)), global(global_), save_path(save),
+        global_path(global_path_), log(this->state, this->global) {
+    this->state.traced = true;
+  }
+  Daemon(const Daemon &) = delete;
+  ~Daemon();
+
+  // Creates the view and starts listening at socket_path, false if either
+  // fails.
+  bool open(const std::string &socket_path, const std::string &view_name);
+
+  // Ticks until stop is set, then saves.
+  void run(const std::atomic<bool> &stop);
+
+  void save();
+
+private:
+  void accept();
+
+  // Reads what client i sent, false once it has disconnected.
+  bool receive(std::size_t i);
+
+  json handle(const std::string &line);
+};
+
+// A connection to a Daemon.
+struct Client {
+  int fd = -1;
+  std::string pending;
+  // name of the daemon's SharedView
+  std::string view_name;
+
+  Client() = default;
+  Client(const Client &) = delete;
+  ~Client();
+
+  static std::unique_ptr<Client> connect(const std::string &socket_path);
+
+  // Sends an action, the tick before which it is applied, nullopt if the
+  // daemon refused it or is gone.
+  std::optional<std::uint64_t> send(const Action &action);
+
+  bool save();
+
+  // Has the daemon write its recent trace events to path, which is relative
+  // to the daemon's working directory.
+  bool dump_trace(const std::string &path);
+
+  // Waits up to timeout for the daemon to close the connection, true once
+  // it has.
+  bool closed(std::chrono::milliseconds timeout);
+
+private:
+  std::optional<json> request(const json &j);
+
+  std::optional<json> read_line();
+};
+
+} // namespace shapezx
+
+#endif
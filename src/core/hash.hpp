@@ -0,0 +1,40 @@
+#ifndef SHAPEZX_CORE_HASH
+#define SHAPEZX_CORE_HASH
+
+#include <cstdint>
+#include <string_view>
+
+namespace shapezx::hash {
+
+using std::uint64_t;
+
+// splitmix64 finalizer
+constexpr uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+constexpr uint64_t combine(uint64_t seed, uint64_t v) {
+  return mix(seed ^ mix(v));
+}
+
+template <typename... Ts>
+constexpr uint64_t combine(uint64_t seed, uint64_t v, Ts... rest) {
+  return combine(combine(seed, v), rest...);
+}
+
+// FNV-1a, stable across platforms unlike std::hash
+constexpr uint64_t of(std::string_view s) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (auto c : s) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+} // namespace shapezx::hash
+
+#endif
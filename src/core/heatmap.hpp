@@ -0,0 +1,106 @@
+#ifndef SHAPEZX_CORE_HEATMAP
+#define SHAPEZX_CORE_HEATMAP
+
+#include "../vec/vec.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace shapezx {
+
+// Sampled update cost of the buildings by anchor, for finding the ones that
+// make a map slow. Every SAMPLE_EVERY-th tick Map::update() times each
+// building and counts the items it hands on, all other ticks cost nothing.
+// Samples are averaged with a weight halving every HALF_LIFE samples: a
+// cell keeps the weighted sums and the sum of the weights, decayed when it
+// is next sampled, and reads their ratio. A building costing the same on
+// every update reads exactly that from its first sample on.
+struct Heatmap {
+  static constexpr std::uint64_t SAMPLE_EVERY = 16;
+  static constexpr double HALF_LIFE = 8;
+
+  struct Cell {
+    // weighted sums of the ns per update and of the outputs accepted by a
+    // neighbour per update
+    float cost = 0;
+    float transfers = 0;
+    // sum of the weights, 0 if never sampled
+    float weight = 0;
+    // sample the sums are as of
+    std::uint64_t sample = 0;
+  };
+
+  // what a cell reads
+  struct Average {
+    // ns per update
+    float cost = 0;
+    // outputs accepted by a neighbour per update
+    float transfers = 0;
+  };
+
+  std::size_t height = 0;
+  std::size_t width = 0;
+  std::vector<Cell> cells;
+
+  Heatmap() = default;
+  Heatmap(std::size_t height_, std::size_t width_)
+      : height(height_), width(width_), cells(height_ * width_) {}
+
+  static bool sampling(std::uint64_t tick) {
+    return tick % SAMPLE_EVERY == 0;
+  }
+
+  static std::uint64_t sample_of(std::uint64_t tick) {
+    return tick / SAMPLE_EVERY;
+  }
+
+  // weight of what was sampled n samples ago
+  static float decay(std::uint64_t n) {
+    return float(std::exp2(-double(n) / HALF_LIFE));
+  }
+
+  Average at(vec::Vec2<> pos) const {
+    auto const &cell = this->cells[pos[0] * this->width + pos[1]];
+    if (cell.weight <= 0) {
+      return {};
+    }
+    return {cell.cost / cell.weight, cell.transfers / cell.weight};
+  }
+
+  // Only called for anchors within one region per thread, so regions
+  // updating in parallel never share a cell.
+  void add(vec::Vec2<> pos, std::uint64_t tick, std::uint64_t ns,
+           std::uint32_t transfers) {
+    auto &cell = this->cells[pos[0] * this->width + pos[1]];
+    auto const now = sample_of(tick);
+    auto const d = decay(now - std::min(cell.sample, now));
+    cell.cost = cell.cost * d + float(ns);
+    cell.transfers = cell.transfers * d + float(transfers);
+    cell.weight = cell.weight * d + 1;
+    cell.sample = now;
+  }
+
+  // Forgets pos, e.g. once its building is gone.
+  void clear(vec::Vec2<> pos) {
+    if (pos[0] < this->height && pos[1] < this->width) {
+      this->cells[pos[0] * this->width + pos[1]] = {};
+    }
+  }
+
+  // cost of the most expensive cell
+  float hottest() const {
+    float res = 0;
+    for (std::size_t i = 0; i < this->cells.size(); ++i) {
+      auto pos = vec::Vec2<>(i / this->width, i % this->width);
+      res = std::max(res, this->at(pos).cost);
+    }
+    return res;
+  }
+};
+
+} // namespace shapezx
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef SHAPEZX_CORE_HISTOGRAM
+#define SHAPEZX_CORE_HISTOGRAM
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace shapezx {
+
+// Log-linear histogram after HdrHistogram. Values below 2 * SUB are counted
+// exactly, larger ones in buckets 1/SUB of their magnitude wide, so
+// percentiles are off by at most 3%. Recording is a few relaxed atomic
+// operations and may happen on any thread, so it is left on.
+struct Histogram {
+  static constexpr unsigned SUB_BITS = 5;
+  static constexpr std::size_t SUB = std::size_t(1) << SUB_BITS;
+  static constexpr std::size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+  std::array<std::atomic<std::uint64_t>, BUCKETS> counts{};
+  std::atomic<std::uint64_t> total = 0;
+  std::atomic<std::uint64_t> max = 0;
+
+  static std::size_t bucket(std::uint64_t v) {
+    if (v < SUB) {
+      return v;
+    }
+    // the top SUB_BITS + 1 bits of v pick the bucket
+    auto const shift = unsigned(std::bit_width(v)) - SUB_BITS - 1;
+    return (shift + 1) * SUB + ((v >> shift) - SUB);
+  }
+
+  // largest value counted in bucket b
+  static std::uint64_t highest(std::size_t b) {
+    if (b < SUB) {
+      return b;
+    }
+    auto const shift = b / SUB - 1;
+    auto const top = std::uint64_t(b % SUB + SUB);
+    // wraps around to the largest value for the last bucket
+    return ((top + 1) << shift) - 1;
+  }
+
+  void record(std::uint64_t v) {
+    this->counts[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    this->total.fetch_add(1, std::memory_order_relaxed);
+    auto m = this->max.load(std::memory_order_relaxed);
+    while (v > m && !this->max.compare_exchange_weak(
+                        m, v, std::memory_order_relaxed)) {
+    }
+  }
+
+  // The least value that q of the recorded values do not exceed, 0 if
+  // nothing was recorded.
+  std::uint64_t percentile(double q) const {
+    auto const n = this->total.load(std::memory_order_relaxed);
+    if (n == 0) {
+      return 0;
+    }
+    auto const target =
+        std::max<std::uint64_t>(std::uint64_t(std::ceil(q * n)), 1);
+    std::uint64_t seen = 0;
+    for (std::size_t b = 0; b < BUCKETS; ++b) {
+      seen += this->counts[b].load(std::memory_order_relaxed);
+      if (seen >= target) {
+        return std::min(highest(b),
+                        this->max.load(std::memory_order_relaxed));
+      }
+    }
+    return this->max.load(std::memory_order_relaxed);
+  }
+
+  // Values recorded meanwhile may be lost.
+  void reset() {
+    for (auto &c : this->counts) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    this->total.store(0, std::memory_order_relaxed);
+    this->max.store(0, std::memory_order_relaxed);
+  }
+};
+
+} // namespace shapezx
+
+#endif
@@ -0,0 +1,258 @@
+#include "image.hpp"
+#include "machine.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace shapezx {
+
+namespace {
+
+// Whether n records of size bytes from offset on lie within the image.
+bool fits(const Image &image, std::uint64_t offset, std::uint64_t n,
+          std::size_t size) {
+  return offset <= image.size && n <= (image.size - offset) / size;
+}
+
+template <typename T> T read_at(const Image &image, std::uint64_t offset) {
+  if (!fits(image, offset, 1, sizeof(T))) {
+    throw std::out_of_range("truncated image");
+  }
+  T res;
+  std::memcpy(&res, image.data + offset, sizeof(T));
+  return res;
+}
+
+// Growing file contents, every record starts 8-byte aligned.
+struct Writer {
+  std::vector<std::uint8_t> buf;
+
+  std::uint64_t reserve(std::size_t n) {
+    auto offset = this->buf.size();
+    this->buf.resize((offset + n + 7) / 8 * 8);
+    return offset;
+  }
+
+  template <typename T> void put(std::uint64_t offset, const T &v) {
+    std::memcpy(this->buf.data() + offset, &v, sizeof(T));
+  }
+
+  std::uint64_t append(const std::uint8_t *p, std::size_t n) {
+    auto offset = this->reserve(n);
+    std::memcpy(this->buf.data() + offset, p, n);
+    return offset;
+  }
+};
+
+} // namespace
+
+Image::~Image() {
+  if (this->data) {
+    munmap(const_cast<std::uint8_t *>(this->data), this->size);
+  }
+}
+
+std::shared_ptr<const Image> Image::open(const std::string &p) {
+  auto fd = ::open(p.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(Header)) {
+    close(fd);
+    return nullptr;
+  }
+
+  auto *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps the file alive
+  close(fd);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  // tiles are read in no particular order
+  madvise(data, st.st_size, MADV_RANDOM);
+
+  auto res = std::make_shared<Image>();
+  res->data = static_cast<const std::uint8_t *>(data);
+  res->size = st.st_size;
+  res->header = read_at<Header>(*res, 0);
+  if (res->header.magic != MAGIC || res->header.version != VERSION ||
+      res->header.tile_size != Tile::SIZE) {
+    return nullptr;
+  }
+
+  auto const &h = res->header;
+  auto const tiles = (h.height + Tile::SIZE - 1) / Tile::SIZE *
+                     ((h.width + Tile::SIZE - 1) / Tile::SIZE);
+  if (h.tiles != tiles ||
+      !fits(*res, h.tile_table, h.tiles, sizeof(TileRecord)) ||
+      !fits(*res, h.counts, h.tiles, sizeof(std::uint32_t)) ||
+      !fits(*res, h.state, h.state_size, 1)) {
+    return nullptr;
+  }
+  // the records of each tile are checked when it is loaded, so opening
+  // reads nothing but the header
+  return res;
+}
+
+std::uint64_t Image::buildings(std::size_t t) const {
+  return read_at<std::uint32_t>(*this, this->header.counts +
+                                           t * sizeof(std::uint32_t));
+}
+
+std::optional<Tile> Image::load_tile(std::size_t t) const try {
+  auto rec = read_at<TileRecord>(*this, this->header.tile_table +
+                                            t * sizeof(TileRecord));
+  if (!fits(*this, rec.slots, rec.slot_count, sizeof(SlotRecord))) {
+    return std::nullopt;
+  }
+  Tile res;
+  std::memcpy(res.cells.data(), rec.cells, sizeof(rec.cells));
+  res.buildings = rec.buildings;
+  res.slots.reserve(rec.slot_count);
+  for (std::uint64_t k = 0; k < rec.slot_count; ++k) {
+    auto s = read_at<SlotRecord>(*this, rec.slots + k * sizeof(SlotRecord));
+    auto &slot = res.slots.emplace_back();
+    slot.owner = s.owner;
+    slot.cells = s.cells;
+    slot.anchor = {s.anchor[0], s.anchor[1]};
+    if (s.building_size) {
+      if (!fits(*this, s.building, s.building_size, 1)) {
+        return std::nullopt;
+      }
+      auto const *p = this->data + s.building;
+      slot.building = load_building(json::from_msgpack(p, p + s.building_size));
+    }
+  }
+  // every cell must refer to a slot of the tile
+  for (auto const &cell : res.cells) {
+    if (cell.slot > res.slots.size()) {
+      return std::nullopt;
+    }
+  }
+  res.index_belts();
+  return res;
+} catch (const json::exception &) {
+  return std::nullopt;
+}
+
+Cell Image::cell(std::size_t t, std::size_t i) const {
+  return read_at<Cell>(*this, this->header.tile_table +
+                                  t * sizeof(TileRecord) +
+                                  offsetof(TileRecord, cells) +
+                                  i * sizeof(Cell));
+}
+
+json Image::state() const {
+  auto const *p = this->data + this->header.state;
+  return json::parse(p, p + this->header.state_size);
+}
+
+void save_image(const State &state, const std::string &p) {
+  trace::Span span("save image");
+  auto const &map = state.map;
+  Writer w;
+
+  Image::Header header{
+      .height = map.height,
+      .width = map.width,
+      .seed = map.seed,
+      .hash = map.hash_,
+      .tiles = map.tiles.size(),
+  };
+  auto const at = w.reserve(sizeof(Image::Header));
+  header.tile_table = w.reserve(map.tiles.size() * sizeof(Image::TileRecord));
+  header.counts = w.reserve(map.tiles.size() * sizeof(std::uint32_t));
+
+  // region by region, so that each page is read once
+  for (std::size_t r = 0; r < map.regions(); ++r) {
+    auto const held = map.peek_region(r);
+    for (auto const [n, t] : std::views::enumerate(map.region_tiles(r))) {
+      auto const &tile = *held[n];
+      Image::TileRecord rec;
+      std::memcpy(rec.cells, tile.cells.data(), sizeof(rec.cells));
+      rec.buildings = tile.buildings;
+      rec.slot_count = tile.slots.size();
+      rec.slots = w.reserve(tile.slots.size() * sizeof(Image::SlotRecord));
+
+      for (auto const [k, slot] : std::views::enumerate(tile.slots)) {
+        Image::SlotRecord s{
+            .owner = slot.owner,
+            .cells = slot.cells,
+            .anchor = {slot.anchor[0], slot.anchor[1]},
+        };
+        if (slot.building) {
+          auto bytes = json::to_msgpack(tile.building_json(slot));
+          s.building = w.append(bytes.data(), bytes.size());
+          s.building_size = bytes.size();
+        }
+        w.put(rec.slots + k * sizeof(Image::SlotRecord), s);
+      }
+      w.put(header.tile_table + t * sizeof(Image::TileRecord), rec);
+      w.put(header.counts + t * sizeof(std::uint32_t),
+            static_cast<std::uint32_t>(tile.buildings));
+    }
+  }
+
+  auto rest = json{
+      {"eff", state.eff},     {"store", state.store}, {"value", state.value},
+      {"tasks", state.tasks}, {"id_", state.id_},     {"tick", state.tick},
+  }.dump();
+  header.state = w.append(reinterpret_cast<const std::uint8_t *>(rest.data()),
+                          rest.size());
+  header.state_size = rest.size();
+  w.put(at, header);
+
+  auto tmp = p + ".tmp";
+  std::ofstream f(tmp, std::ios::binary);
+  f.write(reinterpret_cast<const char *>(w.buf.data()), w.buf.size());
+  f.close();
+  std::filesystem::rename(tmp, p);
+}
+
+std::optional<State> load_image(const std::string &p) try {
+  trace::Span span("load image");
+  auto image = Image::open(p);
+  if (!image) {
+    return std::nullopt;
+  }
+
+  State res;
+  auto j = image->state();
+  j.at("eff").get_to(res.eff);
+  j.at("store").get_to(res.store);
+  j.at("value").get_to(res.value);
+  j.at("tasks").get_to(res.tasks);
+  j.at("id_").get_to(res.id_);
+  j.at("tick").get_to(res.tick);
+  res.index_tasks();
+
+  auto const &h = image->header;
+  auto &map = res.map;
+  map.height = h.height;
+  map.width = h.width;
+  map.seed = h.seed;
+  map.hash_ = h.hash;
+  // every tile starts out unloaded
+  map.tiles.resize(h.tiles);
+  auto const n = map.regions();
+  map.paging = Paging{
+      .image = std::move(image),
+      .pages = vector<std::shared_ptr<Page>>(n),
+      .dirty = vector<char>(h.tiles, 0),
+      .last_used = vector<std::uint64_t>(n, 0),
+  };
+  return res;
+} catch (const std::exception &) {
+  return std::nullopt;
+}
+
+} // namespace shapezx
@@ -0,0 +1,96 @@
+#ifndef SHAPEZX_CORE_IMAGE
+#define SHAPEZX_CORE_IMAGE
+
+#include "core.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace shapezx {
+
+// A saved state laid out as fixed-size records, for mapping into memory and
+// reading in place. Loading one reads nothing but the header and the small
+// non-map part of the state; tiles are copied out of the mapping when the
+// map first touches them, so only those pages are ever read from disk.
+//
+// Layout: Header, TileRecord[tiles], the anchor counts, then SlotRecords
+// and the buildings as MessagePack, everything 8-byte aligned. Offsets are
+// from the start of the file.
+struct Image {
+  static constexpr std::uint64_t MAGIC = 0x5a50414853ULL; // "SHAPZ"
+  static constexpr std::uint32_t VERSION = 1;
+
+  struct Header {
+    std::uint64_t magic = MAGIC;
+    std::uint32_t version = VERSION;
+    std::uint32_t tile_size = Tile::SIZE;
+    std::uint64_t height = 0;
+    std::uint64_t width = 0;
+    std::uint64_t seed = 0;
+    std::uint64_t hash = 0;
+    std::uint64_t tiles = 0;
+    std::uint64_t tile_table = 0;
+    // std::uint32_t[tiles] with the anchors per tile, dense so that finding
+    // the idle tiles does not read the tiles themselves
+    std::uint64_t counts = 0;
+    // everything but the map, as JSON
+    std::uint64_t state = 0;
+    std::uint64_t state_size = 0;
+  };
+
+  struct TileRecord {
+    Cell cells[Tile::SIZE * Tile::SIZE];
+    std::uint64_t buildings = 0;
+    std::uint64_t slots = 0;
+    std::uint64_t slot_count = 0;
+  };
+
+  struct SlotRecord {
+    std::uint32_t owner = 0;
+    std::uint16_t cells = 0;
+    std::uint16_t reserved_ = 0;
+    std::uint64_t anchor[2] = {0, 0};
+    // 0 for slots of buildings anchored in another tile
+    std::uint64_t building = 0;
+    std::uint64_t building_size = 0;
+  };
+
+  const std::uint8_t *data = nullptr;
+  std::size_t size = 0;
+  Header header;
+
+  Image() = default;
+  Image(const Image &) = delete;
+  ~Image();
+
+  // Maps the file at p, nullptr if it is missing, not an image or its
+  // tables do not fit into it. Only the header is read.
+  static std::shared_ptr<const Image> open(const std::string &p);
+
+  std::uint64_t buildings(std::size_t t) const;
+
+  // Tile t, nullopt if its records are damaged or reach past the end.
+  std::optional<Tile> load_tile(std::size_t t) const;
+
+  // cell i of tile t, without loading the tile
+  Cell cell(std::size_t t, std::size_t i) const;
+
+  json state() const;
+};
+
+// Writes state as an image. The file is replaced atomically, so maps still
+// reading an older image at p keep seeing it.
+void save_image(const State &state, const std::string &p);
+
+// The state in the image at p with every tile still unloaded, nullopt if
+// there is no valid image.
+std::optional<State> load_image(const std::string &p);
+
+} // namespace shapezx
+
+#endif
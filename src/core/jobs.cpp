@@ -0,0 +1,130 @@
+#include "jobs.hpp"
+#include "alloc.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <string>
+
+namespace shapezx {
+
+namespace {
+
+// index of the queue of the current thread, 0 for threads that are not
+// workers
+thread_local std::size_t worker_index = 0;
+
+std::atomic<std::size_t> configured = 0;
+
+} // namespace
+
+void Jobs::Group::spawn(Job job) {
+  this->pending += 1;
+  // allocations of the job count where it was spawned from
+  this->jobs.push([this, site = alloc::site(), job = std::move(job)]() {
+    alloc::Scope scope(site);
+    try {
+      job();
+    } catch (...) {
+      std::lock_guard lock(this->m);
+      if (!this->error) {
+        this->error = std::current_exception();
+      }
+    }
+    this->pending -= 1;
+  });
+}
+
+void Jobs::Group::wait_all() {
+  while (this->pending > 0) {
+    if (!this->jobs.run_one()) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+Jobs::Jobs(std::size_t threads) {
+  threads = std::max<std::size_t>(threads, 1);
+  for (std::size_t i = 0; i < threads; ++i) {
+    this->queues.push_back(std::make_unique<Queue>());
+  }
+  for (std::size_t i = 1; i < threads; ++i) {
+    this->workers.emplace_back(
+        [this, i](std::stop_token stop) { this->work(i, stop); });
+  }
+}
+
+Jobs::~Jobs() {
+  this->stopping = true;
+  this->idle.notify_all();
+  // joined here, while the queues and idle are still there
+  this->workers.clear();
+}
+
+std::size_t Jobs::default_threads() {
+  if (auto const *env = std::getenv("SHAPEZX_THREADS"); env) {
+    if (auto n = std::strtoull(env, nullptr, 10); n > 0) {
+      return n;
+    }
+  }
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+Jobs &Jobs::shared() {
+  static Jobs jobs(configured ? configured.load() : default_threads());
+  return jobs;
+}
+
+void Jobs::configure(std::size_t threads) { configured = threads; }
+
+void Jobs::push(Job job) {
+  auto &q = *this->queues[worker_index < this->queues.size() ? worker_index
+                                                              : 0];
+  {
+    std::lock_guard lock(q.m);
+    q.jobs.push_back(std::move(job));
+  }
+  this->queued += 1;
+  this->idle.notify_one();
+}
+
+bool Jobs::run_one() {
+  auto const own = worker_index < this->queues.size() ? worker_index : 0;
+  Job job;
+  for (std::size_t k = 0; k < this->queues.size() && !job; ++k) {
+    auto &q = *this->queues[(own + k) % this->queues.size()];
+    std::lock_guard lock(q.m);
+    if (q.jobs.empty()) {
+      continue;
+    }
+    // newest of our own, oldest of the others
+    if (k == 0) {
+      job = std::move(q.jobs.back());
+      q.jobs.pop_back();
+    } else {
+      job = std::move(q.jobs.front());
+      q.jobs.pop_front();
+    }
+  }
+  if (!job) {
+    return false;
+  }
+  this->queued -= 1;
+  job();
+  return true;
+}
+
+void Jobs::work(std::size_t index, std::stop_token stop) {
+  worker_index = index;
+  while (!stop.stop_requested() && !this->stopping) {
+    if (this->run_one()) {
+      continue;
+    }
+    std::unique_lock lock(this->idle_m);
+    // the timeout covers a push between run_one() and here
+    this->idle.wait_for(lock, std::chrono::milliseconds(1), [this]() {
+      return this->queued > 0 || this->stopping;
+    });
+  }
+}
+
+} // namespace shapezx
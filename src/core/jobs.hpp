@@ -0,0 +1,125 @@
+#ifndef SHAPEZX_CORE_JOBS
+#define SHAPEZX_CORE_JOBS
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace shapezx {
+
+// Work-stealing scheduler. Every worker has a deque of jobs: it runs its own
+// newest job first and steals the oldest job of another worker when it has
+// none left. Threads waiting for jobs to finish run jobs meanwhile, so jobs
+// may wait for jobs of their own.
+struct Jobs {
+  using Job = std::function<void()>;
+
+  struct Queue {
+    std::mutex m;
+    std::deque<Job> jobs;
+  };
+
+  // Jobs spawned through it, wait() returns once all of them have finished
+  // and rethrows the first exception one of them threw.
+  struct Group {
+    Jobs &jobs;
+    std::atomic<std::size_t> pending = 0;
+    std::mutex m;
+    std::exception_ptr error;
+
+    explicit Group(Jobs &jobs_) : jobs(jobs_) {}
+    Group(const Group &) = delete;
+    ~Group() { this->wait_all(); }
+
+    void spawn(Job job);
+
+    void wait() {
+      this->wait_all();
+      if (this->error) {
+        std::rethrow_exception(std::exchange(this->error, nullptr));
+      }
+    }
+
+  private:
+    void wait_all();
+  };
+
+  // queues[0] takes jobs spawned by threads that are not workers, queues[i]
+  // those of worker i
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::jthread> workers;
+  std::atomic<std::size_t> queued = 0;
+  std::atomic<bool> stopping = false;
+  std::mutex idle_m;
+  std::condition_variable idle;
+
+  // threads counts the calling thread, which takes part while waiting
+  explicit Jobs(std::size_t threads);
+  Jobs(const Jobs &) = delete;
+  ~Jobs();
+
+  // SHAPEZX_THREADS if set, otherwise one per core
+  static std::size_t default_threads();
+
+  // The scheduler of the engine, created on first use with the number of
+  // threads last passed to configure(), default_threads() otherwise.
+  static Jobs &shared();
+
+  // Only has an effect before the first call to shared().
+  static void configure(std::size_t threads);
+
+  std::size_t threads() const { return this->queues.size(); }
+
+  void push(Job job);
+
+  // Runs one queued job, false if there was none.
+  bool run_one();
+
+  // Calls f(i) for every i in [begin, end), in chunks of at least grain
+  // indices, and returns once all calls have returned. Ranges of a single
+  // chunk run on the calling thread.
+  template <typename F>
+  void parallel_for(std::size_t begin, std::size_t end, std::size_t grain,
+                    F &&f) {
+    if (begin >= end) {
+      return;
+    }
+    grain = std::max<std::size_t>(grain, 1);
+    auto const chunks = std::min((end - begin + grain - 1) / grain,
+                                 4 * this->threads());
+    if (chunks <= 1) {
+      for (auto i = begin; i < end; ++i) {
+        f(i);
+      }
+      return;
+    }
+
+    Group group(*this);
+    auto const n = end - begin;
+    for (std::size_t k = 0; k < chunks; ++k) {
+      group.spawn([&f, from = begin + n * k / chunks,
+                   to = begin + n * (k + 1) / chunks]() {
+        for (auto i = from; i < to; ++i) {
+          f(i);
+        }
+      });
+    }
+    group.wait();
+  }
+
+private:
+  void work(std::size_t index, std::stop_token stop);
+};
+
+} // namespace shapezx
+
+#endif
@@ -1,26 +1,36 @@
 #include "machine.hpp"
+#include "alloc.hpp"
 #include "core.hpp"
 #include "ore.hpp"
+#include "recipe.hpp"
 
 #include <algorithm>
-#include <format>
-#include <iostream>
+#include <utility>
 
 namespace shapezx {
 
 void output_to(MapAccessor m, vec::Vec2<ssize_t> at, vec::Vec2<> from,
                Buffer &buf, Capability cap) {
-  auto [out_chk, acc] = m.get_chunk_and_accessor(at);
-  std::cout << std::format("{}\n", acc.pos);
-  if (out_chk.building) {
-    auto &out = out_chk.building.value();
-    std::cout << std::format("{}\n", out->info().type);
-    if (std::ranges::any_of(out->input_positons(acc), [=](const auto d) {
-          std::cout << std::format("{}\n", d);
-          return d == from;
-        })) {
-      std::cout << "ok?\n";
-      out->input(acc, buf, cap);
+  auto &map = m.map.get();
+  auto anchor = map.anchor_of(m.relative_pos_by(at));
+  if (anchor) {
+    auto acc = m.relocate(*anchor);
+    // only look until the target accepts, writing would unshare its tile
+    auto const *out = map.read(*anchor).building;
+    auto accepts = [&]() {
+      alloc::Scope scope(alloc::Site::Positions);
+      return std::ranges::any_of(out->input_positons(acc),
+                                 [=](const auto d) { return d == from; });
+    };
+    if (accepts()) {
+      map[*anchor].building->input(acc, buf, cap);
+      map.refresh_belt(*anchor);
+      // both sides changed
+      acc.rehash();
+      m.rehash();
+      if (m.transfers) {
+        *m.transfers += 1;
+      }
     }
   }
 }
@@ -35,7 +45,7 @@ void consume(Buffer &from, Buffer &to, Capability cap) {
     auto accepts = cap.num_accepts(item).value_or(val);
 
     if (accepts) {
-      val -= accepts;
+      from.increase(item, -ssize_t(accepts));
       to.increase(item, accepts);
     }
   }
@@ -43,21 +53,69 @@ void consume(Buffer &from, Buffer &to, Capability cap) {
 
 void Building::update(MapAccessor) {}
 
+unique_ptr<Building> make_building(BuildingType type, uint32_t id,
+                                   Direction direction) {
+  switch (type) {
+  case BuildingType::Miner:
+    return std::make_unique<Miner>(id, direction);
+  case BuildingType::Belt:
+    return std::make_unique<Belt>(id, direction);
+  case BuildingType::Cutter:
+    return std::make_unique<Cutter>(id, direction);
+  case BuildingType::TrashCan:
+    return std::make_unique<TrashCan>(id, direction);
+  case BuildingType::TaskCenter:
+    return std::make_unique<TaskCenter>(id);
+  default:
+    return nullptr;
+  }
+}
+
+unique_ptr<Building> load_building(const json &j) {
+  BuildingInfo info;
+  j.at("info").get_to(info);
+  unique_ptr<Building> b;
+  switch (info.type) {
+  case BuildingType::Miner:
+    b = std::make_unique<Miner>();
+    break;
+  case BuildingType::Belt:
+    b = std::make_unique<Belt>();
+    break;
+  case BuildingType::Cutter:
+    b = std::make_unique<Cutter>();
+    break;
+  case BuildingType::TrashCan:
+    b = std::make_unique<TrashCan>();
+    break;
+  case BuildingType::TaskCenter:
+    b = std::make_unique<TaskCenter>();
+    break;
+  case BuildingType::PlaceHolder:
+    // older saves stored one per covered chunk, the footprints are rebuilt
+    // from the anchors instead
+    return nullptr;
+  }
+  b->from_json(j);
+  return b;
+}
+
 void to_json(json &j, const Building &p) { p.to_json(j); }
 
 void from_json(const json &j, Building &p) { p.from_json(j); }
 
 void Miner::update(MapAccessor m) {
-  const auto &chk = m.current_chunk();
-  if (chk.ore) {
-    const auto &ore = chk.ore.value();
-    this->ores.increase(ore, m.ctx.get().eff.miner);
+  if (auto const *ore = m.current_chunk().ore; ore) {
+    this->ores.increase(*ore, m.ctx.get().eff.miner * m.scale);
+    m.rehash();
   }
 
   if (!this->ores.empty()) {
-    std::cout << std::format("miner: {}\n", this->ores);
-    output_to(m, to_vec2(this->info_.direction), this->ores,
-              Capability::custom(this->ores));
+    auto capability = [&]() {
+      alloc::Scope scope(alloc::Site::Capability);
+      return Capability::custom(this->ores);
+    };
+    output_to(m, to_vec2(this->info_.direction), this->ores, capability());
   }
 }
 
@@ -66,21 +124,23 @@ vector<vec::Vec2<size_t>> Belt::input_positons(MapAccessor &m) const {
 }
 
 void Belt::input(MapAccessor &m, Buffer &buf, Capability cap) {
-  cap = cap.merge(this->transport_capability(m.ctx.get().eff.belt));
+  {
+    alloc::Scope scope(alloc::Site::Capability);
+    cap = cap.merge(
+        this->transport_capability(m.ctx.get().eff.belt * m.scale));
+  }
 
   consume(buf, this->buffer, cap);
 }
 
-void Belt::update(MapAccessor m) {
+void Belt::transfer(MapAccessor m, std::uint32_t moves) {
   if (!this->buffer.empty()) {
-    std::cout << std::format("belt: {}\n", this->buffer);
-
-    this->progress += 10;
-    if (this->progress == 100) {
-      this->progress = 0;
-      auto capability = this->transport_capability(m.ctx.get().eff.belt);
-      output_to(m, to_vec2(this->info_.direction), this->buffer, capability);
-    }
+    // a coarse update may cover several moves, made as one bigger move
+    auto capability = [&]() {
+      alloc::Scope scope(alloc::Site::Capability);
+      return this->transport_capability(m.ctx.get().eff.belt * moves);
+    };
+    output_to(m, to_vec2(this->info_.direction), this->buffer, capability());
   }
 }
 
@@ -88,28 +148,61 @@ vector<vec::Vec2<size_t>> Cutter::input_positons(MapAccessor &m) const {
   return {m.relative_pos_by(to_vec2(this->info_.direction))};
 }
 
+Capability Cutter::transport_capability() const {
+  static const auto inputs = recipe_inputs(CUTTER_RECIPES);
+  return Capability::specific(inputs);
+}
+
 void Cutter::input(MapAccessor &, Buffer &buf, Capability cap) {
-  cap = cap.merge(this->transport_capability());
+  {
+    alloc::Scope scope(alloc::Site::Capability);
+    cap = cap.merge(this->transport_capability());
+  }
 
   consume(buf, this->in, cap);
 }
 
 void Cutter::update(MapAccessor m) {
-  if (this->in.get(IRON_ORE) && this->out.empty()) {
-    this->in.increase(IRON_ORE, -1);
-    this->out.increase(IRON, 1);
-    this->out.increase(STONE, 1);
+  size_t max_crafts = std::max(m.ctx.get().eff.cutter, 1);
+  auto runnable = std::ranges::find_if(CUTTER_RECIPES, [&](const auto &r) {
+    return r.batch(this->in, this->out, max_crafts,
+                   BUFFERED_BATCHES * max_crafts) > 0;
+  });
+  if (runnable != CUTTER_RECIPES.end()) {
+    this->progress += m.scale;
+    if (this->progress >= runnable->duration) {
+      auto const crafts = max_crafts * (this->progress / runnable->duration);
+      this->progress %= runnable->duration;
+      runnable->craft(this->in, this->out,
+                      runnable->batch(this->in, this->out, crafts,
+                                      BUFFERED_BATCHES * crafts));
+    }
+    m.rehash();
   }
 
   if (!this->out.empty()) {
     auto d = this->info_.direction;
     auto select = [this](Item item) {
-      return Capability::custom({.items = {{item, this->out.get(item)}}});
+      alloc::Scope scope(alloc::Site::Capability);
+      return Capability::custom(
+          Buffer(Buffer::Items{{item, this->out.get(item)}}));
     };
-
-    output_to(m, to_vec2(opposite_of(d)), this->out, select(IRON));
-    output_to(m, to_vec2(opposite_of(d)) + to_vec2(right_of(d)),
-              m.pos + to_vec2(right_of(d)), this->out, select(STONE));
+    // output i of a recipe leaves through port i
+    const array<pair<vec::Vec2<ssize_t>, vec::Vec2<>>, Recipe::MAX_STACKS>
+        ports{{
+            {to_vec2(opposite_of(d)), m.pos},
+            {to_vec2(opposite_of(d)) + to_vec2(right_of(d)),
+             m.pos + to_vec2(right_of(d))},
+        }};
+
+    for (auto const &recipe : CUTTER_RECIPES) {
+      for (auto const [i, s] : recipe.outputs | std::views::enumerate) {
+        if (s.item && this->out.get(*s.item)) {
+          auto [at, from] = ports[i];
+          output_to(m, at, from, this->out, select(*s.item));
+        }
+      }
+    }
   }
 }
 
@@ -125,37 +218,26 @@ void TrashCan::input(MapAccessor &, Buffer &buf, Capability cap) {
   consume(buf, tmp, cap);
 }
 
-Building *PlaceHolder::base(MapAccessor &m) {
-  return m.map.get()[this->pos_].building->get();
-}
-
-const Building *PlaceHolder::base(MapAccessor &m) const {
-  return m.map.get()[this->pos_].building->get();
-}
-
-void PlaceHolder::input(MapAccessor &m, Buffer &buf, Capability cap) {
-  auto acc = m.relocate(this->pos_);
-  return this->base(m)->input(acc, buf, cap);
-}
-
-vector<vec::Vec2<size_t>> PlaceHolder::input_positons(MapAccessor &m) const {
-  auto acc = m.relocate(this->pos_);
-  return this->base(m)->input_positons(acc);
-}
-
 void TaskCenter::input(MapAccessor &, Buffer &buf, Capability cap) {
   consume(buf, this->buffer, cap);
 }
 
 void TaskCenter::update(MapAccessor m) {
-  for (auto &[item, num] : this->buffer.items) {
-    m.ctx.get().take_item(item, num);
-    num = 0;
+  if (this->buffer.empty()) {
+    return;
+  }
+  for (auto const &[item, num] : this->buffer.items) {
+    if (m.delivered) {
+      m.delivered->increase(item, num);
+    } else {
+      m.ctx.get().take_item(item, num);
+    }
+    this->buffer.set(item, 0);
   }
+  m.rehash();
 }
 
 vector<vec::Vec2<size_t>> TaskCenter::input_positons(MapAccessor &m) const {
-  std::cout << std::format("tc pos: {}\n", m.pos);
   return vector<vec::Vec2<ssize_t>>{{-1, 0}, {-1, 1}, {0, 2},  {1, 2},
                                     {2, 0},  {2, 1},  {0, -1}, {1, -1}} |
          std::views::transform(
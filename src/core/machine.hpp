@@ -2,6 +2,8 @@
 #define SHAPEZX_CORE_MACHINE
 
 #include "../vec/vec.hpp"
+#include "hash.hpp"
+#include "memory.hpp"
 #include "ore.hpp"
 
 #include <algorithm>
@@ -43,6 +45,7 @@ enum class BuildingType {
   Cutter,
   TrashCan,
   TaskCenter,
+  // only found in saves written before Map kept an occupancy grid
   PlaceHolder,
 };
 
@@ -114,10 +117,33 @@ constexpr vec::Vec2<ssize_t> to_vec2(Direction d) {
   }
 }
 
+// Items are only written through the members below, which keep digest_ up
+// to date one entry at a time.
 struct Buffer {
-  std::unordered_map<Item, size_t> items;
+  // counted in memory::Kind::Buffers
+  using Items = std::unordered_map<
+      Item, size_t, std::hash<Item>, std::equal_to<Item>,
+      memory::Allocator<std::pair<const Item, size_t>, memory::Kind::Buffers>>;
 
-  void clear() { this->items.clear(); }
+  Items items;
+  // XOR of entry() over items
+  std::uint64_t digest_ = 0;
+
+  Buffer() = default;
+  explicit Buffer(Items items_) : items(std::move(items_)) {
+    this->reindex();
+  }
+
+  // What num of item add to digest_, nothing for 0 so that equal contents
+  // give equal digests.
+  static std::uint64_t entry(const Item &item, size_t num) {
+    return num ? hash::combine(hash::of(item.name), num) : 0;
+  }
+
+  void clear() {
+    this->items.clear();
+    this->digest_ = 0;
+  }
 
   Buffer take() {
     auto ret = Buffer(*this);
@@ -132,22 +158,41 @@ struct Buffer {
     return 0;
   }
 
-  void set(Item it, size_t n) { this->items[it] = n; }
+  void set(const Item &it, size_t n) {
+    auto &cur = this->items[it];
+    this->digest_ ^= entry(it, cur) ^ entry(it, n);
+    cur = n;
+  }
 
-  size_t increase(Item it, ssize_t n) {
+  size_t increase(const Item &it, ssize_t n) {
     auto &cur = this->items[it];
+    auto const before = cur;
     if (n >= 0 || cur >= size_t(-n)) {
       cur += n;
     } else {
       cur = 0;
     }
+    this->digest_ ^= entry(it, before) ^ entry(it, cur);
     return cur;
   }
 
-  size_t &operator[](Item it) { return this->items[it]; }
+  void merge(Buffer &other) {
+    this->items.merge(other.items);
+    this->reindex();
+    other.reindex();
+  }
+  void merge(Buffer &&other) { this->merge(other); }
+
+  // Independent of insertion order, O(1).
+  std::uint64_t digest() const { return this->digest_; }
 
-  void merge(Buffer &other) { this->items.merge(other.items); }
-  void merge(Buffer &&other) { this->items.merge(std::move(other.items)); }
+  // Recomputes digest_ from the items, for checking the incremental one.
+  void reindex() {
+    this->digest_ = 0;
+    for (auto const &[item, num] : this->items) {
+      this->digest_ ^= entry(item, num);
+    }
+  }
 
   bool empty() const {
     return this->items.empty() ||
@@ -156,7 +201,11 @@ struct Buffer {
   }
 };
 
-NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Buffer, items)
+inline void to_json(json &j, const Buffer &p) { j["items"] = p.items; }
+
+inline void from_json(const json &j, Buffer &p) {
+  p = Buffer(j.at("items").get<Buffer::Items>());
+}
 
 struct Capability {
   struct None {
@@ -176,7 +225,7 @@ struct Capability {
       auto items = this->inner;
       for (const auto &[item, val] : oc.inner.items) {
         auto num = std::min(val, items.get(item));
-        items[item] = num;
+        items.set(item, num);
       }
       return Capability{.restriction = Custom{.inner = items}};
     }
@@ -188,7 +237,7 @@ struct Capability {
                      return std::find(inner.cbegin(), inner.cend(),
                                       entry.first) != inner.cend();
                    }) |
-                   std::ranges::to<std::unordered_map<Item, size_t>>();
+                   std::ranges::to<Buffer::Items>();
       return Capability{.restriction = Custom{.inner = Buffer(items)}};
     }
   };
@@ -289,6 +338,11 @@ struct BuildingInfo {
 
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(BuildingInfo, id, type, size, direction)
 
+inline std::uint64_t digest(const BuildingInfo &info) {
+  return hash::combine(info.id, static_cast<std::uint64_t>(info.type),
+                       static_cast<std::uint64_t>(info.direction));
+}
+
 struct MapAccessor;
 
 struct Building {
@@ -314,8 +368,8 @@ struct Building {
     return {};
   };
 
-  // INVARIANCE: chunks bewteen (0, 0) and relative_rect() either have
-  // placeholder or have no building
+  // INVARIANCE: chunks bewteen (0, 0) and relative_rect() are covered by this
+  // building in the occupancy grid and hold no building themselves
   virtual vec::Vec2<ssize_t> relative_rect() const {
     auto size = this->info().size;
     auto d = this->info().direction;
@@ -329,6 +383,15 @@ struct Building {
   virtual void to_json(json &j) const = 0;
   virtual void from_json(const json &j) = 0;
 
+  // hash of the whole internal state, see State::hash()
+  virtual std::uint64_t digest() const = 0;
+
+  // Recomputes the digests of the buffers, see Buffer::reindex().
+  virtual void reindex() {}
+
+  // what this building currently contributes to Map::hash_
+  std::uint64_t hashed_ = 0;
+
   virtual ~Building() = default;
 };
 
@@ -373,11 +436,20 @@ struct Miner final : public Building {
     j.at("ores").get_to(this->ores);
   }
 
+  std::uint64_t digest() const override {
+    return hash::combine(shapezx::digest(this->info_), this->ores.digest());
+  }
+
+  void reindex() override { this->ores.reindex(); }
+
   ~Miner() override = default;
 };
 
+// Moves its items every 10 ticks. Belts are not updated one by one, see
+// Tile::belts, the map only calls transfer() when they are due.
 struct Belt final : public Building {
   BuildingInfo info_;
+  // only while saved or loaded, the tile has the current value
   std::uint32_t progress = 0;
   Buffer buffer;
 
@@ -393,7 +465,8 @@ struct Belt final : public Building {
 
   vector<vec::Vec2<size_t>> input_positons(MapAccessor &) const override;
 
-  void update(MapAccessor) override;
+  // Passes on what moves times the usual amount of items.
+  void transfer(MapAccessor m, std::uint32_t moves);
 
   unique_ptr<Building> clone() const override {
     return std::make_unique<Belt>(*this);
@@ -408,12 +481,18 @@ struct Belt final : public Building {
   }
 
   void from_json(const json &j) override {
-    std::cout << j << '\n';
     j.at("info").get_to(this->info_);
     j.at("progress").get_to(this->progress);
     j.at("buffer").get_to(this->buffer);
   }
 
+  // progress is hashed by the tile
+  std::uint64_t digest() const override {
+    return hash::combine(shapezx::digest(this->info_), this->buffer.digest());
+  }
+
+  void reindex() override { this->buffer.reindex(); }
+
   ~Belt() override = default;
 
   Capability transport_capability(int64_t efficiency_factor) const {
@@ -427,14 +506,18 @@ struct Belt final : public Building {
           return std::make_pair(
               t.first, std::min(size_t(4 * efficiency_factor), t.second));
         }) |
-        std::ranges::to<std::unordered_map<Item, size_t>>()));
+        std::ranges::to<Buffer::Items>()));
   }
 };
 
 struct Cutter final : public Building {
+  // crafts worth of output kept in `out` while waiting for the belts
+  static constexpr size_t BUFFERED_BATCHES = 2;
+
   BuildingInfo info_;
   Buffer in;
   Buffer out;
+  std::uint32_t progress = 0;
 
   Cutter() = default;
   explicit Cutter(uint32_t id, Direction direction_)
@@ -446,9 +529,7 @@ struct Cutter final : public Building {
 
   vector<vec::Vec2<size_t>> input_positons(MapAccessor &) const override;
 
-  Capability transport_capability() const {
-    return Capability::specific({IRON_ORE});
-  }
+  Capability transport_capability() const;
 
   void input(MapAccessor &, Buffer &, Capability) override;
 
@@ -463,14 +544,25 @@ struct Cutter final : public Building {
         {"info", this->info_},
         {"in", this->in},
         {"out", this->out},
+        {"progress", this->progress},
     };
   }
 
   void from_json(const json &j) override {
-    std::cout << j << '\n';
     j.at("info").get_to(this->info_);
     j.at("in").get_to(this->in);
     j.at("out").get_to(this->out);
+    this->progress = j.value("progress", std::uint32_t(0));
+  }
+
+  std::uint64_t digest() const override {
+    return hash::combine(shapezx::digest(this->info_), this->in.digest(),
+                         this->out.digest(), this->progress);
+  }
+
+  void reindex() override {
+    this->in.reindex();
+    this->out.reindex();
   }
 
   ~Cutter() override = default;
@@ -503,43 +595,11 @@ struct TrashCan final : public Building {
 
   void from_json(const json &j) override { j.at("info").get_to(this->info_); }
 
-  ~TrashCan() override = default;
-};
-
-struct PlaceHolder final : public Building {
-  BuildingInfo info_;
-  vec::Vec2<> pos_;
-
-  PlaceHolder() : pos_(0, 0) {}
-  explicit PlaceHolder(uint32_t id, Direction direction_, vec::Vec2<> pos)
-      : info_(id, BuildingType::PlaceHolder, {1, 1}, direction_), pos_(pos) {}
-
-  BuildingInfo info() const override { return this->info_; }
-
-  void input(MapAccessor &m, Buffer &buf, Capability cap) override;
-
-  vector<vec::Vec2<size_t>> input_positons(MapAccessor &m) const override;
-
-  unique_ptr<Building> clone() const override {
-    return std::make_unique<PlaceHolder>(*this);
+  std::uint64_t digest() const override {
+    return shapezx::digest(this->info_);
   }
 
-  Building *base(MapAccessor &m);
-  const Building *base(MapAccessor &m) const;
-
-  void to_json(json &j) const override {
-    j = {
-        {"info", this->info_},
-        {"pos", this->pos_},
-    };
-  }
-
-  void from_json(const json &j) override {
-    j.at("info").get_to(this->info_);
-    j.at("pos").get_to(this->pos_);
-  }
-
-  ~PlaceHolder() = default;
+  ~TrashCan() override = default;
 };
 
 struct State;
@@ -575,8 +635,23 @@ struct TaskCenter final : public Building {
     j.at("info").get_to(this->info_);
     j.at("buffer").get_to(this->buffer);
   }
+
+  std::uint64_t digest() const override {
+    return hash::combine(shapezx::digest(this->info_), this->buffer.digest());
+  }
+
+  void reindex() override { this->buffer.reindex(); }
 };
 
+// Creates a building as placed by the player, or nullptr for types that
+// cannot be placed.
+unique_ptr<Building> make_building(BuildingType type, uint32_t id,
+                                   Direction direction);
+
+// Reads a building written by Building::to_json, nullptr for legacy
+// placeholders.
+unique_ptr<Building> load_building(const json &j);
+
 } // namespace shapezx
 
 namespace std {
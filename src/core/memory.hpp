@@ -0,0 +1,101 @@
+#ifndef SHAPEZX_CORE_MEMORY
+#define SHAPEZX_CORE_MEMORY
+
+#include "alloc.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bytes held by the structures of the game. Containers that come and go
+// everywhere count their own allocations through Allocator, the rest is
+// measured by walking a State, see usage.hpp.
+namespace shapezx::memory {
+
+enum class Kind : std::size_t {
+  // contents of every Buffer
+  Buffers,
+};
+
+inline constexpr std::size_t KINDS = 1;
+
+// bytes currently allocated through Allocator<T, k>, by k
+inline std::array<std::atomic<std::int64_t>, KINDS> live{};
+
+inline std::int64_t live_bytes(Kind k) {
+  return live[std::size_t(k)].load(std::memory_order_relaxed);
+}
+
+// std::allocator that counts the bytes it hands out in live[K].
+template <typename T, Kind K> struct Allocator {
+  using value_type = T;
+
+  template <typename U> struct rebind {
+    using other = Allocator<U, K>;
+  };
+
+  Allocator() = default;
+  template <typename U> Allocator(const Allocator<U, K> &) {}
+
+  T *allocate(std::size_t n) {
+    live[std::size_t(K)].fetch_add(n * sizeof(T), std::memory_order_relaxed);
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T *p, std::size_t n) {
+    live[std::size_t(K)].fetch_sub(n * sizeof(T), std::memory_order_relaxed);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U> bool operator==(const Allocator<U, K> &) const {
+    return true;
+  }
+};
+
+// Operations that go through JSON, each staged on its own.
+enum class Stage : std::size_t {
+  StateLoad,
+  StateSave,
+  GlobalLoad,
+  GlobalSave,
+};
+
+inline constexpr std::size_t STAGES = 4;
+
+inline constexpr std::array<const char *, STAGES> STAGE_NAMES{
+    "state load", "state save", "global load", "global save"};
+
+// Bytes allocated for JSON by the last of each operation, by Stage. Only
+// counted when built with SHAPEZX_TRACK_ALLOCATIONS.
+inline std::array<std::atomic<std::uint64_t>, STAGES> json_staged{};
+
+inline std::uint64_t staged(Stage s) {
+  return json_staged[std::size_t(s)].load(std::memory_order_relaxed);
+}
+
+// Attributes what the current thread, and the jobs it spawns, allocate to
+// alloc::Site::Json, and stores the bytes as the last stage when it ends.
+// Only meant to cover parsing or dumping the JSON, not converting it to
+// and from the game's types.
+struct Staging {
+  Stage stage;
+  alloc::Scope scope{alloc::Site::Json};
+  std::uint64_t before = json_bytes();
+
+  explicit Staging(Stage s) : stage(s) {}
+  Staging(const Staging &) = delete;
+  ~Staging() {
+    json_staged[std::size_t(this->stage)].store(
+        json_bytes() - this->before, std::memory_order_relaxed);
+  }
+
+  static std::uint64_t json_bytes() {
+    return alloc::stats().bytes[std::size_t(alloc::Site::Json)];
+  }
+};
+
+} // namespace shapezx::memory
+
+#endif
@@ -0,0 +1,283 @@
+#include "metrics.hpp"
+#include "core.hpp"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <mutex>
+
+namespace shapezx {
+
+namespace {
+
+// label values are quoted, with \, " and newlines escaped
+std::string label(std::string_view s) {
+  std::string res;
+  for (auto c : s) {
+    if (c == '\\' || c == '"') {
+      res += '\\';
+      res += c;
+    } else if (c == '\n') {
+      res += "\\n";
+    } else {
+      res += c;
+    }
+  }
+  return res;
+}
+
+void header(std::string &out, std::string_view name, std::string_view type,
+            std::string_view help) {
+  out += std::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+} // namespace
+
+void Metrics::tick(std::uint64_t ns) {
+  auto const seconds = ns / 1e9;
+  auto b = std::ranges::find_if(TICK_BUCKETS,
+                                [&](double le) { return seconds <= le; }) -
+           TICK_BUCKETS.begin();
+  this->tick_buckets[b].fetch_add(1, std::memory_order_relaxed);
+  this->tick_ns.fetch_add(ns, std::memory_order_relaxed);
+  this->ticks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::deliver(const Item &item, std::size_t num) {
+  for (auto &slot : this->delivered) {
+    auto state = slot.state.load(std::memory_order_acquire);
+    if (state == ItemCount::FREE &&
+        slot.state.compare_exchange_strong(state, ItemCount::NAMING,
+                                           std::memory_order_acquire)) {
+      slot.name = item.name;
+      slot.count.fetch_add(num, std::memory_order_relaxed);
+      slot.state.store(ItemCount::READY, std::memory_order_release);
+      return;
+    }
+    // named by another thread right now, which takes no time
+    while (state == ItemCount::NAMING) {
+      state = slot.state.load(std::memory_order_acquire);
+    }
+    if (slot.name == item.name) {
+      slot.count.fetch_add(num, std::memory_order_relaxed);
+      return;
+    }
+  }
+  this->delivered_other.fetch_add(num, std::memory_order_relaxed);
+}
+
+void Metrics::count_buildings(const Map &map) {
+  std::array<std::int64_t, TYPES> counts{};
+  for (size_t r = 0; r < map.regions(); ++r) {
+    // paged out regions are only read if the index says they have
+    // buildings, and then without loading them
+    auto const tiles = map.region_tiles(r);
+    if (std::ranges::none_of(tiles,
+                             [&](auto t) { return map.has_buildings(t); })) {
+      continue;
+    }
+    for (auto const &tile : map.peek_region(r)) {
+      for (auto const &slot : tile->slots) {
+        if (slot.building) {
+          counts[std::size_t(slot.building->info().type)] += 1;
+        }
+      }
+    }
+  }
+  for (std::size_t k = 0; k < TYPES; ++k) {
+    this->buildings[k].store(counts[k], std::memory_order_relaxed);
+  }
+}
+
+void Metrics::saved(std::uint64_t ns, std::uint64_t bytes) {
+  this->saves.fetch_add(1, std::memory_order_relaxed);
+  this->save_ns.fetch_add(ns, std::memory_order_relaxed);
+  this->save_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+std::string Metrics::render() const {
+  auto load = [](auto const &a) { return a.load(std::memory_order_relaxed); };
+  std::string res;
+
+  header(res, "shapezx_tick_seconds", "histogram", "Duration of game ticks.");
+  std::uint64_t below = 0;
+  for (std::size_t b = 0; b < TICK_BUCKETS.size(); ++b) {
+    below += load(this->tick_buckets[b]);
+    res += std::format("shapezx_tick_seconds_bucket{{le=\"{}\"}} {}\n",
+                       TICK_BUCKETS[b], below);
+  }
+  below += load(this->tick_buckets.back());
+  res += std::format("shapezx_tick_seconds_bucket{{le=\"+Inf\"}} {}\n"
+                     "shapezx_tick_seconds_sum {}\n"
+                     "shapezx_tick_seconds_count {}\n",
+                     below, load(this->tick_ns) / 1e9, below);
+
+  header(res, "shapezx_ticks_total", "counter",
+         "Ticks run, rate() of it is ticks per second.");
+  res += std::format("shapezx_ticks_total {}\n", load(this->ticks));
+
+  header(res, "shapezx_items_delivered_total", "counter",
+         "Items delivered to the task center.");
+  for (auto const &slot : this->delivered) {
+    if (slot.state.load(std::memory_order_acquire) != ItemCount::READY) {
+      continue;
+    }
+    res += std::format("shapezx_items_delivered_total{{item=\"{}\"}} {}\n",
+                       label(slot.name), load(slot.count));
+  }
+  if (auto other = load(this->delivered_other); other) {
+    res += std::format(
+        "shapezx_items_delivered_total{{item=\"(other)\"}} {}\n", other);
+  }
+
+  header(res, "shapezx_value_total", "counter",
+         "Value earned, as added to Global::value.");
+  res += std::format("shapezx_value_total {}\n", load(this->value));
+
+  header(res, "shapezx_buildings", "gauge", "Buildings on the map by type.");
+  for (std::size_t k = 0; k < TYPES; ++k) {
+    res += std::format("shapezx_buildings{{type=\"{}\"}} {}\n",
+                       BuildingType(k), load(this->buildings[k]));
+  }
+
+  header(res, "shapezx_saves_total", "counter", "Saves written.");
+  res += std::format("shapezx_saves_total {}\n", load(this->saves));
+  header(res, "shapezx_save_seconds_total", "counter",
+         "Time spent writing saves.");
+  res += std::format("shapezx_save_seconds_total {}\n",
+                     load(this->save_ns) / 1e9);
+  header(res, "shapezx_save_bytes", "gauge", "Size of the last save.");
+  res += std::format("shapezx_save_bytes {}\n", load(this->save_bytes));
+  return res;
+}
+
+MetricsExporter::~MetricsExporter() {
+  if (this->worker.joinable()) {
+    this->worker.request_stop();
+    this->worker.join();
+  }
+  if (this->listener >= 0) {
+    close(this->listener);
+    std::filesystem::remove(this->path);
+  }
+}
+
+std::unique_ptr<MetricsExporter>
+MetricsExporter::open(const std::string &spec,
+                      std::shared_ptr<const Metrics> metrics) {
+  if (spec.starts_with("file:")) {
+    auto res = std::make_unique<MetricsExporter>(std::move(metrics),
+                                                 spec.substr(5));
+    res->worker = std::jthread(
+        [p = res.get()](std::stop_token stop) { p->write_file(stop); });
+    return res;
+  }
+  if (!spec.starts_with("unix:")) {
+    return nullptr;
+  }
+
+  auto res =
+      std::make_unique<MetricsExporter>(std::move(metrics), spec.substr(5));
+  sockaddr_un addr{};
+  if (res->path.size() >= sizeof(addr.sun_path)) {
+    return nullptr;
+  }
+  addr.sun_family = AF_UNIX;
+  res->path.copy(addr.sun_path, res->path.size());
+  res->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (res->listener < 0) {
+    return nullptr;
+  }
+  std::filesystem::remove(res->path);
+  if (bind(res->listener, reinterpret_cast<const sockaddr *>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(res->listener, 4) != 0) {
+    return nullptr;
+  }
+  res->worker = std::jthread(
+      [p = res.get()](std::stop_token stop) { p->serve(stop); });
+  return res;
+}
+
+std::unique_ptr<MetricsExporter> MetricsExporter::from_env(State &state) {
+  auto const *spec = std::getenv("SHAPEZX_METRICS");
+  if (!spec) {
+    return nullptr;
+  }
+  auto metrics = std::make_shared<Metrics>();
+  metrics->count_buildings(state.map);
+  auto res = open(spec, metrics);
+  if (res) {
+    state.metrics = std::move(metrics);
+  }
+  return res;
+}
+
+void MetricsExporter::serve(std::stop_token stop) {
+  while (!stop.stop_requested()) {
+    pollfd fd{this->listener, POLLIN, 0};
+    // wakes up now and then to see whether it should stop
+    if (poll(&fd, 1, 250) <= 0) {
+      continue;
+    }
+    auto c = accept4(this->listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (c < 0) {
+      continue;
+    }
+    // the request itself does not matter, only that it was sent
+    timeval timeout{1, 0};
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos &&
+           request.size() < 8192) {
+      auto n = recv(c, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        break;
+      }
+      request.append(buf, n);
+    }
+
+    auto body = this->metrics->render();
+    auto response = std::format("HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: {}\r\n\r\n{}",
+                                body.size(), body);
+    for (std::size_t done = 0; done < response.size();) {
+      auto n = send(c, response.data() + done, response.size() - done,
+                    MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      done += n;
+    }
+    close(c);
+  }
+}
+
+void MetricsExporter::write_file(std::stop_token stop) {
+  std::mutex m;
+  std::condition_variable_any cv;
+  auto tmp = this->path + ".tmp";
+  do {
+    std::ofstream f(tmp);
+    f << this->metrics->render();
+    f.close();
+    // scrapers never see half a file
+    std::error_code ec;
+    std::filesystem::rename(tmp, this->path, ec);
+
+    std::unique_lock lock(m);
+    cv.wait_for(lock, stop, this->interval, []() { return false; });
+  } while (!stop.stop_requested());
+}
+
+} // namespace shapezx
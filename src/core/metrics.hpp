@@ -0,0 +1,111 @@
+#ifndef SHAPEZX_CORE_METRICS
+#define SHAPEZX_CORE_METRICS
+
+#include "machine.hpp"
+#include "ore.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace shapezx {
+
+struct Map;
+struct State;
+
+// Counters of a running game, rendered in the Prometheus text format. The
+// game only touches atomics, rendering may run on any thread meanwhile.
+struct Metrics {
+  static constexpr std::size_t TYPES =
+      std::size_t(BuildingType::PlaceHolder) + 1;
+  // upper bounds of the tick duration buckets, in seconds
+  static constexpr std::array<double, 8> TICK_BUCKETS{
+      0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.25,
+  };
+  // distinct items counted, further ones are only counted in total
+  static constexpr std::size_t ITEMS = 64;
+
+  // A slot is claimed by setting state to NAMING, written, and published by
+  // setting it to READY. The name never changes afterwards.
+  struct ItemCount {
+    enum State : int { FREE, NAMING, READY };
+
+    std::atomic<int> state = FREE;
+    std::string name;
+    std::atomic<std::uint64_t> count = 0;
+  };
+
+  // the last one counts ticks over every bucket
+  std::array<std::atomic<std::uint64_t>, TICK_BUCKETS.size() + 1>
+      tick_buckets{};
+  std::atomic<std::uint64_t> tick_ns = 0;
+  std::atomic<std::uint64_t> ticks = 0;
+  std::array<ItemCount, ITEMS> delivered;
+  std::atomic<std::uint64_t> delivered_other = 0;
+  std::atomic<std::uint64_t> value = 0;
+  std::array<std::atomic<std::int64_t>, TYPES> buildings{};
+  std::atomic<std::uint64_t> saves = 0;
+  std::atomic<std::uint64_t> save_ns = 0;
+  // size of the last save
+  std::atomic<std::uint64_t> save_bytes = 0;
+
+  void tick(std::uint64_t ns);
+
+  // num of item were delivered to the task center
+  void deliver(const Item &item, std::size_t num);
+
+  void building_added(BuildingType type, std::int64_t n = 1) {
+    this->buildings[std::size_t(type)].fetch_add(n,
+                                                 std::memory_order_relaxed);
+  }
+
+  // Sets the building counts to those of map, which the game then keeps up
+  // to date through State::execute().
+  void count_buildings(const Map &map);
+
+  void saved(std::uint64_t ns, std::uint64_t bytes);
+
+  std::string render() const;
+};
+
+// Serves Metrics::render() to a local scraper. At a Unix socket, every
+// connection gets one plain HTTP response, so that e.g.
+// `curl --unix-socket <path> http://localhost/metrics` works. A file is
+// rewritten every interval, as node_exporter's textfile collector wants.
+struct MetricsExporter {
+  std::shared_ptr<const Metrics> metrics;
+  std::string path;
+  int listener = -1;
+  std::chrono::milliseconds interval{5000};
+  std::jthread worker;
+
+  MetricsExporter(std::shared_ptr<const Metrics> metrics_,
+                  const std::string &path_)
+      : metrics(std::move(metrics_)), path(path_) {}
+  MetricsExporter(const MetricsExporter &) = delete;
+  ~MetricsExporter();
+
+  // spec is "unix:<path>" or "file:<path>". nullptr if it is neither or the
+  // socket cannot be opened.
+  static std::unique_ptr<MetricsExporter>
+  open(const std::string &spec, std::shared_ptr<const Metrics> metrics);
+
+  // Gives state metrics and exports them to SHAPEZX_METRICS, which is a
+  // spec for open(). nullptr if it is not set or open() fails.
+  static std::unique_ptr<MetricsExporter> from_env(State &state);
+
+private:
+  void serve(std::stop_token stop);
+
+  void write_file(std::stop_token stop);
+};
+
+} // namespace shapezx
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef SHAPEZX_CORE_NOISE
+#define SHAPEZX_CORE_NOISE
+
+#include "hash.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Integer value noise. Every value is a pure function of the seed and the
+// position, so results do not depend on how the work is split or on how
+// wide the vector units are.
+namespace shapezx::noise {
+
+using std::size_t;
+using std::uint32_t;
+using std::uint64_t;
+
+// random value in [0, 65536) at a lattice point
+constexpr uint32_t lattice(uint64_t seed, uint64_t r, uint64_t c) {
+  return static_cast<uint32_t>(hash::combine(seed, r, c) >> 48);
+}
+
+// smoothstep from one lattice point to the next, in 256ths
+template <unsigned SHIFT> constexpr auto weights() {
+  constexpr uint64_t STEP = uint64_t(1) << SHIFT;
+  std::array<uint32_t, STEP> res{};
+  for (uint64_t i = 0; i < STEP; ++i) {
+    res[i] = static_cast<uint32_t>((3 * i * i * STEP - 2 * i * i * i) * 256 /
+                                   (STEP * STEP * STEP));
+  }
+  return res;
+}
+
+constexpr uint32_t lerp(uint32_t a, uint32_t b, uint32_t w) {
+  return (a * (256 - w) + b * w) >> 8;
+}
+
+// Noise with a lattice spacing of 1 << SHIFT chunks for the N chunks of row
+// r starting at column c0, in [0, 65536). Every lattice cell touched is
+// filled whole, STEP chunks with the same two ends and the weights in order,
+// so the inner loop has a fixed trip count and contiguous loads that GCC
+// vectorizes at -O2. The chunks wanted are then copied out of the cells.
+template <unsigned SHIFT, size_t N>
+void row(uint64_t seed, uint64_t r, uint64_t c0, std::array<uint32_t, N> &out) {
+  constexpr uint64_t STEP = uint64_t(1) << SHIFT;
+  constexpr auto W = weights<SHIFT>();
+  // lattice cells touched by [c0, c0 + N), wherever in a cell c0 is
+  constexpr size_t K = (N + 2 * STEP - 2) / STEP;
+
+  auto const gr = r >> SHIFT;
+  auto const wr = W[r & (STEP - 1)];
+  auto const g0 = c0 >> SHIFT;
+  // lattice columns, lerped along the row first
+  std::array<uint32_t, K + 1> column;
+  for (size_t k = 0; k <= K; ++k) {
+    column[k] = lerp(lattice(seed, gr, g0 + k), lattice(seed, gr + 1, g0 + k),
+                     wr);
+  }
+
+  std::array<uint32_t, K * STEP> cells;
+  for (size_t k = 0; k < K; ++k) {
+    auto const a = column[k];
+    auto const b = column[k + 1];
+    for (size_t i = 0; i < STEP; ++i) {
+      cells[k * STEP + i] = lerp(a, b, W[i]);
+    }
+  }
+  std::copy_n(cells.begin() + (c0 & (STEP - 1)), N, out.begin());
+}
+
+} // namespace shapezx::noise
+
+#endif
@@ -0,0 +1,166 @@
+#include "perf.hpp"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <format>
+
+namespace shapezx {
+
+namespace {
+
+constexpr std::array<std::uint64_t, Counters::EVENTS> CONFIGS{
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+std::mutex error_m;
+std::string error;
+
+// One group of counters per thread, all read at once through the leader.
+struct Group {
+  std::array<int, Counters::EVENTS> fds;
+  // position of every event in a read of the group, -1 if it is missing
+  std::array<int, Counters::EVENTS> slots;
+  std::size_t opened = 0;
+
+  Group() {
+    fds.fill(-1);
+    slots.fill(-1);
+    for (std::size_t e = 0; e < Counters::EVENTS; ++e) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = CONFIGS[e];
+      // user space only, which perf_event_paranoid allows most often
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      auto fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1,
+                                         this->fds[0], PERF_FLAG_FD_CLOEXEC));
+      if (fd < 0) {
+        if (e == 0) {
+          std::lock_guard lock(error_m);
+          error = std::format("perf_event_open: {}", std::strerror(errno));
+          return;
+        }
+        // e.g. no cache events in a VM, the others still work
+        continue;
+      }
+      this->fds[e] = fd;
+      this->slots[e] = static_cast<int>(this->opened++);
+    }
+  }
+
+  ~Group() {
+    for (auto fd : this->fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  std::optional<Counters> read() const {
+    if (this->fds[0] < 0) {
+      return std::nullopt;
+    }
+    std::array<std::uint64_t, Counters::EVENTS + 1> buf;
+    auto n = ::read(this->fds[0], buf.data(), sizeof(buf));
+    if (n < 0 || std::size_t(n) < (this->opened + 1) * sizeof(buf[0])) {
+      return std::nullopt;
+    }
+    Counters res;
+    for (std::size_t e = 0; e < Counters::EVENTS; ++e) {
+      if (this->slots[e] >= 0) {
+        res.values[e] = buf[1 + this->slots[e]];
+      }
+    }
+    return res;
+  }
+};
+
+} // namespace
+
+std::optional<Counters> Counters::now() {
+  thread_local Group group;
+  return group.read();
+}
+
+std::string Counters::unavailable() {
+  std::lock_guard lock(error_m);
+  return error;
+}
+
+void Profile::PerType::add(BuildingType type,
+                           const std::optional<Counters> &start) {
+  auto const k = std::size_t(type);
+  this->updates[k] += 1;
+  if (start) {
+    if (auto end = Counters::now(); end) {
+      this->counters[k] += *end - *start;
+    }
+  }
+}
+
+Profile::Scope::~Scope() {
+  if (this->start) {
+    if (auto end = Counters::now(); end) {
+      this->profile->add(this->phase, *end - *this->start);
+    }
+  }
+}
+
+void Profile::add(Phase phase, const Counters &c) {
+  std::lock_guard lock(this->m);
+  this->phases[phase] += c;
+}
+
+void Profile::add(const PerType &per_type) {
+  std::lock_guard lock(this->m);
+  for (std::size_t k = 0; k < TYPES; ++k) {
+    this->buildings.counters[k] += per_type.counters[k];
+    this->buildings.updates[k] += per_type.updates[k];
+  }
+}
+
+std::string Profile::report() {
+  std::lock_guard lock(this->m);
+  if (auto why = Counters::unavailable(); !why.empty()) {
+    return std::format("{} ticks, hardware counters unavailable ({})\n",
+                       this->ticks, why);
+  }
+
+  auto res = std::format("{} ticks\n{:<12}{:>14}{:>14}{:>7}{:>10}{:>10}\n",
+                         this->ticks, "", "cycles", "instructions", "IPC",
+                         "cache/ki", "branch/ki");
+  auto row = [&](std::string_view name, const Counters &c) {
+    res += std::format("{:<12}{:>14}{:>14}{:>7.2f}{:>10.2f}{:>10.2f}\n", name,
+                       c.values[Counters::Cycles],
+                       c.values[Counters::Instructions], c.ipc(),
+                       c.per_kilo(Counters::CacheMisses),
+                       c.per_kilo(Counters::BranchMisses));
+  };
+  row("map", this->phases[MapUpdate]);
+  row("value", this->phases[Value]);
+  row("tasks", this->phases[Tasks]);
+  for (std::size_t k = 0; k < TYPES; ++k) {
+    if (this->buildings.updates[k]) {
+      row(std::format("{}", BuildingType(k)), this->buildings.counters[k]);
+    }
+  }
+  return res;
+}
+
+void Profile::reset() {
+  std::lock_guard lock(this->m);
+  this->phases = {};
+  this->buildings = {};
+  this->ticks = 0;
+}
+
+} // namespace shapezx
@@ -0,0 +1,107 @@
+#ifndef SHAPEZX_CORE_PERF
+#define SHAPEZX_CORE_PERF
+
+#include "machine.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace shapezx {
+
+// Hardware counters of the calling thread, read through perf_event_open.
+// Containers and locked-down kernels often refuse them; everything here
+// then reports nothing instead of failing.
+struct Counters {
+  enum Event : std::size_t { Cycles, Instructions, CacheMisses, BranchMisses };
+  static constexpr std::size_t EVENTS = 4;
+
+  std::array<std::uint64_t, EVENTS> values{};
+
+  Counters &operator+=(const Counters &other) {
+    for (std::size_t e = 0; e < EVENTS; ++e) {
+      this->values[e] += other.values[e];
+    }
+    return *this;
+  }
+
+  Counters operator-(const Counters &other) const {
+    auto res = *this;
+    for (std::size_t e = 0; e < EVENTS; ++e) {
+      res.values[e] -= other.values[e];
+    }
+    return res;
+  }
+
+  double ipc() const {
+    return this->values[Cycles]
+               ? double(this->values[Instructions]) / this->values[Cycles]
+               : 0;
+  }
+
+  // misses per 1000 instructions
+  double per_kilo(Event e) const {
+    return this->values[Instructions]
+               ? 1000.0 * this->values[e] / this->values[Instructions]
+               : 0;
+  }
+
+  // The counters of the calling thread so far, nullopt if they cannot be
+  // read. They are opened on first use in every thread.
+  static std::optional<Counters> now();
+
+  // Why now() fails, empty while it works.
+  static std::string unavailable();
+};
+
+// Counters of the phases of State::update, and of the buildings by type.
+// The map phase only counts the thread running State::update, the
+// buildings count every thread that updated them.
+struct Profile {
+  enum Phase : std::size_t { MapUpdate, Value, Tasks };
+  static constexpr std::size_t PHASES = 3;
+  static constexpr std::size_t TYPES =
+      std::size_t(BuildingType::PlaceHolder) + 1;
+
+  struct PerType {
+    std::array<Counters, TYPES> counters{};
+    std::array<std::uint64_t, TYPES> updates{};
+
+    // Adds what the counters advanced since start to type.
+    void add(BuildingType type, const std::optional<Counters> &start);
+  };
+
+  // Adds what the counters advanced while it existed to phase.
+  struct Scope {
+    Profile *profile;
+    Phase phase;
+    std::optional<Counters> start;
+
+    Scope(Profile *profile_, Phase phase_)
+        : profile(profile_), phase(phase_),
+          start(profile_ ? Counters::now() : std::nullopt) {}
+    Scope(const Scope &) = delete;
+    ~Scope();
+  };
+
+  std::mutex m;
+  std::array<Counters, PHASES> phases{};
+  PerType buildings;
+  std::uint64_t ticks = 0;
+
+  void add(Phase phase, const Counters &c);
+
+  void add(const PerType &per_type);
+
+  // A table of everything counted so far.
+  std::string report();
+
+  void reset();
+};
+
+} // namespace shapezx
+
+#endif
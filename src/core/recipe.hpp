@@ -0,0 +1,92 @@
+#ifndef SHAPEZX_CORE_RECIPE
+#define SHAPEZX_CORE_RECIPE
+
+#include "machine.hpp"
+#include "ore.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace shapezx {
+
+using std::array;
+using std::size_t;
+using std::span;
+using std::vector;
+
+struct Stack {
+  const Item *item = nullptr;
+  size_t num = 0;
+};
+
+// Turns inputs into outputs after duration ticks. Unused stacks are left
+// empty, outputs are sent through the output port of the same index.
+struct Recipe {
+  static constexpr size_t MAX_STACKS = 2;
+
+  array<Stack, MAX_STACKS> inputs;
+  array<Stack, MAX_STACKS> outputs;
+  std::uint32_t duration = 1;
+
+  // Number of crafts that can run at once: bounded by max_crafts, by the
+  // inputs in `in` and by keeping at most `capacity` crafts worth of each
+  // output in `out`.
+  size_t batch(const Buffer &in, const Buffer &out, size_t max_crafts,
+               size_t capacity) const {
+    auto n = max_crafts;
+    for (auto const &s : this->inputs) {
+      if (s.item) {
+        n = std::min(n, in.get(*s.item) / s.num);
+      }
+    }
+    for (auto const &s : this->outputs) {
+      if (s.item) {
+        auto held = out.get(*s.item);
+        auto limit = capacity * s.num;
+        n = std::min(n, held < limit ? (limit - held) / s.num : 0);
+      }
+    }
+    return n;
+  }
+
+  void craft(Buffer &in, Buffer &out, size_t n) const {
+    for (auto const &s : this->inputs) {
+      if (s.item) {
+        in.increase(*s.item, -static_cast<ssize_t>(n * s.num));
+      }
+    }
+    for (auto const &s : this->outputs) {
+      if (s.item) {
+        out.increase(*s.item, static_cast<ssize_t>(n * s.num));
+      }
+    }
+  }
+};
+
+inline vector<Item> recipe_inputs(span<const Recipe> recipes) {
+  vector<Item> res;
+  for (auto const &recipe : recipes) {
+    for (auto const &s : recipe.inputs) {
+      if (s.item && std::ranges::find(res, *s.item) == res.end()) {
+        res.push_back(*s.item);
+      }
+    }
+  }
+  return res;
+}
+
+static constexpr array<Recipe, 1> CUTTER_RECIPES{{
+    {
+        .inputs = {Stack{&IRON_ORE, 1}},
+        .outputs = {Stack{&IRON, 1}, Stack{&STONE, 1}},
+        .duration = 1,
+    },
+}};
+
+} // namespace shapezx
+
+#endif
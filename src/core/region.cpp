@@ -0,0 +1,386 @@
+#include "core.hpp"
+#include "image.hpp"
+#include "machine.hpp"
+#include "region.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <ranges>
+#include <unordered_set>
+
+namespace shapezx {
+
+vector<size_t> Map::region_tiles(size_t r) const {
+  auto const rows = this->tile_rows();
+  auto const cols = this->tile_cols();
+  auto const tr = r / this->region_cols() * Pager::REGION;
+  auto const tc = r % this->region_cols() * Pager::REGION;
+
+  vector<size_t> res;
+  for (auto i = tr; i < std::min(tr + Pager::REGION, rows); ++i) {
+    for (auto j = tc; j < std::min(tc + Pager::REGION, cols); ++j) {
+      res.push_back(i * cols + j);
+    }
+  }
+  return res;
+}
+
+void Map::page_to(std::filesystem::path dir, size_t budget) {
+  std::filesystem::create_directories(dir);
+  this->page_to(std::make_shared<Pager>(std::move(dir), budget));
+}
+
+void Map::page_to(std::shared_ptr<Pager> pager) {
+  if (this->paging) {
+    this->paging->pager = std::move(pager);
+    return;
+  }
+
+  auto const n = this->regions();
+  this->paging = Paging{
+      .pager = std::move(pager),
+      .pages = vector<std::shared_ptr<Page>>(n),
+      // nothing is written yet
+      .dirty = vector<char>(this->tiles.size(), 1),
+      .last_used = vector<std::uint64_t>(n, 0),
+  };
+}
+
+size_t Map::paged_buildings(size_t t) const {
+  auto const &paging = *this->paging;
+  if (auto const &page = paging.pages[this->region_of(t)]; page) {
+    return page->buildings;
+  }
+  return paging.image->buildings(t);
+}
+
+ConstChunk Map::peek(vec::Vec2<> pos) {
+  auto [t, i] = this->locate(pos);
+  if (!this->tiles[t] && this->paging && this->paging->image &&
+      !this->paging->pages[this->region_of(t)]) {
+    return {ore_item(this->paging->image->cell(t, i).ore), nullptr};
+  }
+  return this->read(pos);
+}
+
+std::shared_ptr<const Tile> Map::peek_tile(size_t t) const {
+  if (auto const &tile = this->tiles.at(t); tile || !this->paging) {
+    return tile;
+  }
+  auto const r = this->region_of(t);
+  if (!this->paging->pages[r]) {
+    return std::make_shared<const Tile>(this->image_tile(t));
+  }
+  auto const tiles = this->region_tiles(r);
+  auto const k = std::ranges::find(tiles, t) - tiles.begin();
+  return this->peek_region(r)[k];
+}
+
+vector<std::shared_ptr<const Tile>> Map::peek_region(size_t r) const {
+  auto const tiles = this->region_tiles(r);
+  // regions are faulted in and paged out whole
+  if (this->tiles[tiles.front()] || !this->paging) {
+    return tiles |
+           std::views::transform([&](auto t) {
+             return std::shared_ptr<const Tile>(this->tiles[t]);
+           }) |
+           std::ranges::to<vector>();
+  }
+  return this->load_region(r) | std::views::as_rvalue |
+         std::views::transform([](Tile &&tile) {
+           return std::make_shared<const Tile>(std::move(tile));
+         }) |
+         std::ranges::to<vector>();
+}
+
+Tile Map::image_tile(size_t t) const {
+  if (auto tile = this->paging->image->load_tile(t); tile) {
+    return std::move(*tile);
+  }
+  // the chunks of a damaged tile come back as generated, without buildings
+  std::cerr << std::format("tile {} of the image is damaged, left empty\n", t);
+  Tile res;
+  auto const origin = this->tile_origin(t);
+  for (size_t i = 0; i < res.cells.size(); ++i) {
+    auto pos = origin + vec::Vec2<>(i / Tile::SIZE, i % Tile::SIZE);
+    if (this->contains(pos)) {
+      res.cells[i].ore = Map::ore_at(this->seed, pos[0], pos[1]);
+    }
+  }
+  return res;
+}
+
+vector<Tile> Map::load_region(size_t r) const {
+  auto const &paging = *this->paging;
+  vector<Tile> res;
+  if (auto const &page = paging.pages[r]; page) {
+    std::ifstream f(page->path);
+    auto j = json::parse(f);
+    f.close();
+    j.at("tiles").get_to(res);
+    return res;
+  }
+  for (auto t : this->region_tiles(r)) {
+    res.push_back(this->image_tile(t));
+  }
+  return res;
+}
+
+void Map::fault(size_t r) {
+  trace::Span span(this->traced, "page in", "region", r);
+  auto loaded = this->load_region(r);
+  for (auto const [k, t] : std::views::enumerate(this->region_tiles(r))) {
+    auto tile = std::make_shared<Tile>(std::move(loaded[k]));
+    // hashed_ is not saved, but it only depends on what is
+    auto origin = this->tile_origin(t);
+    for (size_t i = 0; i < tile->cells.size(); ++i) {
+      auto pos = origin + vec::Vec2<>(i / Tile::SIZE, i % Tile::SIZE);
+      if (auto *b = tile->anchored(i, pos); b) {
+        b->hashed_ = hash::combine(pos[0] * this->width + pos[1], b->digest());
+      }
+    }
+    this->tiles[t] = std::move(tile);
+    this->paging->dirty[t] = 0;
+  }
+  this->paging->last_used[r] = this->paging->clock;
+}
+
+bool Map::region_dirty(size_t r) const {
+  return std::ranges::any_of(this->region_tiles(r), [&](auto t) {
+    return this->paging->dirty[t] != 0;
+  });
+}
+
+void Map::prefault(std::span<const size_t> todo) {
+  auto &paging = *this->paging;
+  auto const rows = this->tile_rows();
+  auto const cols = this->tile_cols();
+  for (auto r : todo) {
+    for (auto t : this->region_tiles(r)) {
+      if (!this->has_buildings(t)) {
+        continue;
+      }
+      // all a building touches is a few chunks from it, in its tile or one
+      // next to it
+      auto const tr = t / cols;
+      auto const tc = t % cols;
+      for (auto i = tr ? tr - 1 : 0; i < std::min(tr + 2, rows); ++i) {
+        for (auto j = tc ? tc - 1 : 0; j < std::min(tc + 2, cols); ++j) {
+          auto const n = this->region_of(i * cols + j);
+          paging.last_used[n] = paging.clock;
+          if (!this->tiles[i * cols + j]) {
+            this->fault(n);
+          }
+        }
+      }
+    }
+  }
+}
+
+std::shared_ptr<Page> Map::write_page(size_t r) const {
+  trace::Span span(this->traced, "page out", "region", r);
+  auto tiles = json::array();
+  size_t buildings = 0;
+  for (auto const &tile : this->peek_region(r)) {
+    tiles.push_back(json(*tile));
+    buildings += tile->buildings;
+  }
+
+  auto path = this->paging->pager->next_path(r);
+  std::ofstream f(path);
+  f << json{{"tiles", std::move(tiles)}};
+  f.close();
+  return std::make_shared<Page>(std::move(path), buildings, false);
+}
+
+void Map::write_region(size_t r) {
+  this->paging->pages[r] = this->write_page(r);
+  for (auto t : this->region_tiles(r)) {
+    this->paging->dirty[t] = 0;
+  }
+}
+
+void Map::flush() {
+  auto &paging = *this->paging;
+  for (size_t r = 0; r < this->regions(); ++r) {
+    if (!paging.pages[r] || this->region_dirty(r)) {
+      this->write_region(r);
+    }
+  }
+}
+
+size_t Map::resident_bytes() const {
+  return std::ranges::count_if(this->tiles, [](auto const &t) {
+           return t != nullptr;
+         }) *
+         sizeof(Tile);
+}
+
+void Map::page_out() {
+  auto &paging = *this->paging;
+  paging.clock += 1;
+  if (!paging.pager) {
+    return;
+  }
+
+  auto bytes = this->resident_bytes();
+  if (bytes <= paging.pager->budget) {
+    return;
+  }
+
+  // Regions the last tick updated or reached into stay, they would only be
+  // faulted in again by the next one. Should those alone outgrow the budget,
+  // the map stays above it rather than rewriting them every tick.
+  vector<size_t> resident;
+  for (size_t r = 0; r < this->regions(); ++r) {
+    if (this->tiles[this->region_tiles(r).front()] &&
+        paging.last_used[r] + 1 < paging.clock) {
+      resident.push_back(r);
+    }
+  }
+  std::ranges::sort(resident, {},
+                    [&](auto r) { return paging.last_used[r]; });
+
+  for (auto r : resident) {
+    if (bytes <= paging.pager->budget) {
+      break;
+    }
+    // clean regions can be read again from where they came from
+    if ((!paging.pages[r] && !paging.image) || this->region_dirty(r)) {
+      this->write_region(r);
+    }
+    for (auto t : this->region_tiles(r)) {
+      this->tiles[t].reset();
+      bytes -= sizeof(Tile);
+    }
+  }
+}
+
+void Map::save_pages(json &j) const {
+  auto const &paging = *this->paging;
+  auto &pager = *paging.pager;
+
+  auto regions = json::array();
+  vector<std::shared_ptr<Page>> saved;
+  for (size_t r = 0; r < this->regions(); ++r) {
+    auto page = !paging.pages[r] || this->region_dirty(r) ? this->write_page(r)
+                                                          : paging.pages[r];
+    page->keep = true;
+    saved.push_back(page);
+    regions.push_back(json{
+        {"file", page->path.filename().string()},
+        {"buildings", page->buildings},
+    });
+  }
+
+  // pages only the previous save used are removed with their last copy
+  std::unordered_set<const Page *> current;
+  for (auto const &page : saved) {
+    current.insert(page.get());
+  }
+  for (auto const &page : pager.saved) {
+    if (!current.contains(page.get())) {
+      page->keep = false;
+    }
+  }
+  pager.saved = std::move(saved);
+
+  j = {
+      {"height", this->height},
+      {"width", this->width},
+      {"seed", this->seed},
+      {"hash", this->hash_},
+      {"regions",
+       {
+           {"dir", pager.dir.string()},
+           {"budget", pager.budget},
+           {"next", pager.next.load()},
+           {"pages", std::move(regions)},
+       }},
+  };
+}
+
+void Map::load_pages(const json &j) {
+  auto const &regions = j.at("regions");
+  *this = Map();
+  this->height = j.at("height").get<size_t>();
+  this->width = j.at("width").get<size_t>();
+  this->seed = j.value("seed", std::uint64_t(0));
+  this->hash_ = j.at("hash").get<std::uint64_t>();
+  // every tile starts out paged out
+  this->tiles.resize(this->tile_rows() * this->tile_cols());
+
+  auto pager =
+      std::make_shared<Pager>(regions.at("dir").get<std::string>(),
+                              regions.at("budget").get<size_t>());
+  pager->next = regions.at("next").get<std::uint64_t>();
+  this->page_to(pager);
+
+  auto &paging = *this->paging;
+  auto const &pages = regions.at("pages");
+  for (size_t r = 0; r < this->regions(); ++r) {
+    auto page = std::make_shared<Page>(
+        pager->dir / pages.at(r).at("file").get<std::string>(),
+        pages.at(r).at("buildings").get<size_t>(), true);
+    paging.pages[r] = page;
+    pager->saved.push_back(std::move(page));
+  }
+  std::ranges::fill(paging.dirty, 0);
+}
+
+// Cells are packed as ore | slot << 16.
+void to_json(json &j, const Tile &p) {
+  auto cells = p.cells | std::views::transform([](auto const &cell) {
+                 return std::uint32_t(cell.ore) |
+                        std::uint32_t(cell.slot) << 16;
+               }) |
+               std::ranges::to<vector>();
+
+  auto slots = json::array();
+  for (auto const &slot : p.slots) {
+    json building = nullptr;
+    if (slot.building) {
+      building = p.building_json(slot);
+    }
+    slots.push_back(json{
+        {"owner", slot.owner},
+        {"cells", slot.cells},
+        {"anchor", slot.anchor},
+        {"building", std::move(building)},
+    });
+  }
+
+  j = {
+      {"cells", std::move(cells)},
+      {"slots", std::move(slots)},
+      {"buildings", p.buildings},
+  };
+}
+
+void from_json(const json &j, Tile &p) {
+  auto const &cells = j.at("cells");
+  for (size_t i = 0; i < p.cells.size(); ++i) {
+    auto v = cells.at(i).get<std::uint32_t>();
+    p.cells[i] = {
+        .ore = static_cast<std::uint8_t>(v & 0xff),
+        .slot = static_cast<std::uint16_t>(v >> 16),
+    };
+  }
+
+  p.slots.clear();
+  for (auto const &s : j.at("slots")) {
+    auto &slot = p.slots.emplace_back();
+    s.at("owner").get_to(slot.owner);
+    s.at("cells").get_to(slot.cells);
+    s.at("anchor").get_to(slot.anchor);
+    if (auto const &b = s.at("building"); !b.is_null()) {
+      slot.building = load_building(b);
+    }
+  }
+  j.at("buildings").get_to(p.buildings);
+  p.index_belts();
+}
+
+} // namespace shapezx
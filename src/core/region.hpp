@@ -0,0 +1,79 @@
+#ifndef SHAPEZX_CORE_REGION
+#define SHAPEZX_CORE_REGION
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace shapezx {
+
+struct Image;
+
+// A file holding one region of a paged Map, written when the region was
+// paged out or saved. Never modified, so copies of a map can keep reading
+// it. Removed once nothing refers to it unless the last save does.
+struct Page {
+  std::filesystem::path path;
+  // anchors in the region, so idle regions are skipped without loading them
+  std::size_t buildings = 0;
+  std::atomic<bool> keep = false;
+
+  Page(std::filesystem::path path_, std::size_t buildings_, bool keep_)
+      : path(std::move(path_)), buildings(buildings_), keep(keep_) {}
+  Page(const Page &) = delete;
+
+  ~Page() {
+    if (!this->keep) {
+      std::error_code ec;
+      std::filesystem::remove(this->path, ec);
+    }
+  }
+};
+
+// Where the pages of a map and of its copies go.
+struct Pager {
+  // regions are REGION x REGION tiles
+  static constexpr std::size_t REGION = 8;
+
+  std::filesystem::path dir;
+  // bytes of tiles a map keeps resident
+  std::size_t budget;
+  std::atomic<std::uint64_t> next = 0;
+  // pages of the last save
+  std::vector<std::shared_ptr<Page>> saved;
+
+  Pager(std::filesystem::path dir_, std::size_t budget_)
+      : dir(std::move(dir_)), budget(budget_) {}
+
+  std::filesystem::path next_path(std::size_t region) {
+    return this->dir / std::format("{}.{}.json", region, this->next++);
+  }
+};
+
+// Paging state of one map, see Map::page_to() and load_image().
+struct Paging {
+  // null if regions are only loaded, never paged out
+  std::shared_ptr<Pager> pager;
+  // the image the map was loaded from, if any
+  std::shared_ptr<const Image> image;
+  // per region: the file it was last written to, null if never written.
+  // Regions without one are read from the image.
+  std::vector<std::shared_ptr<Page>> pages;
+  // per tile: resident and changed since its region was last written. Kept
+  // per tile so regions updating in parallel never write the same flag.
+  std::vector<char> dirty;
+  // per region: value of clock when it was last faulted in or updated
+  std::vector<std::uint64_t> last_used;
+  // ticks since paging started
+  std::uint64_t clock = 0;
+};
+
+} // namespace shapezx
+
+#endif
@@ -0,0 +1,49 @@
+#include "replay.hpp"
+#include "core.hpp"
+
+#include <fstream>
+#include <variant>
+
+namespace shapezx {
+
+std::optional<CommandLog> CommandLog::load(const std::string &p) try {
+  std::ifstream f(p);
+  auto j = json::parse(f);
+  f.close();
+  auto res = j.get<CommandLog>();
+  if (res.version != VERSION) {
+    return std::nullopt;
+  }
+  return res;
+} catch (const json::exception &) {
+  return std::nullopt;
+}
+
+void CommandLog::save_to(const std::string &p) const {
+  std::ofstream f(p);
+  f << json(*this);
+  f.close();
+}
+
+void apply(const Action &action, State &state, Global &global_state) {
+  if (auto purchase = std::get_if<Purchase>(&action); purchase) {
+    global_state.purchase(purchase->offer);
+  } else {
+    state.execute(action);
+  }
+}
+
+bool Replay::step() {
+  auto &commands = this->log.commands;
+  while (this->next < commands.size() &&
+         commands[this->next].tick <= this->state.tick) {
+    apply(commands[this->next].action, this->state, this->global);
+    this->next += 1;
+  }
+
+  auto i = this->ticks_done();
+  this->state.update(this->global);
+  return this->state.hash() == this->log.hashes.at(i);
+}
+
+} // namespace shapezx
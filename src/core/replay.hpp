@@ -0,0 +1,97 @@
+#ifndef SHAPEZX_CORE_REPLAY
+#define SHAPEZX_CORE_REPLAY
+
+#include "command.hpp"
+#include "core.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace shapezx {
+
+using nlohmann::json;
+
+// Everything needed to reproduce a session: where it started, what the
+// player did and the state hash after every tick.
+struct CommandLog {
+  // Bumped whenever a change to the simulation makes the logs recorded
+  // before it diverge. 1 updated the chunks row by row, 2 tile by tile,
+  // region by region, 3 ran the regions in four phases by the parity of
+  // their row and column, 4 also moves the belts of a tile before its other
+  // buildings, see Map::update().
+  static constexpr std::uint32_t VERSION = 4;
+
+  std::uint32_t version = VERSION;
+  json initial;
+  Global global;
+  std::vector<Command> commands;
+  // hashes[i] is State::hash() after tick initial.tick + i + 1
+  std::vector<std::uint64_t> hashes;
+
+  CommandLog() = default;
+  CommandLog(const State &state, const Global &global_state)
+      : initial(state), global(global_state) {}
+
+  // The log at p, nullopt if it cannot be read or was recorded by another
+  // version, which would not replay the same.
+  static std::optional<CommandLog> load(const std::string &p);
+
+  void record(const Command &cmd) { this->commands.push_back(cmd); }
+
+  // call after every State::update
+  void record_tick(const State &state) {
+    this->hashes.push_back(state.hash());
+  }
+
+  void save_to(const std::string &p) const;
+};
+
+inline void to_json(json &j, const CommandLog &p) {
+  j = {
+      {"version", p.version}, {"initial", p.initial},
+      {"global", p.global},   {"commands", p.commands},
+      {"hashes", p.hashes},
+  };
+}
+
+// logs from before versions were recorded are version 1
+inline void from_json(const json &j, CommandLog &p) {
+  p.version = j.value("version", std::uint32_t(1));
+  j.at("initial").get_to(p.initial);
+  j.at("global").get_to(p.global);
+  j.at("commands").get_to(p.commands);
+  j.at("hashes").get_to(p.hashes);
+}
+
+// Applies a recorded action, purchases go to global_state.
+void apply(const Action &action, State &state, Global &global_state);
+
+// Re-runs a CommandLog from its initial state.
+struct Replay {
+  const CommandLog &log;
+  State state;
+  Global global;
+  std::uint64_t start = this->state.tick;
+  // index of the next command to apply
+  std::size_t next = 0;
+
+  explicit Replay(const CommandLog &log_)
+      : log(log_), state(log_.initial.get<State>()), global(log_.global) {}
+
+  std::uint64_t ticks_done() const { return this->state.tick - this->start; }
+
+  bool done() const { return this->ticks_done() >= this->log.hashes.size(); }
+
+  // Applies the commands taken before the current tick and runs it. Returns
+  // false if the resulting hash differs from the recorded one.
+  bool step();
+};
+
+} // namespace shapezx
+
+#endif
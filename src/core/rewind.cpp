@@ -0,0 +1,89 @@
+#include "rewind.hpp"
+#include "replay.hpp"
+#include "usage.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <ranges>
+#include <utility>
+
+namespace shapezx {
+
+Rewind::Rewind(const State &state, const Global &global_state, Config config_)
+    : config(config_) {
+  this->keyframes.push_back({state.snapshot(), global_state});
+}
+
+void Rewind::record_tick(const State &state, const Global &global_state) {
+  if (state.tick % this->config.interval != 0) {
+    return;
+  }
+  // the previous keyframe only changes relative to this one from now on
+  auto &previous = this->keyframes.back();
+  previous.held = unshared(previous.state.map, state.map);
+  this->held += previous.held;
+  this->keyframes.push_back({state.snapshot(), global_state});
+  this->trim();
+}
+
+std::size_t Rewind::unshared(const Map &older, const Map &newer) {
+  // a tile is only ever replaced in place, so older shares it with newer
+  // exactly when the pointers are equal. Paged out tiles hold nothing.
+  std::size_t res = 0;
+  for (auto const [t, tile] : std::views::enumerate(older.tiles)) {
+    if (tile && (std::cmp_greater_equal(t, newer.tiles.size()) ||
+                 tile != newer.tiles[t])) {
+      res += Usage::bytes_of(*tile);
+    }
+  }
+  return res;
+}
+
+std::size_t Rewind::memory(const Map &live) const {
+  return this->held + unshared(this->keyframes.back().state.map, live);
+}
+
+void Rewind::trim() {
+  auto const now = this->keyframes.back().state.tick;
+  // the newest keyframe was just taken and still shares every tile with the
+  // live map, the older ones hold what their held says. The newest one is
+  // always kept so that the present stays reachable.
+  while (this->keyframes.size() > 1 &&
+         (now - this->oldest() > this->config.horizon ||
+          this->held > this->config.budget)) {
+    this->held -= this->keyframes.front().held;
+    this->keyframes.pop_front();
+  }
+
+  auto const first = std::ranges::find_if(
+      this->commands,
+      [oldest = this->oldest()](auto const &c) { return c.tick >= oldest; });
+  this->commands.erase(this->commands.begin(), first);
+}
+
+std::optional<std::pair<State, Global>>
+Rewind::seek(std::uint64_t tick) const {
+  if (tick < this->oldest()) {
+    return std::nullopt;
+  }
+
+  // last keyframe not after tick
+  auto const it = std::ranges::upper_bound(
+      this->keyframes, tick, {},
+      [](auto const &keyframe) { return keyframe.state.tick; });
+  auto const &keyframe = *std::prev(it);
+
+  auto state = keyframe.state.snapshot();
+  auto global = keyframe.global;
+  auto next = std::ranges::lower_bound(
+      this->commands, state.tick, {}, [](auto const &c) { return c.tick; });
+  while (state.tick < tick) {
+    for (; next != this->commands.end() && next->tick <= state.tick; ++next) {
+      apply(next->action, state, global);
+    }
+    state.update(global);
+  }
+  return std::pair{std::move(state), std::move(global)};
+}
+
+} // namespace shapezx
@@ -0,0 +1,75 @@
+#ifndef SHAPEZX_CORE_REWIND
+#define SHAPEZX_CORE_REWIND
+
+#include "command.hpp"
+#include "core.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace shapezx {
+
+// Recent history of a game, for jumping back to any tick of the last few
+// minutes. Keeps a snapshot every `interval` ticks plus the commands taken
+// since the oldest one; seeking copies the closest snapshot and re-runs the
+// ticks in between.
+struct Rewind {
+  struct Config {
+    // ticks between snapshots, also the most ticks a seek has to re-run
+    std::uint64_t interval = 200;
+    // how far back seeking can go, in ticks
+    std::uint64_t horizon = 20 * 60 * 10;
+    // bytes of map tiles the snapshots may keep alive on their own
+    std::size_t budget = std::size_t(256) << 20;
+  };
+
+  struct Keyframe {
+    State state;
+    Global global;
+    // bytes of the tiles it does not share with the next keyframe, set once
+    // that is taken
+    std::size_t held = 0;
+  };
+
+  Config config;
+  // oldest first
+  std::deque<Keyframe> keyframes;
+  // Keyframe::held summed over keyframes
+  std::size_t held = 0;
+  // sorted by tick, none older than keyframes.front()
+  std::vector<Command> commands;
+
+  Rewind(const State &state, const Global &global_state)
+      : Rewind(state, global_state, Config{}) {}
+  Rewind(const State &state, const Global &global_state, Config config_);
+
+  void record(const Command &cmd) { this->commands.push_back(cmd); }
+
+  // call after every State::update
+  void record_tick(const State &state, const Global &global_state);
+
+  std::uint64_t oldest() const { return this->keyframes.front().state.tick; }
+
+  // Bytes of tiles held by the snapshots but no longer by the live map.
+  std::size_t memory(const Map &live) const;
+
+  // The game as it was right after the given tick, or nullopt if the tick
+  // is older than oldest(). Ticks after the last recorded one are run with
+  // no further commands.
+  std::optional<std::pair<State, Global>> seek(std::uint64_t tick) const;
+
+private:
+  void trim();
+
+  // Bytes of the tiles of older that newer does not share, see
+  // Usage::bytes_of().
+  static std::size_t unshared(const Map &older, const Map &newer);
+};
+
+} // namespace shapezx
+
+#endif
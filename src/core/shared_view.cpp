@@ -0,0 +1,230 @@
+#include "shared_view.hpp"
+#include "machine.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <ranges>
+#include <utility>
+
+namespace shapezx {
+
+namespace {
+
+constexpr std::size_t align(std::size_t n) { return (n + 63) / 64 * 64; }
+
+SharedView::ViewCell *cells_of(std::uint8_t *frame) {
+  return reinterpret_cast<SharedView::ViewCell *>(
+      frame + align(sizeof(SharedView::Frame)));
+}
+
+// Writes the cells of tile t, the ore and whatever building covers them.
+// False if the tile is paged out, nothing is written then. Buildings
+// anchored in a paged out tile are left out.
+bool write_tile(const Map &map, std::size_t t, SharedView::ViewCell *cells) {
+  auto const *loaded = map.loaded(t);
+  if (!loaded) {
+    return false;
+  }
+  auto const &tile = *loaded;
+  auto const origin = map.tile_origin(t);
+  for (std::size_t i = 0; i < tile.cells.size(); ++i) {
+    auto pos = origin + vec::Vec2<>(i / Tile::SIZE, i % Tile::SIZE);
+    if (!map.contains(pos)) {
+      continue;
+    }
+    SharedView::ViewCell cell{.ore = tile.cells[i].ore};
+    if (auto const s = tile.cells[i].slot; s != 0) {
+      auto const anchor = tile.slots[s - 1].anchor;
+      auto const [at, k] = map.locate(anchor);
+      auto const *owner = map.loaded(at);
+      if (auto const *b = owner ? owner->anchored(k, anchor) : nullptr; b) {
+        auto const info = b->info();
+        cell.building = std::uint8_t(info.type) + 1;
+        cell.direction = std::uint8_t(info.direction);
+        cell.anchor = anchor == pos;
+      }
+    }
+    cells[pos[0] * map.width + pos[1]] = cell;
+  }
+  return true;
+}
+
+} // namespace
+
+SharedView::~SharedView() {
+  if (this->data) {
+    munmap(this->data, this->size);
+  }
+  if (this->owner) {
+    shm_unlink(this->name.c_str());
+  }
+}
+
+std::unique_ptr<SharedView> SharedView::create(const std::string &name,
+                                               const Map &map) {
+  auto const frame_size =
+      align(sizeof(Frame)) + align(map.height * map.width * sizeof(ViewCell));
+  auto const size = align(sizeof(Header)) + 2 * frame_size;
+
+  // a view left over by a process that died is replaced
+  shm_unlink(name.c_str());
+  auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    return nullptr;
+  }
+  if (ftruncate(fd, size) != 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+  auto *data =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+
+  auto res = std::make_unique<SharedView>();
+  res->name = name;
+  res->owner = true;
+  res->data = static_cast<std::uint8_t *>(data);
+  res->size = size;
+
+  auto *header = new (res->data) Header();
+  header->height = map.height;
+  header->width = map.width;
+  header->frame_size = frame_size;
+
+  // ore only changes with the map, written once for both frames
+  for (std::uint32_t f = 0; f < 2; ++f) {
+    auto *cells = cells_of(res->frame_at(f));
+    for (std::size_t t = 0; t < map.tiles.size(); ++t) {
+      if (write_tile(map, t, cells)) {
+        continue;
+      }
+      // paged out, its ore is the generated one
+      auto const origin = map.tile_origin(t);
+      for (auto r = origin[0]; r < origin[0] + Tile::SIZE; ++r) {
+        for (auto c = origin[1]; c < origin[1] + Tile::SIZE; ++c) {
+          if (map.contains({r, c})) {
+            cells[r * map.width + c].ore = Map::ore_at(map.seed, r, c);
+          }
+        }
+      }
+    }
+    res->written[f] = std::views::iota(std::size_t(0), map.tiles.size()) |
+                      std::views::transform([&](std::size_t t) {
+                        return char(map.has_buildings(t));
+                      }) |
+                      std::ranges::to<std::vector>();
+  }
+  return res;
+}
+
+std::unique_ptr<SharedView> SharedView::attach(const std::string &name) {
+  auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(Header)) {
+    close(fd);
+    return nullptr;
+  }
+  auto *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  auto res = std::make_unique<SharedView>();
+  res->name = name;
+  res->data = static_cast<std::uint8_t *>(data);
+  res->size = st.st_size;
+  auto const &header = res->header();
+  if (header.magic != MAGIC || header.version != VERSION ||
+      align(sizeof(Header)) + 2 * header.frame_size > res->size) {
+    return nullptr;
+  }
+  return res;
+}
+
+std::uint8_t *SharedView::frame_at(std::uint32_t i) const {
+  return this->data + align(sizeof(Header)) + i * this->header().frame_size;
+}
+
+void SharedView::publish(const State &state, const Global &global) {
+  auto &header = this->header();
+  auto const i = 1 - header.current.load(std::memory_order_relaxed);
+  auto *frame = this->frame_at(i);
+
+  header.seq[i].fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  Frame f{
+      .tick = state.tick,
+      .value = global.value,
+      .hash = state.hash(),
+      .tasks = std::uint32_t(state.tasks.size()),
+      .tasks_done = std::uint32_t(std::ranges::count_if(
+          state.tasks, [](auto const &t) { return t.completed_; })),
+  };
+  for (auto const &[item, count] : state.store.items) {
+    if (f.store_size == MAX_STORE) {
+      break;
+    }
+    auto &entry = f.store[f.store_size++];
+    item.name.copy(entry.name, sizeof(entry.name) - 1);
+    entry.count = count;
+  }
+  std::memcpy(frame, &f, sizeof(f));
+
+  // the view keeps the size it was created with
+  auto const &map = state.map;
+  if (map.height == header.height && map.width == header.width) {
+    auto *cells = cells_of(frame);
+    auto &written = this->written[i];
+    written.resize(map.tiles.size(), 1);
+    for (std::size_t t = 0; t < map.tiles.size(); ++t) {
+      auto const busy = map.has_buildings(t);
+      // paged out tiles keep what the frame had, and are written once back
+      if ((busy || written[t]) && write_tile(map, t, cells)) {
+        written[t] = busy;
+      }
+    }
+  }
+
+  header.seq[i].fetch_add(1, std::memory_order_release);
+  header.current.store(i, std::memory_order_release);
+}
+
+std::optional<SharedView::Snapshot> SharedView::read() const {
+  auto const &header = this->header();
+  auto const cells = header.height * header.width;
+  Snapshot res{.cells = std::vector<ViewCell>(cells)};
+
+  for (int attempt = 0; attempt < 8; ++attempt) {
+    auto const i = header.current.load(std::memory_order_acquire);
+    auto const before = header.seq[i].load(std::memory_order_acquire);
+    if (before % 2 != 0) {
+      continue;
+    }
+    auto *frame = this->frame_at(i);
+    std::memcpy(&res.frame, frame, sizeof(Frame));
+    std::memcpy(res.cells.data(), cells_of(frame), cells * sizeof(ViewCell));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header.seq[i].load(std::memory_order_relaxed) == before) {
+      return res;
+    }
+  }
+  return std::nullopt;
+}
+
+} // namespace shapezx
@@ -0,0 +1,109 @@
+#ifndef SHAPEZX_CORE_SHARED_VIEW
+#define SHAPEZX_CORE_SHARED_VIEW
+
+#include "core.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace shapezx {
+
+// What a running game looks like, in POSIX shared memory. The process
+// running the game publishes a frame after every tick, any number of
+// viewers read it without ever making the writer wait.
+//
+// Layout: Header, then two frames of frame_size bytes, each a Frame
+// followed by height * width ViewCells, row-major. The writer fills the
+// frame that is not current and then flips current. A reader copies the
+// current frame and retries if seq of that frame changed meanwhile.
+struct SharedView {
+  static constexpr std::uint64_t MAGIC = 0x5756585a50414853ULL; // "SHAPZXVW"
+  static constexpr std::uint32_t VERSION = 1;
+  static constexpr std::size_t MAX_STORE = 32;
+
+  struct Header {
+    std::uint64_t magic = MAGIC;
+    std::uint32_t version = VERSION;
+    std::uint32_t reserved_ = 0;
+    std::uint64_t height = 0;
+    std::uint64_t width = 0;
+    std::uint64_t frame_size = 0;
+    // the frame to read
+    std::atomic<std::uint32_t> current = 0;
+    // odd while frame i is being written
+    std::atomic<std::uint64_t> seq[2] = {0, 0};
+  };
+
+  struct StoreEntry {
+    // truncated item name, NUL-terminated
+    char name[24] = {};
+    std::uint64_t count = 0;
+  };
+
+  struct Frame {
+    std::uint64_t tick = 0;
+    std::uint64_t value = 0;
+    std::uint64_t hash = 0;
+    std::uint32_t tasks = 0;
+    std::uint32_t tasks_done = 0;
+    std::uint32_t store_size = 0;
+    std::uint32_t reserved_ = 0;
+    StoreEntry store[MAX_STORE];
+  };
+
+  struct ViewCell {
+    std::uint8_t ore = 0;
+    // BuildingType + 1, 0 if there is no building
+    std::uint8_t building = 0;
+    std::uint8_t direction = 0;
+    // 1 on the chunk the building is anchored to
+    std::uint8_t anchor = 0;
+  };
+
+  // a frame copied out of the shared memory
+  struct Snapshot {
+    Frame frame;
+    std::vector<ViewCell> cells;
+  };
+
+  std::string name;
+  bool owner = false;
+  std::uint8_t *data = nullptr;
+  std::size_t size = 0;
+  // tiles that had buildings when frame i was last written, their cells
+  // are rewritten until they have none
+  std::vector<char> written[2];
+
+  SharedView() = default;
+  SharedView(const SharedView &) = delete;
+  ~SharedView();
+
+  // Creates the shared memory object name for a map of the given size and
+  // fills both frames with the ore of map. The object is removed again when
+  // the view is destroyed.
+  static std::unique_ptr<SharedView> create(const std::string &name,
+                                            const Map &map);
+
+  // Maps an existing view read-only, nullptr if there is none.
+  static std::unique_ptr<SharedView> attach(const std::string &name);
+
+  Header &header() const { return *reinterpret_cast<Header *>(this->data); }
+
+  std::uint8_t *frame_at(std::uint32_t i) const;
+
+  // Writes state and global into the frame that is not current and makes
+  // it current. Only cells of tiles with buildings are written.
+  void publish(const State &state, const Global &global);
+
+  // The current frame, nullopt if the writer kept overwriting it.
+  std::optional<Snapshot> read() const;
+};
+
+} // namespace shapezx
+
+#endif
@@ -2,17 +2,32 @@
 #include "core.hpp"
 
 namespace shapezx {
-bool Task::update(State &ctx) {
+std::vector<Item> Task::missing(const Buffer &store) {
+  std::vector<Item> res;
   if (!this->completed_) {
-    for (auto [item, num] : this->target_.items) {
-      if (ctx.store.get(item) < num) {
-        return false;
+    for (auto const &[item, num] : this->target_.items) {
+      if (store.get(item) < num) {
+        res.push_back(item);
       }
     }
+  }
+  this->unmet_ = res.size();
+  return res;
+}
 
-    this->completed_ = true;
-    return true;
+bool Task::progress(const Item &item, std::size_t before, std::size_t after) {
+  if (this->completed_) {
+    return false;
+  }
+
+  auto target = this->target_.get(item);
+  if (before < target && after >= target) {
+    this->unmet_ -= 1;
+    if (this->unmet_ == 0) {
+      this->completed_ = true;
+      return true;
+    }
   }
   return false;
 }
-} // namespace shapezx
\ No newline at end of file
+} // namespace shapezx
@@ -5,17 +5,27 @@
 
 #include <nlohmann/json.hpp>
 
+#include <cstddef>
+#include <vector>
+
 namespace shapezx {
 
 struct Task {
   Buffer target_;
   bool completed_ = false;
+  // number of target items not reached yet, maintained by State
+  std::size_t unmet_ = 0;
+
+  // Recounts unmet_ against store and returns the items still missing.
+  std::vector<Item> missing(const Buffer &store);
 
-  bool update(State &ctx);
+  // Called when the stored amount of item went from before to after. Returns
+  // true if that completed the task.
+  bool progress(const Item &item, std::size_t before, std::size_t after);
 };
 
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Task, target_, completed_);
 
 } // namespace shapezx
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,175 @@
+#include "trace.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+namespace shapezx::trace {
+
+using nlohmann::json;
+
+namespace {
+
+// Every field is atomic so that dumping while others record is well
+// defined. seq is 2n + 1 while the n-th event is written into the slot and
+// 2n + 2 once it is complete.
+struct Slot {
+  std::atomic<std::uint64_t> seq{0};
+  std::atomic<const char *> name{nullptr};
+  std::atomic<const char *> arg_name{nullptr};
+  std::atomic<std::uint64_t> arg{0};
+  std::atomic<std::uint64_t> begin{0};
+  std::atomic<std::uint64_t> end{0};
+  std::atomic<std::uint32_t> thread{0};
+};
+
+std::array<Slot, CAPACITY> ring;
+// number of events recorded so far
+std::atomic<std::uint64_t> head{0};
+std::atomic<std::uint32_t> threads{0};
+// end of the tick that was dumped last
+std::atomic<std::uint64_t> last_dump{0};
+
+constexpr std::uint64_t COOLDOWN_NS = 10'000'000'000;
+
+} // namespace
+
+std::uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void record(const Event &e) {
+  thread_local auto const thread =
+      threads.fetch_add(1, std::memory_order_relaxed) + 1;
+  auto const n = head.fetch_add(1, std::memory_order_relaxed);
+  auto &s = ring[n % CAPACITY];
+
+  s.seq.store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.name.store(e.name, std::memory_order_relaxed);
+  s.arg_name.store(e.arg_name, std::memory_order_relaxed);
+  s.arg.store(e.arg, std::memory_order_relaxed);
+  s.begin.store(e.begin, std::memory_order_relaxed);
+  s.end.store(e.end, std::memory_order_relaxed);
+  s.thread.store(thread, std::memory_order_relaxed);
+  s.seq.store(2 * n + 2, std::memory_order_release);
+}
+
+std::vector<Event> recent(double seconds) {
+  auto const t = now();
+  auto const window = std::uint64_t(seconds * 1e9);
+  auto const since = t > window ? t - window : 0;
+  auto const last = head.load(std::memory_order_acquire);
+  auto const first = last > CAPACITY ? last - CAPACITY : 0;
+
+  std::vector<Event> res;
+  for (auto n = first; n < last; ++n) {
+    auto const &s = ring[n % CAPACITY];
+    if (s.seq.load(std::memory_order_acquire) != 2 * n + 2) {
+      continue;
+    }
+    Event e{
+        .name = s.name.load(std::memory_order_relaxed),
+        .arg_name = s.arg_name.load(std::memory_order_relaxed),
+        .arg = s.arg.load(std::memory_order_relaxed),
+        .begin = s.begin.load(std::memory_order_relaxed),
+        .end = s.end.load(std::memory_order_relaxed),
+        .thread = s.thread.load(std::memory_order_relaxed),
+    };
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // overwritten while it was read
+    if (s.seq.load(std::memory_order_relaxed) != 2 * n + 2) {
+      continue;
+    }
+    if (e.end >= since) {
+      res.push_back(e);
+    }
+  }
+  std::ranges::sort(res, {}, &Event::begin);
+  return res;
+}
+
+namespace {
+
+// Writes events to path as Chrome trace JSON, false if that fails.
+bool write(const std::vector<Event> &recorded, const std::string &path) {
+  auto events = json::array();
+  for (auto const &e : recorded) {
+    json j{
+        {"name", e.name},
+        {"ph", "X"},
+        {"pid", 1},
+        {"tid", e.thread},
+        // microseconds
+        {"ts", e.begin / 1e3},
+        {"dur", (e.end - e.begin) / 1e3},
+    };
+    if (e.arg_name) {
+      j["args"] = {{e.arg_name, e.arg}};
+    }
+    events.push_back(std::move(j));
+  }
+
+  std::ofstream f(path);
+  f << json{{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}};
+  f.close();
+  return bool(f);
+}
+
+} // namespace
+
+bool dump(const std::string &path, double seconds) {
+  return write(recent(seconds), path);
+}
+
+std::string dump_dir() {
+  if (auto const *dir = std::getenv("SHAPEZX_TRACE_DIR"); dir) {
+    return dir;
+  }
+  std::error_code ec;
+  auto tmp = std::filesystem::temp_directory_path(ec);
+  return ec ? "." : tmp.string();
+}
+
+void end_tick(std::uint64_t tick, std::uint64_t begin) {
+  auto const end = now();
+  record({.name = "tick",
+          .arg_name = "tick",
+          .arg = tick,
+          .begin = begin,
+          .end = end});
+  if (end - begin <= BUDGET_NS) {
+    return;
+  }
+
+  auto last = last_dump.load(std::memory_order_relaxed);
+  if ((last && end - last < COOLDOWN_NS) ||
+      !last_dump.compare_exchange_strong(last, end)) {
+    return;
+  }
+  auto path = (std::filesystem::path(dump_dir()) /
+               std::format("shapezx-tick-{}.json", tick))
+                  .string();
+  // the events are copied now, serializing and writing them is left to a
+  // thread of its own so that the next tick is not held up as well
+  std::thread([events = recent(), path = std::move(path), tick,
+               ms = (end - begin) / 1e6]() {
+    if (write(events, path)) {
+      std::cerr << std::format("tick {} took {:.1f}ms, trace written to {}\n",
+                               tick, ms, path);
+    }
+  }).detach();
+}
+
+} // namespace shapezx::trace
@@ -0,0 +1,77 @@
+#ifndef SHAPEZX_CORE_TRACE
+#define SHAPEZX_CORE_TRACE
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Flight recorder: spans of the last few seconds, kept in a fixed ring shared
+// by all threads and written out as Chrome trace JSON, which Perfetto opens.
+// Recording a span costs two clock reads and a few relaxed stores. Ticks are
+// only recorded for the states that set State::traced, so that copies being
+// simulated on the side neither fill the ring nor trigger dumps.
+namespace shapezx::trace {
+
+struct Event {
+  // names are string literals, only the pointers are kept
+  const char *name = nullptr;
+  // name of arg, nullptr if the event has none
+  const char *arg_name = nullptr;
+  std::uint64_t arg = 0;
+  // steady clock, in nanoseconds
+  std::uint64_t begin = 0;
+  std::uint64_t end = 0;
+  // small number given to every thread that records
+  std::uint32_t thread = 0;
+};
+
+inline constexpr std::size_t CAPACITY = std::size_t(1) << 15;
+// a tick taking longer dumps the recorder, see end_tick()
+inline constexpr std::uint64_t BUDGET_NS = 50'000'000;
+// seconds of events in a dump
+inline constexpr double WINDOW = 5;
+
+std::uint64_t now();
+
+void record(const Event &e);
+
+// Records the time between its construction and destruction, unless it was
+// created off.
+struct Span {
+  Event event;
+  bool on = true;
+
+  explicit Span(const char *name, const char *arg_name = nullptr,
+                std::uint64_t arg = 0)
+      : Span(true, name, arg_name, arg) {}
+  Span(bool on_, const char *name, const char *arg_name = nullptr,
+       std::uint64_t arg = 0)
+      : event{name, arg_name, arg, on_ ? now() : 0}, on(on_) {}
+  Span(const Span &) = delete;
+  ~Span() {
+    if (this->on) {
+      this->event.end = now();
+      record(this->event);
+    }
+  }
+};
+
+// Events that ended in the last seconds, by their beginning. Events being
+// written meanwhile are left out.
+std::vector<Event> recent(double seconds = WINDOW);
+
+// Writes recent(seconds) to path, false if that fails.
+bool dump(const std::string &path, double seconds = WINDOW);
+
+// SHAPEZX_TRACE_DIR if set, the temporary directory otherwise
+std::string dump_dir();
+
+// Records tick as a span since begin. If it went over BUDGET_NS, dumps the
+// recorder into dump_dir(), at most once every few seconds. The dump is
+// written in the background, the caller only waits for recent().
+void end_tick(std::uint64_t tick, std::uint64_t begin);
+
+} // namespace shapezx::trace
+
+#endif
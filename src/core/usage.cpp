@@ -0,0 +1,145 @@
+#include "usage.hpp"
+#include "machine.hpp"
+
+#include <algorithm>
+#include <format>
+
+namespace shapezx {
+
+namespace {
+
+template <typename T> std::uint64_t capacity_bytes(const vector<T> &v) {
+  return v.capacity() * sizeof(T);
+}
+
+std::uint64_t object_size(BuildingType type) {
+  switch (type) {
+  case BuildingType::Miner:
+    return sizeof(Miner);
+  case BuildingType::Belt:
+    return sizeof(Belt);
+  case BuildingType::Cutter:
+    return sizeof(Cutter);
+  case BuildingType::TrashCan:
+    return sizeof(TrashCan);
+  case BuildingType::TaskCenter:
+    return sizeof(TaskCenter);
+  case BuildingType::PlaceHolder:
+    break;
+  }
+  return 0;
+}
+
+// Entries, their nodes and the bucket array, as libstdc++ lays them out.
+std::uint64_t buffer_bytes(const Buffer &buffer) {
+  using Node = std::pair<std::pair<const Item, size_t>, std::array<void *, 2>>;
+  return buffer.items.size() * sizeof(Node) +
+         buffer.items.bucket_count() * sizeof(void *);
+}
+
+std::uint64_t buffers_of(const Building &b) {
+  switch (b.info().type) {
+  case BuildingType::Miner:
+    return buffer_bytes(static_cast<const Miner &>(b).ores);
+  case BuildingType::Belt:
+    return buffer_bytes(static_cast<const Belt &>(b).buffer);
+  case BuildingType::Cutter: {
+    auto const &cutter = static_cast<const Cutter &>(b);
+    return buffer_bytes(cutter.in) + buffer_bytes(cutter.out);
+  }
+  case BuildingType::TaskCenter:
+    return buffer_bytes(static_cast<const TaskCenter &>(b).buffer);
+  case BuildingType::TrashCan:
+  case BuildingType::PlaceHolder:
+    break;
+  }
+  return 0;
+}
+
+std::string bytes(std::uint64_t n) {
+  if (n >= std::uint64_t(1) << 20) {
+    return std::format("{:.1f} MiB", n / double(1 << 20));
+  }
+  if (n >= 1 << 10) {
+    return std::format("{:.1f} KiB", n / double(1 << 10));
+  }
+  return std::format("{} B", n);
+}
+
+} // namespace
+
+Usage Usage::of(const State &state) {
+  Usage res;
+  auto const &map = state.map;
+  res.tiles = capacity_bytes(map.tiles);
+  // paged out tiles take no memory, and are not loaded to be counted
+  for (auto const &tile : map.tiles) {
+    if (!tile) {
+      continue;
+    }
+    res.resident_tiles += 1;
+    res.tiles += sizeof(Tile) + capacity_bytes(tile->slots) +
+                 capacity_bytes(tile->belts.cells) +
+                 capacity_bytes(tile->belts.progress) +
+                 capacity_bytes(tile->belts.busy);
+    for (auto const &slot : tile->slots) {
+      if (slot.building) {
+        auto const k = std::size_t(slot.building->info().type);
+        res.buildings[k] += object_size(slot.building->info().type);
+        res.building_counts[k] += 1;
+      } else if (!slot.empty()) {
+        res.placeholders += sizeof(Slot);
+        res.placeholder_count += 1;
+      }
+    }
+  }
+  res.tiles -= res.placeholders;
+  res.buffers = memory::live_bytes(memory::Kind::Buffers);
+  for (std::size_t s = 0; s < memory::STAGES; ++s) {
+    res.json[s] = memory::staged(memory::Stage(s));
+  }
+  return res;
+}
+
+std::uint64_t Usage::bytes_of(const Tile &tile) {
+  auto res = sizeof(Tile) + capacity_bytes(tile.slots) +
+             capacity_bytes(tile.belts.cells) +
+             capacity_bytes(tile.belts.progress) +
+             capacity_bytes(tile.belts.busy);
+  for (auto const &slot : tile.slots) {
+    if (slot.building) {
+      res += object_size(slot.building->info().type) +
+             buffers_of(*slot.building);
+    }
+  }
+  return res;
+}
+
+std::string Usage::report(
+    std::span<const std::pair<std::string, std::uint64_t>> extra) const {
+  auto res = std::format("{:<18}{:>12}{:>10}\n", "", "bytes", "count");
+  auto row = [&](std::string_view name, std::uint64_t n, std::uint64_t count) {
+    res += std::format("{:<18}{:>12}{:>10}\n", name, bytes(n), count);
+  };
+  row("tiles", this->tiles, this->resident_tiles);
+  row("placeholders", this->placeholders, this->placeholder_count);
+  for (std::size_t k = 0; k < TYPES; ++k) {
+    if (this->building_counts[k]) {
+      row(std::format("{}", BuildingType(k)), this->buildings[k],
+          this->building_counts[k]);
+    }
+  }
+  res += std::format("{:<18}{:>12}\n", "buffers",
+                     bytes(std::max<std::int64_t>(this->buffers, 0)));
+  for (std::size_t s = 0; s < memory::STAGES; ++s) {
+    res += std::format("{:<18}{:>12}\n",
+                       std::format("json {}", memory::STAGE_NAMES[s]),
+                       alloc::TRACKED ? bytes(this->json[s]) : "untracked");
+  }
+  for (auto const &[name, n] : extra) {
+    res += std::format("{:<18}{:>12}\n", name, bytes(n));
+  }
+  return res;
+}
+
+} // namespace shapezx
@@ -0,0 +1,51 @@
+#ifndef SHAPEZX_CORE_USAGE
+#define SHAPEZX_CORE_USAGE
+
+#include "core.hpp"
+#include "memory.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <utility>
+
+namespace shapezx {
+
+// Bytes a game holds, by structure. Taken from the sizes of the objects and
+// the capacities of their containers, except for Buffer contents, which
+// memory::Allocator counts for every Buffer of the process.
+struct Usage {
+  static constexpr std::size_t TYPES =
+      std::size_t(BuildingType::PlaceHolder) + 1;
+
+  // resident tiles with the vectors they own, without placeholders
+  std::uint64_t tiles = 0;
+  std::uint64_t resident_tiles = 0;
+  // slots of cells covered by a building anchored in another tile
+  std::uint64_t placeholders = 0;
+  std::uint64_t placeholder_count = 0;
+  // building objects by type, their Buffers are in buffers
+  std::array<std::uint64_t, TYPES> buildings{};
+  std::array<std::uint64_t, TYPES> building_counts{};
+  std::int64_t buffers = 0;
+  // see memory::json_staged
+  std::array<std::uint64_t, memory::STAGES> json{};
+
+  static Usage of(const State &state);
+
+  // Bytes tile owns: the vectors and buildings counted by of(), plus the
+  // contents of their Buffers. Unlike memory::live_bytes(), which of() uses
+  // for those, this can be told apart per tile, but it is an estimate.
+  static std::uint64_t bytes_of(const Tile &tile);
+
+  // A table of everything, with rows of extra, e.g. from the UI, at the end.
+  std::string
+  report(std::span<const std::pair<std::string, std::uint64_t>> extra = {})
+      const;
+};
+
+} // namespace shapezx
+
+#endif
@@ -0,0 +1,61 @@
+#include "what_if.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+namespace shapezx {
+
+namespace {
+
+Outcome run(const State &base, const Global &global_state, const Place &place,
+            std::uint64_t ticks) {
+  Outcome res;
+  auto state = base.snapshot();
+  auto global = global_state;
+  if (!place.entries.empty() && state.execute(place).placed.empty()) {
+    return res;
+  }
+  res.placed = true;
+
+  for (std::uint64_t i = 0; i < ticks; ++i) {
+    state.update(global);
+  }
+
+  for (auto const &[item, num] : state.store.items) {
+    if (auto before = base.store.get(item); num > before) {
+      res.store.set(item, num - before);
+    }
+  }
+  res.value = global.value - global_state.value;
+  return res;
+}
+
+} // namespace
+
+std::vector<Outcome> evaluate(State base, Global global_state,
+                              const std::vector<Place> &candidates,
+                              std::uint64_t ticks, std::size_t workers) {
+  std::vector<Outcome> res(candidates.size());
+  if (candidates.empty()) {
+    return res;
+  }
+  std::atomic<std::size_t> next = 0;
+  auto work = [&]() {
+    // each copy only unshares the tiles it writes to, base is never written
+    for (auto i = next++; i < candidates.size(); i = next++) {
+      res[i] = run(base, global_state, candidates[i], ticks);
+    }
+  };
+
+  workers = std::clamp<std::size_t>(workers, 1, candidates.size());
+  {
+    std::vector<std::jthread> threads;
+    for (std::size_t i = 1; i < workers; ++i) {
+      threads.emplace_back(work);
+    }
+    work();
+  }
+  return res;
+}
+
+} // namespace shapezx
@@ -0,0 +1,36 @@
+#ifndef SHAPEZX_CORE_WHAT_IF
+#define SHAPEZX_CORE_WHAT_IF
+
+#include "command.hpp"
+#include "core.hpp"
+#include "machine.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace shapezx {
+
+// What a proposed layout achieved on a copy of the game.
+struct Outcome {
+  // false if the placements did not fit, nothing was run then
+  bool placed = false;
+  // items delivered to the store during the run
+  Buffer store;
+  // coins earned during the run
+  std::uint64_t value = 0;
+};
+
+// Applies every candidate to its own copy of base and runs it for the given
+// number of ticks, spread over up to `workers` threads. An empty Place gives
+// the baseline to compare against. Pass a snapshot of the live state, it can
+// keep running while this is in progress.
+std::vector<Outcome>
+evaluate(State base, Global global_state, const std::vector<Place> &candidates,
+         std::uint64_t ticks,
+         std::size_t workers = std::thread::hardware_concurrency());
+
+} // namespace shapezx
+
+#endif
@@ -0,0 +1,68 @@
+#include "core/core.hpp"
+#include "core/daemon.hpp"
+#include "core/memory.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <unistd.h>
+
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+
+using nlohmann::json;
+
+namespace {
+
+std::atomic<bool> stop = false;
+
+} // namespace
+
+// Runs a save until interrupted, see shapezx::Daemon.
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 4) {
+    std::cerr << "usage: shapezx-daemon <save> [<socket> [<view>]]\n";
+    return 2;
+  }
+
+  std::string save = argv[1];
+  auto socket_path = argc > 2 ? std::string(argv[2]) : save + ".sock";
+  auto view_name = argc > 3 ? std::string(argv[3])
+                            : std::format("/shapezx-{}", getpid());
+
+  constexpr auto GLOBAL_PATH = "./global_state.json";
+  auto state = [&]() {
+    std::ifstream f(save);
+    shapezx::memory::Staging staging(shapezx::memory::Stage::StateLoad);
+    return json::parse(f);
+  }().get<shapezx::State>();
+  shapezx::Daemon daemon(std::move(state), shapezx::Global::load(GLOBAL_PATH),
+                         save, GLOBAL_PATH);
+
+  if (!daemon.open(socket_path, view_name)) {
+    std::cerr << std::format("cannot listen at {} or create view {}\n",
+                             socket_path, view_name);
+    return 1;
+  }
+
+  auto metrics = shapezx::MetricsExporter::from_env(daemon.state);
+  if (std::getenv("SHAPEZX_METRICS") && !metrics) {
+    std::cerr << std::format("cannot export metrics to {}\n",
+                             std::getenv("SHAPEZX_METRICS"));
+  }
+
+  std::signal(SIGINT, [](int) { stop = true; });
+  std::signal(SIGTERM, [](int) { stop = true; });
+
+  std::cout << std::format("running {} at {}, view {}\n", save, socket_path,
+                           view_name);
+  daemon.run(stop);
+  std::filesystem::remove(socket_path);
+  return 0;
+}
@@ -0,0 +1,555 @@
+#include "core/alloc.hpp"
+#include "core/core.hpp"
+#include "core/daemon.hpp"
+#include "core/jobs.hpp"
+#include "core/memory.hpp"
+#include "core/replay.hpp"
+#include "core/rewind.hpp"
+#include "core/usage.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using nlohmann::json;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void usage() {
+  std::cerr << "usage: shapezx-headless new <save> <height> <width> "
+               "[<resident MiB>]\n"
+               "       shapezx-headless run <save> <ticks>\n"
+               "       shapezx-headless replay <log>\n"
+               "       shapezx-headless seek <log> <tick>\n"
+               "       shapezx-headless batch <jobs> <ticks> [<save>...]\n"
+               "       shapezx-headless multirate <save> <ticks> <stride>\n"
+               "       shapezx-headless determinism <save> <ticks> "
+               "[<threads>]\n"
+               "       shapezx-headless watch <socket>\n"
+               "       shapezx-headless profile <save> <ticks>\n"
+               "       shapezx-headless allocs <save> <ticks> [<warmup>]\n"
+               "       shapezx-headless trace <socket> <out>\n"
+               "       shapezx-headless hotspots <save> <ticks> [<n>]\n"
+               "       shapezx-headless memory <save>\n";
+}
+
+double seconds_since(Clock::time_point begin) {
+  return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+// Generates a fresh map and writes it as a new save. With a budget, the map
+// is kept in region files next to the save instead.
+int create(const std::string &path, std::size_t height, std::size_t width,
+           std::optional<std::size_t> budget) {
+  auto begin = Clock::now();
+  shapezx::State state(height, width);
+  auto elapsed = seconds_since(begin);
+
+  if (budget) {
+    state.map.page_to(path + ".regions", *budget << 20);
+  }
+  state.save_to(path);
+  std::cout << std::format("generated {}x{} in {:.3f}s\n", height, width,
+                           elapsed);
+  return 0;
+}
+
+// Advances a save by the given number of ticks and writes it back.
+int run(const std::string &path, std::uint64_t ticks) {
+  std::ifstream f(path);
+  auto state = json::parse(f).get<shapezx::State>();
+  f.close();
+
+  shapezx::Global global;
+  auto allocs = shapezx::alloc::stats();
+  auto begin = Clock::now();
+  for (std::uint64_t i = 0; i < ticks; ++i) {
+    state.update(global);
+  }
+  auto elapsed = seconds_since(begin);
+  allocs = shapezx::alloc::stats() - allocs;
+
+  state.save_to(path);
+  std::cout << std::format("{} ticks in {:.3f}s ({:.1f} ticks/s), value {}\n",
+                           ticks, elapsed, ticks / elapsed, global.value);
+  if (shapezx::alloc::TRACKED && ticks) {
+    std::cout << std::format("{:.1f} allocations ({:.0f} bytes) per tick\n",
+                             double(allocs.total_count()) / ticks,
+                             double(allocs.total_bytes()) / ticks);
+  }
+  return 0;
+}
+
+// Replays a recorded session, checking the state hash after every tick.
+int replay(const std::string &path) {
+  auto log = shapezx::CommandLog::load(path);
+  if (!log) {
+    std::cout << std::format("cannot replay {}\n", path);
+    return 1;
+  }
+  shapezx::Replay r(*log);
+
+  auto begin = Clock::now();
+  while (!r.done()) {
+    if (!r.step()) {
+      std::cout << std::format("diverged at tick {}\n", r.state.tick);
+      return 1;
+    }
+  }
+  auto elapsed = seconds_since(begin);
+
+  if (auto h = r.state.hash(); h != r.state.recompute_hash()) {
+    std::cout << std::format("incremental hash {:016x} is stale\n", h);
+    return 1;
+  }
+
+  std::cout << std::format(
+      "replayed {} ticks and {} commands in {:.3f}s ({:.1f} ticks/s)\n",
+      r.ticks_done(), r.next, elapsed, r.ticks_done() / elapsed);
+  return 0;
+}
+
+// Replays a recorded session into a rewind buffer, then jumps back to the
+// given tick and checks the result against the recorded hash.
+int seek(const std::string &path, std::uint64_t tick) {
+  auto log = shapezx::CommandLog::load(path);
+  if (!log) {
+    std::cout << std::format("cannot replay {}\n", path);
+    return 1;
+  }
+  shapezx::Replay r(*log);
+  shapezx::Rewind rewind(r.state, r.global,
+                         {.horizon = UINT64_MAX, .budget = SIZE_MAX});
+  for (auto const &cmd : log->commands) {
+    rewind.record(cmd);
+  }
+  while (!r.done()) {
+    r.step();
+    rewind.record_tick(r.state, r.global);
+  }
+
+  if (tick <= r.start || tick > r.state.tick) {
+    std::cout << std::format("tick {} is outside of ({}, {}]\n", tick, r.start,
+                             r.state.tick);
+    return 1;
+  }
+
+  auto begin = Clock::now();
+  auto [state, global] = rewind.seek(tick).value();
+  auto elapsed = seconds_since(begin);
+
+  auto ok = state.hash() == log->hashes.at(tick - r.start - 1);
+  std::cout << std::format(
+      "seeked to tick {} in {:.3f}s, {} snapshots using {} bytes, {}\n", tick,
+      elapsed, rewind.keyframes.size(), rewind.memory(r.state.map),
+      ok ? "hash matches" : "hash differs");
+  return ok ? 0 : 1;
+}
+
+// Advances many saves on `jobs` workers (0 for one per core), every worker
+// holding one save at a time. Without saves, the ones listed in the global
+// state are run and the coins they earn are credited to it.
+int batch(std::size_t jobs, std::uint64_t ticks,
+          std::vector<std::string> saves) {
+  constexpr auto GLOBAL_PATH = "./global_state.json";
+  auto global = shapezx::Global::load(GLOBAL_PATH);
+  auto const credit = saves.empty();
+  if (credit) {
+    saves = global.saves;
+  }
+  if (saves.empty()) {
+    std::cout << "no saves to run\n";
+    return 0;
+  }
+
+  std::atomic<std::size_t> next = 0;
+  std::atomic<std::size_t> failed = 0;
+  std::atomic<std::uint64_t> earned = 0;
+  std::mutex out;
+  auto work = [&]() {
+    for (auto i = next++; i < saves.size(); i = next++) {
+      auto const &path = saves[i];
+      try {
+        std::ifstream f(path);
+        auto state = json::parse(f).get<shapezx::State>();
+        f.close();
+
+        // only value_factor matters here, the coins are summed up below
+        auto g = global;
+        g.value = 0;
+        for (std::uint64_t t = 0; t < ticks; ++t) {
+          state.update(g);
+        }
+        state.save_to(path);
+        earned += g.value;
+      } catch (const std::exception &e) {
+        // one bad save must not take the other workers down with it
+        failed += 1;
+        std::lock_guard lock(out);
+        std::cerr << std::format("{}: {}\n", path, e.what());
+      }
+    }
+  };
+
+  if (jobs == 0) {
+    jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  jobs = std::min(jobs, saves.size());
+
+  auto begin = Clock::now();
+  {
+    std::vector<std::jthread> workers;
+    for (std::size_t i = 1; i < jobs; ++i) {
+      workers.emplace_back(work);
+    }
+    work();
+  }
+  auto elapsed = seconds_since(begin);
+
+  auto done = saves.size() - failed;
+  if (credit) {
+    global.value += earned;
+    global.save_to(GLOBAL_PATH);
+  }
+  std::cout << std::format(
+      "{} saves ({} failed) on {} workers in {:.3f}s, {:.1f} ticks/s, {} "
+      "coins earned\n",
+      done, failed.load(), jobs, elapsed, done * ticks / elapsed,
+      earned.load());
+  return failed ? 1 : 0;
+}
+
+// Runs a save at full rate and with every region ticked at a coarse rate
+// side by side, then checks that the items in store, the value and the
+// tasks done match exactly, as everything feeding a TaskCenter stays at
+// full rate. The save is left as it is.
+int multirate(const std::string &path, std::uint64_t ticks,
+              std::uint32_t stride) {
+  std::ifstream f(path);
+  auto full = json::parse(f).get<shapezx::State>();
+  f.close();
+  auto coarse = full.snapshot();
+  // an empty view, so no region is in focus
+  coarse.map.multi_rate = shapezx::Map::MultiRate{.stride = stride};
+
+  auto run_for = [ticks](shapezx::State &state) {
+    shapezx::Global global;
+    auto begin = Clock::now();
+    for (std::uint64_t i = 0; i < ticks; ++i) {
+      state.update(global);
+    }
+    return std::pair(global.value, seconds_since(begin));
+  };
+  auto [full_value, full_time] = run_for(full);
+  auto [coarse_value, coarse_time] = run_for(coarse);
+
+  auto items = [](const shapezx::State &state) {
+    std::size_t n = 0;
+    for (auto const &[item, count] : state.store.items) {
+      n += count;
+    }
+    return n;
+  };
+  auto completed = [](const shapezx::State &state) {
+    return std::ranges::count_if(state.tasks,
+                                 [](auto const &t) { return t.completed_; });
+  };
+  // equal contents have equal digests, whatever zero entries are left
+  auto ok = full.store.digest() == coarse.store.digest() &&
+            full_value == coarse_value &&
+            completed(full) == completed(coarse);
+  std::cout << std::format(
+      "full rate: {} items, value {}, {} tasks done in {:.3f}s\n"
+      "stride {}: {} items, value {}, {} tasks done in {:.3f}s\n{}\n",
+      items(full), full_value, completed(full), full_time, stride,
+      items(coarse), coarse_value, completed(coarse), coarse_time,
+      ok ? "match" : "differ");
+  return ok ? 0 : 1;
+}
+
+// Runs a save on one thread and on many side by side and checks that the
+// state hashes agree after every tick, since regions updating in parallel
+// must not depend on the order they finish in. threads is
+// SHAPEZX_THREADS if 0. The save is left as it is.
+int determinism(const std::string &path, std::uint64_t ticks,
+                std::size_t threads) {
+  std::ifstream f(path);
+  auto many = json::parse(f).get<shapezx::State>();
+  f.close();
+  auto one = many.snapshot();
+
+  shapezx::Jobs one_jobs(1);
+  shapezx::Jobs many_jobs(threads ? threads
+                                  : shapezx::Jobs::default_threads());
+  one.jobs = &one_jobs;
+  many.jobs = &many_jobs;
+
+  shapezx::Global one_global;
+  shapezx::Global many_global;
+  for (std::uint64_t i = 0; i < ticks; ++i) {
+    one.update(one_global);
+    many.update(many_global);
+    if (one.hash() != many.hash()) {
+      std::cout << std::format("1 and {} threads diverged at tick {}\n",
+                               many_jobs.threads(), many.tick - 1);
+      return 1;
+    }
+  }
+  if (auto h = many.hash(); h != many.recompute_hash()) {
+    std::cout << std::format("incremental hash {:016x} is stale\n", h);
+    return 1;
+  }
+  std::cout << std::format("1 and {} threads agree for {} ticks\n",
+                           many_jobs.threads(), ticks);
+  return 0;
+}
+
+// Runs a save with hardware counters around the phases of every tick and
+// prints them. The save is left as it is.
+int profile(const std::string &path, std::uint64_t ticks) {
+  std::ifstream f(path);
+  auto state = json::parse(f).get<shapezx::State>();
+  f.close();
+
+  state.profile = std::make_shared<shapezx::Profile>();
+  shapezx::Global global;
+  for (std::uint64_t i = 0; i < ticks; ++i) {
+    state.update(global);
+  }
+  std::cout << state.profile->report();
+  return 0;
+}
+
+// Runs a save with a shapezx::Heatmap and prints the n buildings costing
+// the most at the end. The save is left as it is.
+int hotspots(const std::string &path, std::uint64_t ticks, std::size_t n) {
+  std::ifstream f(path);
+  auto state = json::parse(f).get<shapezx::State>();
+  f.close();
+
+  state.heatmap =
+      std::make_shared<shapezx::Heatmap>(state.map.height, state.map.width);
+  shapezx::Global global;
+  for (std::uint64_t i = 0; i < ticks; ++i) {
+    state.update(global);
+  }
+
+  auto const &heatmap = *state.heatmap;
+  std::vector<std::pair<shapezx::vec::Vec2<>, shapezx::Heatmap::Average>>
+      cells;
+  for (std::size_t i = 0; i < heatmap.cells.size(); ++i) {
+    auto pos = shapezx::vec::Vec2<>(i / heatmap.width, i % heatmap.width);
+    if (auto cell = heatmap.at(pos); cell.cost > 0) {
+      cells.emplace_back(pos, cell);
+    }
+  }
+  n = std::min(n, cells.size());
+  std::ranges::partial_sort(cells, cells.begin() + n, std::ranges::greater{},
+                            [](auto const &c) { return c.second.cost; });
+  for (auto const &[pos, cell] : cells | std::views::take(n)) {
+    auto const *b = state.map.read(pos).building;
+    std::cout << std::format("{:<12}({} {}){:>10.1f}us{:>8.2f} transfers\n",
+                             b ? std::format("{}", b->info().type) : "gone",
+                             pos[0], pos[1], cell.cost / 1e3,
+                             cell.transfers);
+  }
+  return 0;
+}
+
+// Loads a save and prints what it takes in memory.
+int memory(const std::string &path) {
+  auto state = [&]() {
+    std::ifstream f(path);
+    shapezx::memory::Staging staging(shapezx::memory::Stage::StateLoad);
+    return json::parse(f);
+  }().get<shapezx::State>();
+  std::cout << shapezx::Usage::of(state).report();
+  return 0;
+}
+
+// Runs a save for warmup ticks, the second half of which records the most
+// allocations a tick makes at each site. Fails on the first tick after
+// that which allocates more at some site, printing where. Capabilities,
+// deliveries and jobs still allocate on steady ticks, only growth beyond
+// that is caught. The save is left as it is.
+int allocs(const std::string &path, std::uint64_t ticks,
+           std::uint64_t warmup) {
+  if (!shapezx::alloc::TRACKED) {
+    std::cout << "built without SHAPEZX_TRACK_ALLOCATIONS\n";
+    return 2;
+  }
+  std::ifstream f(path);
+  auto state = json::parse(f).get<shapezx::State>();
+  f.close();
+
+  shapezx::Global global;
+  shapezx::alloc::Stats baseline;
+  for (std::uint64_t i = 0; i < warmup; ++i) {
+    auto before = shapezx::alloc::stats();
+    state.update(global);
+    auto used = shapezx::alloc::stats() - before;
+    if (i < warmup / 2) {
+      continue;
+    }
+    for (std::size_t s = 0; s < shapezx::alloc::SITES; ++s) {
+      baseline.count[s] = std::max(baseline.count[s], used.count[s]);
+      baseline.bytes[s] = std::max(baseline.bytes[s], used.bytes[s]);
+    }
+  }
+  for (std::uint64_t i = 0; i < ticks; ++i) {
+    auto before = shapezx::alloc::stats();
+    state.update(global);
+    auto used = shapezx::alloc::stats() - before;
+    auto const grew = std::views::iota(std::size_t(0), shapezx::alloc::SITES) |
+                      std::views::filter([&](std::size_t s) {
+                        return used.count[s] > baseline.count[s];
+                      }) |
+                      std::ranges::to<std::vector>();
+    if (grew.empty()) {
+      continue;
+    }
+
+    std::cout << std::format("tick {} allocated more than the baseline:\n",
+                             state.tick - 1);
+    for (auto s : grew) {
+      std::cout << std::format("  {:<12}{:>8}{:>12} (baseline{:>8}{:>12})\n",
+                               shapezx::alloc::SITE_NAMES[s], used.count[s],
+                               used.bytes[s], baseline.count[s],
+                               baseline.bytes[s]);
+    }
+    return 1;
+  }
+  std::cout << std::format("{} ticks within the baseline of {} allocations "
+                           "({} bytes) per tick\n",
+                           ticks, baseline.total_count(),
+                           baseline.total_bytes());
+  return 0;
+}
+
+// Prints what a daemon publishes, once a second, until it goes away.
+int watch(const std::string &socket_path) {
+  auto client = shapezx::Client::connect(socket_path);
+  if (!client) {
+    std::cout << std::format("no daemon at {}\n", socket_path);
+    return 1;
+  }
+  auto view = shapezx::SharedView::attach(client->view_name);
+  if (!view) {
+    std::cout << std::format("cannot attach to {}\n", client->view_name);
+    return 1;
+  }
+
+  // the connection stays open, the daemon closing it is how we learn that
+  // it stopped
+  for (;;) {
+    if (auto snapshot = view->read(); snapshot) {
+      auto const &frame = snapshot->frame;
+      std::cout << std::format("tick {}, value {}, tasks {}/{}", frame.tick,
+                               frame.value, frame.tasks_done, frame.tasks);
+      for (std::uint32_t i = 0; i < frame.store_size; ++i) {
+        std::cout << std::format(", {} {}", frame.store[i].name,
+                                 frame.store[i].count);
+      }
+      std::cout << std::endl;
+    }
+    if (client->closed(std::chrono::seconds(1))) {
+      return 0;
+    }
+  }
+}
+
+// Has a daemon dump the trace of its last seconds to out.
+int trace(const std::string &socket_path, const std::string &out) {
+  auto client = shapezx::Client::connect(socket_path);
+  if (!client) {
+    std::cout << std::format("no daemon at {}\n", socket_path);
+    return 1;
+  }
+  // the daemon may run elsewhere
+  auto path = std::filesystem::absolute(out).string();
+  if (!client->dump_trace(path)) {
+    std::cout << std::format("cannot write {}\n", path);
+    return 1;
+  }
+  std::cout << std::format("trace written to {}\n", path);
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage();
+    return 2;
+  }
+
+  std::string_view cmd = argv[1];
+  if (cmd == "new" && (argc == 5 || argc == 6)) {
+    auto budget = argc == 6 ? std::optional<std::size_t>(std::stoull(argv[5]))
+                            : std::nullopt;
+    return create(argv[2], std::stoull(argv[3]), std::stoull(argv[4]),
+                  budget);
+  }
+  if (cmd == "run" && argc == 4) {
+    return run(argv[2], std::stoull(argv[3]));
+  }
+  if (cmd == "replay" && argc == 3) {
+    return replay(argv[2]);
+  }
+  if (cmd == "batch" && argc >= 4) {
+    return batch(std::stoull(argv[2]), std::stoull(argv[3]),
+                 {argv + 4, argv + argc});
+  }
+  if (cmd == "seek" && argc == 4) {
+    return seek(argv[2], std::stoull(argv[3]));
+  }
+  if (cmd == "allocs" && (argc == 4 || argc == 5)) {
+    return allocs(argv[2], std::stoull(argv[3]),
+                  argc == 5 ? std::stoull(argv[4]) : 100);
+  }
+  if (cmd == "hotspots" && (argc == 4 || argc == 5)) {
+    return hotspots(argv[2], std::stoull(argv[3]),
+                    argc == 5 ? std::stoull(argv[4]) : 10);
+  }
+  if (cmd == "memory" && argc == 3) {
+    return memory(argv[2]);
+  }
+  if (cmd == "profile" && argc == 4) {
+    return profile(argv[2], std::stoull(argv[3]));
+  }
+  if (cmd == "trace" && argc == 4) {
+    return trace(argv[2], argv[3]);
+  }
+  if (cmd == "watch" && argc == 3) {
+    return watch(argv[2]);
+  }
+  if (cmd == "determinism" && (argc == 4 || argc == 5)) {
+    return determinism(argv[2], std::stoull(argv[3]),
+                       argc == 5 ? std::stoull(argv[4]) : 0);
+  }
+  if (cmd == "multirate" && argc == 5) {
+    return multirate(argv[2], std::stoull(argv[3]), std::stoul(argv[4]));
+  }
+
+  usage();
+  return 2;
+}
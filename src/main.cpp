@@ -1,10 +1,22 @@
 #include "core/core.hpp"
+#include "core/daemon.hpp"
+#include "core/heatmap.hpp"
+#include "core/histogram.hpp"
+#include "core/image.hpp"
 #include "core/machine.hpp"
+#include "core/memory.hpp"
 #include "core/ore.hpp"
+#include "core/replay.hpp"
+#include "core/rewind.hpp"
+#include "core/shared_view.hpp"
+#include "core/trace.hpp"
+#include "core/usage.hpp"
+#include "core/what_if.hpp"
 #include "ui/machine.hpp"
 #include "vec/vec.hpp"
 
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <fstream>
 #include <gdk/gdkkeysyms.h>
@@ -17,15 +29,21 @@
 #include <gtkmm/application.h>
 #include <gtkmm/box.h>
 #include <gtkmm/button.h>
+#include <gtkmm/drawingarea.h>
 #include <gtkmm/enums.h>
 #include <gtkmm/eventcontroller.h>
 #include <gtkmm/eventcontrollerkey.h>
+#include <gtkmm/gestureclick.h>
+#include <gtkmm/grid.h>
 #include <gtkmm/gridview.h>
 #include <gtkmm/image.h>
 #include <gtkmm/label.h>
 #include <gtkmm/listbox.h>
 #include <gtkmm/listboxrow.h>
+#include <gtkmm/overlay.h>
+#include <gtkmm/scale.h>
 #include <gtkmm/scrolledwindow.h>
+#include <gtkmm/spinbutton.h>
 #include <gtkmm/widget.h>
 #include <gtkmm/window.h>
 #include <nlohmann/detail/exceptions.hpp>
@@ -34,20 +52,26 @@
 #include <sigc++/connection.h>
 #include <sigc++/signal.h>
 
+#include <array>
 #include <cstddef>
+#include <cstdlib>
+#include <filesystem>
 #include <format>
 #include <functional>
+#include <future>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <ranges>
 #include <string>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 using nlohmann::json;
-using shapezx::IdGenerator;
 using shapezx::ui::Connections;
 using shapezx::ui::UIState;
 
@@ -65,92 +89,158 @@ class Chunk : public Gtk::Button {
     return {};
   }
 
+  // Chunks after from up to to, first along the row and then along the
+  // column, each with the direction leading on to the next one.
+  static std::vector<std::pair<shapezx::vec::Vec2<>, shapezx::Direction>>
+  line_between(shapezx::vec::Vec2<> from, shapezx::vec::Vec2<> to) {
+    std::vector<std::pair<shapezx::vec::Vec2<>, shapezx::Direction>> res;
+    auto cur = from;
+    auto walk = [&](std::size_t axis, shapezx::Direction forward,
+                    shapezx::Direction backward) {
+      while (cur[axis] != to[axis]) {
+        auto d = cur[axis] < to[axis] ? forward : backward;
+        if (!res.empty()) {
+          res.back().second = d;
+        }
+        cur = cur + shapezx::to_vec2(d);
+        res.emplace_back(cur, d);
+      }
+    };
+    walk(1, shapezx::Direction::Right, shapezx::Direction::Left);
+    walk(0, shapezx::Direction::Down, shapezx::Direction::Up);
+
+    return res;
+  }
+
 public:
-  using sig_machine_placed = sigc::signal<void(
-      std::vector<shapezx::vec::Vec2<>>, shapezx::Building *)>;
+  using sig_machine_placed = sigc::signal<void(const shapezx::ChangeSet &)>;
 
   shapezx::MapAccessor map_accessor;
   std::reference_wrapper<UIState> ui_state;
-  std::reference_wrapper<IdGenerator> id_;
   sig_machine_placed machine_placed;
   sigc::signal<void(std::uint32_t)> machine_removed_;
 
   Gtk::Image ore_icon;
 
   explicit Chunk(shapezx::MapAccessor current_chunk_, UIState &ui_state,
-                 IdGenerator &id,
                  sigc::signal<void(std::uint32_t)> machine_removed)
-      : map_accessor(current_chunk_), ui_state(ui_state), id_(id),
+      : map_accessor(current_chunk_), ui_state(ui_state),
         machine_removed_(machine_removed) {
     this->reset_label();
     this->set_expand(true);
     this->set_halign(Gtk::Align::FILL);
     this->set_valign(Gtk::Align::FILL);
-    if (auto ore = current_chunk_.current_chunk().ore; ore) {
+    if (auto ore = this->peek().ore; ore) {
       this->ore_icon = load_icon(*ore);
       this->set_child(this->ore_icon);
     }
   }
 
   void on_clicked() override {
-    if (auto &state = this->ui_state.get();
-        state.machine_selected &&
-        !this->map_accessor.current_chunk().building) {
-      auto &placing = state.machine_selected;
-      auto &dir = state.direction;
-      auto id = this->id_.get().gen();
-      std::unique_ptr<shapezx::Building> machine;
-      switch (*placing) {
-      case shapezx::BuildingType::Miner:
-        machine = std::make_unique<shapezx::Miner>(id, dir.value());
-        break;
-      case shapezx::BuildingType::Belt:
-        machine = std::make_unique<shapezx::Belt>(id, dir.value());
-        break;
-      case shapezx::BuildingType::Cutter:
-        machine = std::make_unique<shapezx::Cutter>(id, dir.value());
-        break;
-      case shapezx::BuildingType::TrashCan:
-        machine = std::make_unique<shapezx::TrashCan>(id, dir.value());
-        break;
-      case shapezx::BuildingType::TaskCenter:
-        machine = std::make_unique<shapezx::TaskCenter>(id);
-        break;
-      default:
+    auto &state = this->ui_state.get();
+    if (state.copying) {
+      this->copy(state);
+      return;
+    }
+    if (state.pasting && state.blueprint) {
+      state.pasting = false;
+      this->build(state, state.blueprint->paste_at(this->map_accessor.pos));
+      return;
+    }
+    if (!state.machine_selected || !this->map_accessor.occupant().empty()) {
+      return;
+    }
+
+    auto pos = this->map_accessor.pos;
+    auto type = *state.machine_selected;
+    shapezx::Place place;
+    if (state.extending && state.last_placed) {
+      for (auto [p, d] : line_between(*state.last_placed, pos)) {
+        place.entries.push_back({
+            .pos = p,
+            .type = type,
+            .direction = type == shapezx::BuildingType::Belt
+                             ? d
+                             : state.direction.value(),
+        });
+      }
+    } else {
+      auto machine = shapezx::make_building(type, 0, state.direction.value());
+      if (!machine) {
         return;
       }
 
-      auto ref = machine.get();
-
-      for (auto [r, c] : shapezx::rect_iter(ref->relative_rect())) {
-        auto [chk, acc] = this->map_accessor.get_chunk_and_accessor({r, c});
-        if (chk.building) {
-          auto &b = *chk.building;
-          this->machine_removed_.emit(b->info().id);
+      auto &map = this->map_accessor.map.get();
+      for (auto p : this->map_accessor.footprint(machine->relative_rect())) {
+        if (!state.plan && map.contains(p) && !map.occupant(p).empty()) {
+          this->machine_removed_.emit(map.occupant(p).owner);
         }
       }
+      place.entries.push_back({
+          .pos = pos,
+          .type = type,
+          .direction = state.direction.value(),
+      });
+    }
 
-      auto modified = this->map_accessor.add_machine(std::move(machine));
-      this->machine_placed.emit(modified, ref);
+    if (!this->build(state, std::move(place))) {
+      return;
+    }
+    state.last_placed = pos;
 
-      placing.reset();
-      dir.reset();
+    // keep the tool while extending so the next shift-click continues the line
+    if (!state.extending) {
+      state.machine_selected.reset();
+      state.direction.reset();
     }
   }
 
+  // the chunk, without loading a tile of an image for every button
+  shapezx::ConstChunk peek() const {
+    return this->map_accessor.map.get().peek(this->map_accessor.pos);
+  }
+
+  // Builds place, or adds it to the plan while there is one. False if
+  // nothing was placed.
+  bool build(UIState &state, shapezx::Place &&place) {
+    if (state.plan) {
+      std::ranges::move(place.entries, std::back_inserter(state.plan->entries));
+      return true;
+    }
+    state.clicked_at = shapezx::trace::now();
+    auto changes = this->map_accessor.ctx.get().execute(place);
+    if (changes.placed.empty()) {
+      // nothing will be drawn for this click
+      state.clicked_at.reset();
+      return false;
+    }
+    this->machine_placed.emit(changes);
+    return true;
+  }
+
+  // Marks a corner of the selection, copying it once both are set.
+  void copy(UIState &state) {
+    auto pos = this->map_accessor.pos;
+    if (!state.copy_from) {
+      state.copy_from = pos;
+      return;
+    }
+    auto from = *std::exchange(state.copy_from, std::nullopt);
+    state.blueprint = shapezx::Blueprint::capture(
+        this->map_accessor.map.get(),
+        {std::min(from[0], pos[0]), std::min(from[1], pos[1])},
+        {std::max(from[0], pos[0]) + 1, std::max(from[1], pos[1]) + 1});
+    state.copying = false;
+  }
+
   void reset_label() {
-    this->set_label(
-        std::format("{}\nat ({} {})\nwith {}",
-                    this->map_accessor.current_chunk()
-                        .building
-                        .transform([](auto const &b) {
-                          return std::format("{}", b->info().type);
-                        })
-                        .value_or("none"),
-                    this->map_accessor.pos[0], this->map_accessor.pos[1],
-                    this->map_accessor.current_chunk()
-                        .ore.transform([](auto const &ore) { return ore.name; })
-                        .value_or("")));
+    auto chunk = this->peek();
+    this->set_label(std::format(
+        "{}\nat ({} {})\nwith {}",
+        chunk.building ? std::format("{}", chunk.building->info().type)
+                       : "none",
+        this->map_accessor.pos[0], this->map_accessor.pos[1],
+        chunk.ore ? chunk.ore->name : ""));
   }
 
   sig_machine_placed signal_machine_placed() const {
@@ -164,86 +254,95 @@ public:
   std::unordered_map<std::uint32_t, std::unique_ptr<shapezx::ui::Machine>>
       machines;
   sigc::signal<void(std::uint32_t)> machine_removed_;
-  std::reference_wrapper<IdGenerator> id_;
+  // from a click on a chunk to the frame showing what it placed, in ns
+  shapezx::Histogram placement_latency;
   Connections conns;
 
-  explicit Map(UIState &ui_state, shapezx::State &game_state)
-      : id_(game_state.id_) {
+  explicit Map(UIState &ui_state, shapezx::State &game_state) {
     this->set_expand(true);
     this->set_valign(Gtk::Align::FILL);
     this->set_halign(Gtk::Align::FILL);
 
-    auto place_machine =
-        [&, width = game_state.map.width](std::vector<shapezx::vec::Vec2<>> v,
-                                          shapezx::Building *ref) {
-          auto id = ref->info().id;
-          auto it =
-              this->machines
-                  .insert(std::make_pair(
-                      id, shapezx::ui::Machine::create(
-                              ref->info().type, v[0], ref->info().direction, id,
-                              ui_state, game_state, this->machine_removed_)))
-                  .first;
-
-          auto &machine = it->second;
-
-          for (auto chk : v) {
-            this->remove(this->chunks[chk[0] * width + chk[1]]);
-          }
-          auto [w, h] = ref->size();
-          auto get = [](size_t i) {
-            return [=](const shapezx::vec::Vec2<> &v) { return v[i]; };
-          };
-
-          auto r = std::ranges::min(v | std::ranges::views::transform(get(0)));
-          auto c = std::ranges::min(v | std::ranges::views::transform(get(1)));
-
-          this->attach(*machine, c, r, w, h);
+    auto place_machines = [&, width = game_state.map.width](
+                              const shapezx::ChangeSet &changes) {
+      auto clicked_at = std::exchange(ui_state.clicked_at, std::nullopt);
+      for (auto const &[v, ref] : changes.placed) {
+        auto id = ref->info().id;
+        auto it =
+            this->machines
+                .insert(std::make_pair(
+                    id, shapezx::ui::Machine::create(
+                            ref->info().type, v[0], ref->info().direction, id,
+                            ui_state, game_state, this->machine_removed_)))
+                .first;
+
+        auto &machine = it->second;
+
+        for (auto chk : v) {
+          this->remove(this->chunks[chk[0] * width + chk[1]]);
+        }
+        auto [w, h] = ref->size();
+        auto get = [](size_t i) {
+          return [=](const shapezx::vec::Vec2<> &v) { return v[i]; };
         };
 
+        auto r = std::ranges::min(v | std::ranges::views::transform(get(0)));
+        auto c = std::ranges::min(v | std::ranges::views::transform(get(1)));
+
+        this->attach(*machine, c, r, w, h);
+        if (clicked_at) {
+          // runs once, at the start of the next frame drawn
+          machine->add_tick_callback(
+              [this, at = *std::exchange(clicked_at, std::nullopt)](
+                  const Glib::RefPtr<Gdk::FrameClock> &) {
+                this->placement_latency.record(shapezx::trace::now() - at);
+                return false;
+              });
+        }
+      }
+    };
+
     for (auto const r :
          std::views::iota(std::size_t(0), game_state.map.height)) {
       for (auto const c :
            std::views::iota(std::size_t(0), game_state.map.width)) {
         auto &chunk = this->chunks.emplace_back(
-            game_state.create_accessor_at({r, c}), ui_state, this->id_,
+            game_state.create_accessor_at({r, c}), ui_state,
             this->machine_removed_);
-        conns.add(chunk.signal_machine_placed().connect(place_machine));
+        conns.add(chunk.signal_machine_placed().connect(place_machines));
         this->attach(chunk, c, r);
       }
     }
 
-    for (auto const r :
-         std::views::iota(std::size_t(0), game_state.map.height)) {
-      for (auto const c :
-           std::views::iota(std::size_t(0), game_state.map.width)) {
-        auto acc = game_state.create_accessor_at({r, c});
-        if (auto &building = acc.current_chunk().building;
-            building && building.value()->info().type !=
-                            shapezx::BuildingType::PlaceHolder) {
-          auto ref = building->get();
-          auto v =
-              shapezx::rect_iter(ref->relative_rect()) |
-              std::ranges::views::transform(
-                  [acc](std::pair<shapezx::ssize_t, shapezx::ssize_t> pair) {
-                    return acc.relative_pos_by({pair.first, pair.second});
-                  }) |
-              std::ranges::to<std::vector<shapezx::vec::Vec2<>>>();
-          place_machine(v, ref);
+    // only the tiles the anchor counts say have buildings are loaded, and
+    // they are not written to
+    shapezx::ChangeSet existing;
+    auto &map = game_state.map;
+    for (std::size_t t = 0; t < map.tiles.size(); ++t) {
+      if (!map.has_buildings(t)) {
+        continue;
+      }
+      for (auto const &slot : map.tile(t).slots) {
+        if (auto *ref = slot.building.get(); ref) {
+          auto acc = game_state.create_accessor_at(slot.anchor);
+          existing.placed.push_back(
+              {.chunks = acc.footprint(ref->relative_rect()), .building = ref});
         }
       }
     }
+    place_machines(existing);
 
     conns.add(this->machine_removed_.connect(
         [&game_state, width = game_state.map.width, this](std::uint32_t id) {
           auto &m = this->machines.at(id);
-          auto pos = m->pos_;
-          auto acc = game_state.create_accessor_at(pos);
+          auto changes = game_state.execute(shapezx::Remove{m->pos_});
           this->remove(*m);
-          auto res = acc.remove_machine();
 
-          for (auto chk : res) {
-            this->attach(this->chunks[chk[0] * width + chk[1]], chk[1], chk[0]);
+          for (auto const &[res, _] : changes.removed) {
+            for (auto chk : res) {
+              this->attach(this->chunks[chk[0] * width + chk[1]], chk[1],
+                           chk[0]);
+            }
           }
         }));
   }
@@ -266,19 +365,22 @@ public:
 
     auto &miner = this->options.emplace_back("Upgrade miner");
     connect(miner, [this]() {
-      this->game_state_.get().eff.miner += 1;
+      this->game_state_.get().execute(
+          shapezx::Upgrade{shapezx::Upgrade::Target::Miner});
       this->destroy();
     });
 
     auto &belt = this->options.emplace_back("Upgrade belt");
     connect(belt, [this]() {
-      this->game_state_.get().eff.belt += 1;
+      this->game_state_.get().execute(
+          shapezx::Upgrade{shapezx::Upgrade::Target::Belt});
       this->destroy();
     });
 
     auto &cutter = this->options.emplace_back("Upgrade cutter");
     connect(cutter, [this]() {
-      this->game_state_.get().eff.cutter += 1;
+      this->game_state_.get().execute(
+          shapezx::Upgrade{shapezx::Upgrade::Target::Cutter});
       this->destroy();
     });
 
@@ -290,37 +392,608 @@ public:
   }
 };
 
+// The factory as it was at a past tick. Nothing is selected in its UIState,
+// so the view cannot be edited.
+class History final : public Gtk::Window {
+public:
+  std::reference_wrapper<const shapezx::Rewind> rewind_;
+  UIState ui_state;
+  Gtk::Box box;
+  Gtk::Box controls;
+  Gtk::Scale tick_;
+  Gtk::Button show_;
+  Gtk::ScrolledWindow view;
+  // view_ refers to past_, so it is declared after it
+  std::optional<shapezx::State> past_;
+  std::unique_ptr<Map> view_;
+  Connections conns;
+
+  explicit History(const shapezx::Rewind &rewind)
+      : rewind_(rewind), box(Gtk::Orientation::VERTICAL),
+        controls(Gtk::Orientation::HORIZONTAL), show_("Show") {
+    this->tick_.set_digits(0);
+    this->tick_.set_draw_value(true);
+    this->tick_.set_hexpand(true);
+    this->view.set_expand(true);
+
+    this->conns.add(
+        this->show_.signal_clicked().connect([this]() { this->show(); }));
+
+    this->controls.append(this->tick_);
+    this->controls.append(this->show_);
+    this->box.append(this->controls);
+    this->box.append(this->view);
+
+    this->set_title("history");
+    this->set_default_size(1280, 720);
+    this->set_child(this->box);
+  }
+
+  // call before presenting, the range ends at the given tick
+  void update_range(std::uint64_t now) {
+    this->tick_.set_range(this->rewind_.get().oldest(), now);
+    this->tick_.set_value(now);
+  }
+
+  void show() {
+    auto tick = static_cast<std::uint64_t>(this->tick_.get_value());
+    auto res = this->rewind_.get().seek(tick);
+    if (!res) {
+      return;
+    }
+
+    this->view.unset_child();
+    this->view_.reset();
+    this->past_.emplace(std::move(res->first));
+    this->view_ = std::make_unique<Map>(this->ui_state, *this->past_);
+    this->view.set_child(*this->view_);
+    this->set_title(std::format("history at tick {}", tick));
+  }
+};
+
+// Collects candidate layouts from the map and compares what they would
+// produce, computed on copies of the game so the live one keeps running.
+class WhatIf final : public Gtk::Window {
+public:
+  std::reference_wrapper<shapezx::State> game_state_;
+  std::reference_wrapper<shapezx::Global> global_state_;
+  std::reference_wrapper<UIState> ui_state_;
+  std::vector<shapezx::Place> candidates;
+  std::future<std::vector<shapezx::Outcome>> running;
+
+  Gtk::Box box;
+  Gtk::Box controls;
+  Gtk::Button plan_;
+  Gtk::Button add_;
+  Gtk::Button clear_;
+  Gtk::SpinButton ticks_;
+  Gtk::Button evaluate_;
+  Gtk::Label status_;
+  Gtk::Grid results;
+  std::vector<Gtk::Label> cells;
+  Connections conns;
+
+  WhatIf(shapezx::State &game_state, shapezx::Global &global_state,
+         UIState &ui_state)
+      : game_state_(game_state), global_state_(global_state),
+        ui_state_(ui_state), box(Gtk::Orientation::VERTICAL),
+        controls(Gtk::Orientation::HORIZONTAL), plan_("Plan"),
+        add_("Add candidate"), clear_("Clear"), evaluate_("Evaluate") {
+    // one minute at the default tick rate
+    this->ticks_.set_range(1, 72000);
+    this->ticks_.set_increments(20, 1200);
+    this->ticks_.set_value(1200);
+
+    auto connect = [this](Gtk::Button &button, auto f) {
+      this->conns.add(button.signal_clicked().connect(f));
+    };
+    connect(this->plan_, [this]() {
+      auto &plan = this->ui_state_.get().plan;
+      if (plan) {
+        plan.reset();
+      } else {
+        plan.emplace();
+      }
+      this->update();
+    });
+    connect(this->add_, [this]() {
+      auto &plan = this->ui_state_.get().plan;
+      if (plan && !plan->entries.empty()) {
+        this->candidates.push_back(std::move(*plan));
+        plan.emplace();
+      }
+      this->update();
+    });
+    connect(this->clear_, [this]() {
+      this->candidates.clear();
+      this->update();
+    });
+    connect(this->evaluate_, [this]() { this->evaluate(); });
+
+    this->conns.add(Glib::signal_timeout().connect(
+        [this]() {
+          this->poll();
+          return true;
+        },
+        100));
+
+    this->controls.append(this->plan_);
+    this->controls.append(this->add_);
+    this->controls.append(this->clear_);
+    this->controls.append(this->ticks_);
+    this->controls.append(this->evaluate_);
+    this->box.append(this->controls);
+    this->box.append(this->status_);
+    this->box.append(this->results);
+
+    this->update();
+    this->set_title("what if");
+    this->set_child(this->box);
+  }
+
+  void update() {
+    auto const &plan = this->ui_state_.get().plan;
+    this->plan_.set_label(plan ? "Stop planning" : "Plan");
+    this->status_.set_text(std::format(
+        "{} candidates, {} placements planned", this->candidates.size(),
+        plan.transform([](auto const &p) { return p.entries.size(); })
+            .value_or(0)));
+  }
+
+  void evaluate() {
+    if (this->running.valid() || this->candidates.empty()) {
+      return;
+    }
+
+    // the first run changes nothing and serves as the baseline
+    std::vector<shapezx::Place> runs{{}};
+    std::ranges::copy(this->candidates, std::back_inserter(runs));
+    this->running = std::async(
+        std::launch::async, shapezx::evaluate,
+        this->game_state_.get().snapshot(), this->global_state_.get(),
+        std::move(runs),
+        static_cast<std::uint64_t>(this->ticks_.get_value_as_int()),
+        std::thread::hardware_concurrency());
+    this->evaluate_.set_sensitive(false);
+    this->status_.set_text("evaluating...");
+  }
+
+  void poll() {
+    using namespace std::chrono_literals;
+    if (!this->running.valid() ||
+        this->running.wait_for(0s) != std::future_status::ready) {
+      return;
+    }
+
+    auto outcomes = this->running.get();
+    this->evaluate_.set_sensitive(true);
+    this->update();
+    this->show(outcomes);
+  }
+
+  void show(const std::vector<shapezx::Outcome> &outcomes) {
+    for (auto &cell : this->cells) {
+      this->results.remove(cell);
+    }
+    this->cells.clear();
+    this->cells.reserve((outcomes.size() + 1) * 3);
+
+    auto add = [this](int row, int col, std::string text) {
+      auto &cell = this->cells.emplace_back(text);
+      this->results.attach(cell, col, row);
+    };
+    add(0, 0, "layout");
+    add(0, 1, "coins");
+    add(0, 2, "items");
+    for (auto const [i, outcome] : std::views::enumerate(outcomes)) {
+      auto row = static_cast<int>(i) + 1;
+      add(row, 0, i == 0 ? std::string("current") : std::format("#{}", i));
+      if (!outcome.placed) {
+        add(row, 1, "does not fit");
+        add(row, 2, "");
+        continue;
+      }
+      add(row, 1, std::format("{}", outcome.value));
+      std::string items;
+      for (auto const &[item, num] : outcome.store.items) {
+        items += std::format("{} {} ", num, item.name);
+      }
+      add(row, 2, items);
+    }
+  }
+};
+
+// Counters of the running game drawn over the map, see shapezx::Profile.
+// Counting only runs while it is shown.
+class DebugOverlay final : public Gtk::Label {
+public:
+  std::reference_wrapper<shapezx::State> state;
+  Connections conns;
+
+  explicit DebugOverlay(shapezx::State &state_) : state(state_) {
+    this->add_css_class("monospace");
+    this->set_halign(Gtk::Align::START);
+    this->set_valign(Gtk::Align::START);
+    this->set_visible(false);
+
+    this->conns.add(Glib::signal_timeout().connect(
+        [this]() {
+          if (auto const &profile = this->state.get().profile; profile) {
+            this->set_text(profile->report());
+            profile->reset();
+          }
+          return true;
+        },
+        1000));
+  }
+
+  void toggle() {
+    auto &profile = this->state.get().profile;
+    if (profile) {
+      profile.reset();
+      this->set_visible(false);
+    } else {
+      profile = std::make_shared<shapezx::Profile>();
+      this->set_text("collecting counters...");
+      this->set_visible(true);
+    }
+  }
+};
+
+// Percentiles of how long the game takes, drawn over the map. Ticks, UI
+// refreshes and placements are always recorded. Frames are only timed while
+// it is shown, since timing them keeps GTK drawing every frame.
+class LatencyOverlay final : public Gtk::Label {
+public:
+  // all in ns
+  shapezx::Histogram tick;
+  shapezx::Histogram refresh;
+  shapezx::Histogram frame;
+  std::reference_wrapper<shapezx::Histogram> placement;
+  std::optional<std::uint64_t> last_frame;
+  guint frame_callback = 0;
+  Connections conns;
+
+  explicit LatencyOverlay(shapezx::Histogram &placement_)
+      : placement(placement_) {
+    this->add_css_class("monospace");
+    this->set_halign(Gtk::Align::END);
+    this->set_valign(Gtk::Align::START);
+    this->set_visible(false);
+
+    this->conns.add(Glib::signal_timeout().connect(
+        [this]() {
+          if (this->get_visible()) {
+            this->set_text(this->report());
+          }
+          return true;
+        },
+        1000));
+  }
+
+  std::string report() const {
+    auto res = std::format("{:<10}{:>10}{:>10}{:>10}{:>8}\n", "", "p50",
+                           "p99", "max", "count");
+    auto ms = [](std::uint64_t ns) {
+      return std::format("{:.2f}ms", ns / 1e6);
+    };
+    auto row = [&](std::string_view name, const shapezx::Histogram &h) {
+      res += std::format("{:<10}{:>10}{:>10}{:>10}{:>8}\n", name,
+                         ms(h.percentile(0.5)), ms(h.percentile(0.99)),
+                         ms(h.max.load()), h.total.load());
+    };
+    row("tick", this->tick);
+    row("refresh", this->refresh);
+    row("frame", this->frame);
+    row("placement", this->placement.get());
+    return res;
+  }
+
+  // Starts over every time it is shown.
+  void toggle() {
+    if (this->get_visible()) {
+      this->remove_tick_callback(this->frame_callback);
+      this->set_visible(false);
+      return;
+    }
+
+    for (auto *h : {&this->tick, &this->refresh, &this->frame,
+                    &this->placement.get()}) {
+      h->reset();
+    }
+    this->last_frame.reset();
+    this->frame_callback = this->add_tick_callback(
+        [this](const Glib::RefPtr<Gdk::FrameClock> &clock) {
+          auto const at = std::uint64_t(clock->get_frame_time());
+          if (this->last_frame) {
+            // frame times are in microseconds
+            this->frame.record((at - *this->last_frame) * 1000);
+          }
+          this->last_frame = at;
+          return true;
+        });
+    this->set_text(this->report());
+    this->set_visible(true);
+  }
+};
+
+// Where update time goes, as red over the buildings of the map, see
+// shapezx::Heatmap. Sampling only runs while it is shown. Clicks then show
+// the cost of the building under them in info instead of placing.
+class HeatmapView final : public Gtk::DrawingArea {
+public:
+  std::reference_wrapper<shapezx::State> state;
+  Gtk::Label info;
+  Glib::RefPtr<Gtk::GestureClick> click;
+  Connections conns;
+
+  explicit HeatmapView(shapezx::State &state_)
+      : state(state_), click(Gtk::GestureClick::create()) {
+    this->set_can_target(false);
+    this->set_visible(false);
+    this->info.add_css_class("monospace");
+    this->info.set_halign(Gtk::Align::START);
+    this->info.set_valign(Gtk::Align::END);
+    this->info.set_visible(false);
+
+    this->set_draw_func(
+        [this](const Cairo::RefPtr<Cairo::Context> &cr, int w, int h) {
+          this->draw(cr, w, h);
+        });
+    this->conns.add(this->click->signal_pressed().connect(
+        [this](int, double x, double y) { this->inspect(x, y); }));
+    this->add_controller(this->click);
+
+    this->conns.add(Glib::signal_timeout().connect(
+        [this]() {
+          if (this->state.get().heatmap) {
+            this->queue_draw();
+          }
+          return true;
+        },
+        1000));
+  }
+
+  void toggle() {
+    auto &game = this->state.get();
+    if (game.heatmap) {
+      game.heatmap.reset();
+    } else {
+      game.heatmap =
+          std::make_shared<shapezx::Heatmap>(game.map.height, game.map.width);
+      this->info.set_text("click a building to see its cost");
+    }
+    auto const shown = game.heatmap != nullptr;
+    this->set_visible(shown);
+    this->set_can_target(shown);
+    this->info.set_visible(shown);
+  }
+
+  // size of a chunk on screen
+  std::pair<double, double> cell_size() const {
+    auto const &map = this->state.get().map;
+    return {double(this->get_height()) / std::max<std::size_t>(map.height, 1),
+            double(this->get_width()) / std::max<std::size_t>(map.width, 1)};
+  }
+
+  void draw(const Cairo::RefPtr<Cairo::Context> &cr, int, int) {
+    auto &game = this->state.get();
+    if (!game.heatmap) {
+      return;
+    }
+    auto const &heatmap = *game.heatmap;
+    auto const hottest = heatmap.hottest();
+    if (hottest <= 0) {
+      return;
+    }
+
+    auto [ch, cw] = this->cell_size();
+    for (std::size_t i = 0; i < heatmap.cells.size(); ++i) {
+      auto pos = shapezx::vec::Vec2<>(i / heatmap.width, i % heatmap.width);
+      auto const heat = heatmap.at(pos).cost / hottest;
+      auto const [t, k] = game.map.locate(pos);
+      auto const *tile = game.map.loaded(t);
+      auto const *b = tile ? tile->anchored(k, pos) : nullptr;
+      // too cold to see, gone since it was sampled or paged out
+      if (heat < 0.01 || !b) {
+        continue;
+      }
+      cr->set_source_rgba(1, 0, 0, 0.15 + 0.6 * heat);
+      auto acc = game.create_accessor_at(pos);
+      for (auto p : acc.footprint(b->relative_rect())) {
+        cr->rectangle(p[1] * cw, p[0] * ch, cw, ch);
+      }
+      cr->fill();
+    }
+  }
+
+  void inspect(double x, double y) {
+    auto &game = this->state.get();
+    if (!game.heatmap) {
+      return;
+    }
+    auto [ch, cw] = this->cell_size();
+    auto pos = shapezx::vec::Vec2<>(std::size_t(y / ch), std::size_t(x / cw));
+    auto anchor = game.map.contains(pos) ? game.map.anchor_of(pos)
+                                         : std::nullopt;
+    if (!anchor) {
+      this->info.set_text(std::format("nothing at ({} {})", pos[0], pos[1]));
+      return;
+    }
+    auto const &b = *game.map.read(*anchor).building;
+    auto const cell = game.heatmap->at(*anchor);
+    this->info.set_text(std::format(
+        "{} at ({} {})\n{:.1f}us per update\n{:.2f} transfers per update",
+        b.info().type, (*anchor)[0], (*anchor)[1], cell.cost / 1e3,
+        cell.transfers));
+  }
+};
+
+// Bytes held by the game and by the widgets of the map, see
+// shapezx::Usage. It walks all of them, so it only refreshes while shown.
+class MemoryOverlay final : public Gtk::Label {
+public:
+  std::reference_wrapper<const shapezx::State> state;
+  std::reference_wrapper<const Map> map;
+  Connections conns;
+
+  explicit MemoryOverlay(const shapezx::State &state_, const Map &map_)
+      : state(state_), map(map_) {
+    this->add_css_class("monospace");
+    this->set_halign(Gtk::Align::END);
+    this->set_valign(Gtk::Align::END);
+    this->set_visible(false);
+
+    this->conns.add(Glib::signal_timeout().connect(
+        [this]() {
+          if (this->get_visible()) {
+            this->set_text(this->report());
+          }
+          return true;
+        },
+        2000));
+  }
+
+  // size of the GObject behind w, the C++ wrapper is counted apart
+  static std::uint64_t instance_size(const Gtk::Widget &w) {
+    GTypeQuery query;
+    g_type_query(G_OBJECT_TYPE(w.gobj()), &query);
+    return query.instance_size;
+  }
+
+  std::string report() const {
+    auto const &map = this->map.get();
+    std::uint64_t widgets = map.chunks.capacity() * sizeof(Chunk);
+    std::uint64_t textures = 0;
+    std::unordered_set<const GdkPaintable *> seen;
+    // pixel data, images sharing a texture count it once
+    auto texture = [&](const Gtk::Image &image) {
+      auto paintable = image.get_paintable();
+      if (!paintable || !seen.insert(paintable->gobj()).second) {
+        return;
+      }
+      if (auto t = std::dynamic_pointer_cast<const Gdk::Texture>(paintable);
+          t) {
+        textures += std::uint64_t(t->get_width()) * t->get_height() * 4;
+      }
+    };
+
+    for (auto const &chunk : map.chunks) {
+      widgets += instance_size(chunk) + instance_size(chunk.ore_icon);
+      texture(chunk.ore_icon);
+    }
+    for (auto const &[id, machine] : map.machines) {
+      widgets += sizeof(shapezx::ui::Machine) + instance_size(*machine) +
+                 instance_size(machine->icon_);
+      texture(machine->icon_);
+    }
+
+    auto const chunks = std::max<std::size_t>(map.chunks.size(), 1);
+    std::vector<std::pair<std::string, std::uint64_t>> extra{
+        {"widgets", widgets},
+        {"per chunk", widgets / chunks},
+        {"textures", textures},
+        {"icon cache", shapezx::ui::icon_cache_bytes()},
+    };
+    return shapezx::Usage::of(this->state.get()).report(extra);
+  }
+
+  void toggle() {
+    if (!this->get_visible()) {
+      this->set_text(this->report());
+    }
+    this->set_visible(!this->get_visible());
+  }
+};
+
+// Runs the game in this process, see RemoteGame for playing one that a
+// daemon runs.
 class MainGame final : public Gtk::Window {
 protected:
   shapezx::State state;
   std::reference_wrapper<shapezx::Global> global_state_;
+  // this session so far, written next to the save
+  shapezx::CommandLog log_;
+  // the last few minutes, for the history window
+  shapezx::Rewind rewind_;
+  // Replays and seeking assume that every region ticks at full rate, so
+  // log_ and rewind_ are left alone while regions tick at a coarse rate
+  // and start over once they are back at full rate.
+  bool recording_ = true;
   UIState ui_state;
   sigc::signal<void(shapezx::BuildingType)> on_placing_machine_begin;
   Glib::RefPtr<Gtk::EventControllerKey> ev_key;
   Glib::SignalTimeout timer;
   Map map;
   Gtk::ScrolledWindow map_window;
+  // scrolls with the map, unlike map_overlay
+  Gtk::Overlay heat_overlay;
+  HeatmapView heatmap;
+  Gtk::Overlay map_overlay;
+  DebugOverlay debug;
+  LatencyOverlay latency;
+  MemoryOverlay memory;
   Connections conns;
   Gtk::Box box;
   shapezx::ui::MachineSelector machines;
   UpgradeMachine upgrade_machine;
+  History history;
+  WhatIf what_if;
   std::string save_path;
+  // set through SHAPEZX_METRICS
+  std::unique_ptr<shapezx::MetricsExporter> metrics_;
 
 public:
   explicit MainGame(shapezx::State &&state, shapezx::Global &global_state,
                     const std::string &path)
       : state(std::move(state)), global_state_(global_state),
+        log_(this->state, global_state), rewind_(this->state, global_state),
         ev_key(Gtk::EventControllerKey::create()),
         timer(Glib::signal_timeout()), map(this->ui_state, this->state),
-        box(Gtk::Orientation::VERTICAL), upgrade_machine(this->state),
-        save_path(path) {
+        heatmap(this->state),
+        debug(this->state), latency(this->map.placement_latency),
+        memory(this->state, this->map),
+        box(Gtk::Orientation::VERTICAL),
+        upgrade_machine(this->state), history(this->rewind_),
+        what_if(this->state, global_state, this->ui_state), save_path(path) {
+    this->state.on_task_complete = [this]() {
+      this->upgrade_machine.set_visible();
+    };
+    this->state.on_command = [this](const shapezx::Command &cmd) {
+      if (this->recording_) {
+        this->log_.record(cmd);
+        this->rewind_.record(cmd);
+      }
+    };
+    this->metrics_ = shapezx::MetricsExporter::from_env(this->state);
+    this->state.traced = true;
+
     this->conns.add(this->signal_update().connect(
         [this]() {
-          this->state.update([this]() { this->upgrade_machine.set_visible(); },
-                             this->global_state_);
+          if (auto &mr = this->state.map.multi_rate; mr) {
+            std::tie(mr->from, mr->to) = this->visible_chunks();
+          }
+          auto const begin = shapezx::trace::now();
+          this->state.update(this->global_state_);
+          this->latency.tick.record(shapezx::trace::now() - begin);
+          if (this->recording_) {
+            this->log_.record_tick(this->state);
+            this->rewind_.record_tick(this->state, this->global_state_);
+          } else if (auto &mr = this->state.map.multi_rate;
+                     !mr || mr->stride == 1) {
+            // every region caught up on this tick
+            this->log_ = shapezx::CommandLog(this->state, this->global_state_);
+            this->rewind_ = shapezx::Rewind(this->state, this->global_state_);
+            this->recording_ = true;
+          }
           std::cout << this->global_state_.get().value;
-          for (auto &[id, machine] : this->map.machines) {
-            machine->update();
+          {
+            shapezx::trace::Span span("ui refresh");
+            auto const refresh = shapezx::trace::now();
+            for (auto &[id, machine] : this->map.machines) {
+              machine->update();
+            }
+            this->latency.refresh.record(shapezx::trace::now() - refresh);
           }
           return true;
         },
@@ -340,16 +1013,19 @@ public:
       }
     }));
 
-    this->conns.add(this->machines.signal_save().connect(
-        [this]() { this->state.save_to(this->save_path); }));
+    this->conns.add(
+        this->machines.signal_save().connect([this]() { this->save(); }));
 
-    this->conns.add(this->signal_destroy().connect(
-        [this]() { this->state.save_to(this->save_path); }));
+    this->conns.add(this->signal_destroy().connect([this]() { this->save(); }));
 
     this->ev_key->set_propagation_phase(Gtk::PropagationPhase::CAPTURE);
     this->conns.add(this->ev_key->signal_key_pressed().connect(
         [this](guint keyval, guint, Gdk::ModifierType) {
           std::cout << "received event\n";
+          if (keyval == GDK_KEY_Shift_L || keyval == GDK_KEY_Shift_R) {
+            this->ui_state.extending = true;
+            return false;
+          }
           if ((keyval == GDK_KEY_R || keyval == GDK_KEY_r) &&
               this->ui_state.machine_selected) {
             std::cout << "updating direction\n";
@@ -361,10 +1037,79 @@ public:
                         [](auto const d) { return shapezx::right_of(d); });
             return true;
           }
+          if (keyval == GDK_KEY_L || keyval == GDK_KEY_l) {
+            this->latency.toggle();
+            return true;
+          }
+          if (keyval == GDK_KEY_W || keyval == GDK_KEY_w) {
+            this->what_if.present();
+            return true;
+          }
+          if (keyval == GDK_KEY_H || keyval == GDK_KEY_h) {
+            this->history.update_range(this->state.tick);
+            this->history.present();
+            return true;
+          }
+          if (keyval == GDK_KEY_B || keyval == GDK_KEY_b) {
+            // the next two clicks select what to copy
+            this->ui_state.copying = true;
+            this->ui_state.copy_from.reset();
+            this->ui_state.pasting = false;
+            this->ui_state.machine_selected.reset();
+            this->ui_state.direction.reset();
+            return true;
+          }
+          if ((keyval == GDK_KEY_V || keyval == GDK_KEY_v) &&
+              this->ui_state.blueprint) {
+            // the next click pastes what was copied, all or nothing
+            this->ui_state.pasting = true;
+            this->ui_state.copying = false;
+            return true;
+          }
+          if (keyval == GDK_KEY_M || keyval == GDK_KEY_m) {
+            // regions out of view tick at a coarse rate while this is on
+            auto &mr = this->state.map.multi_rate;
+            if (!mr) {
+              mr.emplace();
+            }
+            mr->stride = mr->stride == 1 ? 8 : 1;
+            if (mr->stride != 1) {
+              this->recording_ = false;
+            }
+            return true;
+          }
+          if (keyval == GDK_KEY_F3) {
+            this->debug.toggle();
+            return true;
+          }
+          if (keyval == GDK_KEY_F4) {
+            // the last seconds, for when the game just stuttered
+            auto path = std::filesystem::path(shapezx::trace::dump_dir()) /
+                        std::format("shapezx-{}.json", this->state.tick);
+            if (shapezx::trace::dump(path.string())) {
+              std::cout << std::format("trace written to {}\n",
+                                       path.string());
+            }
+            return true;
+          }
+          if (keyval == GDK_KEY_F5) {
+            this->heatmap.toggle();
+            return true;
+          }
+          if (keyval == GDK_KEY_F6) {
+            this->memory.toggle();
+            return true;
+          }
 
           return false;
         },
         false));
+    this->conns.add(this->ev_key->signal_key_released().connect(
+        [this](guint keyval, guint, Gdk::ModifierType) {
+          if (keyval == GDK_KEY_Shift_L || keyval == GDK_KEY_Shift_R) {
+            this->ui_state.extending = false;
+          }
+        }));
     this->add_controller(this->ev_key);
 
     this->set_title("shapezx");
@@ -375,8 +1120,15 @@ public:
     this->box.set_valign(Gtk::Align::FILL);
     this->box.set_halign(Gtk::Align::FILL);
 
-    this->map_window.set_child(this->map);
-    this->box.append(this->map_window);
+    this->heat_overlay.set_child(this->map);
+    this->heat_overlay.add_overlay(this->heatmap);
+    this->map_window.set_child(this->heat_overlay);
+    this->map_overlay.set_child(this->map_window);
+    this->map_overlay.add_overlay(this->debug);
+    this->map_overlay.add_overlay(this->heatmap.info);
+    this->map_overlay.add_overlay(this->latency);
+    this->map_overlay.add_overlay(this->memory);
+    this->box.append(this->map_overlay);
     this->box.append(this->machines);
 
     this->set_expand(false);
@@ -388,10 +1140,244 @@ public:
 
   Glib::SignalTimeout signal_update() { return this->timer; }
 
+  // chunks shown in the map window, from the scroll positions
+  std::pair<shapezx::vec::Vec2<>, shapezx::vec::Vec2<>>
+  visible_chunks() const {
+    auto span = [](const Glib::RefPtr<const Gtk::Adjustment> &adj,
+                   std::size_t n) {
+      auto const upper = std::max(adj->get_upper(), 1.0);
+      auto at = [&](double v) {
+        return std::min(std::size_t(v / upper * n), n);
+      };
+      return std::pair(at(adj->get_value()),
+                       at(adj->get_value() + adj->get_page_size()));
+    };
+    auto const &map = this->state.map;
+    auto [r0, r1] = span(this->map_window.get_vadjustment(), map.height);
+    auto [c0, c1] = span(this->map_window.get_hadjustment(), map.width);
+    return {{r0, c0}, {r1, c1}};
+  }
+
+  // for actions taken outside of the game window, e.g. in the store
+  void record(const shapezx::Action &action) {
+    if (!this->recording_) {
+      return;
+    }
+    shapezx::Command cmd{this->state.tick, action};
+    this->log_.record(cmd);
+    this->rewind_.record(cmd);
+  }
+
+  // path of the image written next to a save
+  static std::string image_path(const std::string &save) {
+    return std::filesystem::path(save).replace_extension(".snap").string();
+  }
+
+  void save() {
+    this->state.save_to(this->save_path);
+    shapezx::save_image(this->state, image_path(this->save_path));
+    this->log_.save_to(std::filesystem::path(this->save_path)
+                           .replace_extension(".log.json")
+                           .string());
+  }
+
   MainGame(const MainGame &) = delete;
   MainGame(MainGame &&) = delete;
 };
 
+// Plays the game a shapezx-daemon runs: the map is drawn from the frames
+// the daemon publishes to its SharedView, and placing, removing and saving
+// are sent to it through a Client. The windows that need the state itself,
+// such as history, what-if and the heatmap, are only in MainGame.
+class RemoteGame final : public Gtk::Window {
+  std::unique_ptr<shapezx::Client> client;
+  std::unique_ptr<shapezx::SharedView> view;
+  // the frame drawn, nullopt until the first one is read
+  std::optional<shapezx::SharedView::Snapshot> snapshot;
+  std::optional<shapezx::BuildingType> selected;
+  shapezx::Direction direction = shapezx::Direction::Up;
+  bool removing = false;
+  Gtk::Box box;
+  Gtk::Label status;
+  Gtk::DrawingArea area;
+  shapezx::ui::MachineSelector machines;
+  Glib::RefPtr<Gtk::GestureClick> click;
+  Glib::RefPtr<Gtk::EventControllerKey> ev_key;
+  Connections conns;
+
+public:
+  explicit RemoteGame(const std::string &socket_path)
+      : client(shapezx::Client::connect(socket_path)),
+        box(Gtk::Orientation::VERTICAL),
+        click(Gtk::GestureClick::create()),
+        ev_key(Gtk::EventControllerKey::create()) {
+    this->set_title(std::format("shapezx at {}", socket_path));
+    this->set_default_size(1920, 1080);
+    if (this->client) {
+      this->view = shapezx::SharedView::attach(this->client->view_name);
+    }
+    if (!this->view) {
+      this->status.set_text(std::format("no daemon at {}", socket_path));
+      this->set_child(this->status);
+      return;
+    }
+
+    this->area.set_expand(true);
+    this->area.set_draw_func(
+        [this](const Cairo::RefPtr<Cairo::Context> &cr, int w, int h) {
+          this->draw(cr, w, h);
+        });
+    this->conns.add(this->click->signal_pressed().connect(
+        [this](int, double x, double y) { this->clicked(x, y); }));
+    this->area.add_controller(this->click);
+
+    this->conns.add(this->machines.signal_machine_selected().connect(
+        [this](shapezx::BuildingType type) {
+          this->selected = type;
+          this->direction = shapezx::Direction::Up;
+          this->removing = false;
+        }));
+    this->conns.add(this->machines.signal_remove_selected().connect([this]() {
+      this->removing = true;
+      this->selected.reset();
+    }));
+    this->conns.add(this->machines.signal_save().connect(
+        [this]() { this->client->save(); }));
+
+    this->conns.add(this->ev_key->signal_key_pressed().connect(
+        [this](guint keyval, guint, Gdk::ModifierType) {
+          if ((keyval == GDK_KEY_R || keyval == GDK_KEY_r) &&
+              this->selected) {
+            this->direction = shapezx::right_of(this->direction);
+            return true;
+          }
+          return false;
+        },
+        false));
+    this->add_controller(this->ev_key);
+
+    this->conns.add(Glib::signal_timeout().connect(
+        [this]() { return this->refresh(); }, 50));
+
+    this->box.append(this->status);
+    this->box.append(this->area);
+    this->box.append(this->machines);
+    this->set_child(this->box);
+  }
+
+  // Reads the current frame, false once the daemon has gone away.
+  bool refresh() {
+    using namespace std::chrono_literals;
+    if (this->client->closed(0ms)) {
+      this->status.set_text("the daemon stopped");
+      return false;
+    }
+    // a frame being written is skipped, the next call gets a later one
+    if (auto snapshot = this->view->read(); snapshot) {
+      auto const &frame = snapshot->frame;
+      this->status.set_text(std::format("tick {}, value {}, tasks {}/{}",
+                                        frame.tick, frame.value,
+                                        frame.tasks_done, frame.tasks));
+      this->snapshot = std::move(snapshot);
+      this->area.queue_draw();
+    }
+    return true;
+  }
+
+  // size of a chunk on screen
+  std::pair<double, double> cell_size() const {
+    auto const &header = this->view->header();
+    return {double(this->area.get_height()) /
+                std::max<std::uint64_t>(header.height, 1),
+            double(this->area.get_width()) /
+                std::max<std::uint64_t>(header.width, 1)};
+  }
+
+  static std::array<double, 3> color(const shapezx::SharedView::ViewCell &c) {
+    if (c.building) {
+      switch (shapezx::BuildingType(c.building - 1)) {
+      case shapezx::BuildingType::Miner:
+        return {0.2, 0.4, 0.8};
+      case shapezx::BuildingType::Belt:
+        return {0.55, 0.55, 0.55};
+      case shapezx::BuildingType::Cutter:
+        return {0.85, 0.45, 0.1};
+      case shapezx::BuildingType::TaskCenter:
+        return {0.1, 0.6, 0.25};
+      default:
+        return {0.3, 0.3, 0.3};
+      }
+    }
+    if (auto const *ore = shapezx::ore_item(c.ore); ore) {
+      return *ore == shapezx::GOLD ? std::array{0.9, 0.8, 0.2}
+                                   : std::array{0.7, 0.7, 0.75};
+    }
+    return {0.95, 0.95, 0.9};
+  }
+
+  void draw(const Cairo::RefPtr<Cairo::Context> &cr, int, int) {
+    if (!this->snapshot) {
+      return;
+    }
+    auto const width = this->view->header().width;
+    auto [ch, cw] = this->cell_size();
+    auto const &cells = this->snapshot->cells;
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+      auto const &cell = cells[i];
+      auto const x = double(i % width) * cw;
+      auto const y = double(i / width) * ch;
+      auto [r, g, b] = RemoteGame::color(cell);
+      cr->set_source_rgb(r, g, b);
+      cr->rectangle(x, y, cw, ch);
+      cr->fill();
+      if (!cell.anchor) {
+        continue;
+      }
+      // a line from the anchor towards where the building faces
+      auto const d = shapezx::to_vec2(shapezx::Direction(cell.direction));
+      cr->set_source_rgb(0, 0, 0);
+      cr->move_to(x + cw / 2, y + ch / 2);
+      cr->line_to(x + cw / 2 + d[1] * cw / 2, y + ch / 2 + d[0] * ch / 2);
+      cr->stroke();
+    }
+  }
+
+  void clicked(double x, double y) {
+    if (!this->snapshot) {
+      return;
+    }
+    auto const &header = this->view->header();
+    auto [ch, cw] = this->cell_size();
+    auto pos = shapezx::vec::Vec2<>(std::size_t(y / ch), std::size_t(x / cw));
+    if (pos[0] >= header.height || pos[1] >= header.width) {
+      return;
+    }
+    auto const &cell = this->snapshot->cells[pos[0] * header.width + pos[1]];
+
+    std::optional<std::uint64_t> applied;
+    if (this->removing && cell.building) {
+      this->removing = false;
+      applied = this->client->send(shapezx::Remove{pos});
+    } else if (this->selected && !cell.building) {
+      shapezx::Place place;
+      place.entries.push_back({
+          .pos = pos,
+          .type = *std::exchange(this->selected, std::nullopt),
+          .direction = this->direction,
+      });
+      applied = this->client->send(place);
+    } else {
+      return;
+    }
+    if (!applied) {
+      this->status.set_text(
+          std::format("nothing changed at ({} {})", pos[0], pos[1]));
+    }
+  }
+
+  RemoteGame(const RemoteGame &) = delete;
+};
+
 template <typename T> class Value final : public Gtk::Label {
 public:
   T val_;
@@ -413,7 +1399,7 @@ public:
   Gtk::Button new_game_;
   Gtk::Button open_store_;
   Gtk::Button exit_;
-  Value<std::uint32_t> coins_;
+  Value<std::uint64_t> coins_;
 
   std::reference_wrapper<shapezx::Global> global_state_;
   bool playing = false;
@@ -462,6 +1448,7 @@ public:
   Gtk::Button center_;
   Gtk::Button map_;
   Gtk::Button value_;
+  sigc::signal<void(shapezx::Purchase)> purchased_;
   Connections conns;
 
   std::reference_wrapper<shapezx::Global> global_state_;
@@ -470,33 +1457,18 @@ public:
       : box_(Gtk::Orientation::VERTICAL), global_state_(global_state) {
     this->update();
 
-    this->conns.add(this->center_.signal_clicked().connect([this]() {
-      if (auto &s = this->global_state_.get(); s.value >= s.price.center()) {
-        s.value -= s.price.center();
-        s.price.center_ += 1;
-        s.center_size += {1, 1};
-        this->update();
-      }
-    }));
-
-    this->conns.add(this->map_.signal_clicked().connect([this]() {
-      if (auto &s = this->global_state_.get(); s.value >= s.price.map()) {
-        s.value -= s.price.map();
-        s.price.map_ += 1;
-        s.max_height += 10;
-        s.max_width += 10;
-        this->update();
-      }
-    }));
-
-    this->conns.add(this->value_.signal_clicked().connect([this]() {
-      if (auto &s = this->global_state_.get(); s.value >= s.price.value()) {
-        s.value -= s.price.value();
-        s.price.value_ += 1;
-        s.value_factor += 1;
-        this->update();
-      }
-    }));
+    auto connect = [this](Gtk::Button &button,
+                          shapezx::Purchase::Offer offer) {
+      this->conns.add(button.signal_clicked().connect([this, offer]() {
+        if (this->global_state_.get().purchase(offer)) {
+          this->purchased_.emit({offer});
+          this->update();
+        }
+      }));
+    };
+    connect(this->center_, shapezx::Purchase::Offer::Center);
+    connect(this->map_, shapezx::Purchase::Offer::Map);
+    connect(this->value_, shapezx::Purchase::Offer::Value);
 
     this->box_.append(this->center_);
     this->box_.append(this->map_);
@@ -504,6 +1476,10 @@ public:
     this->set_child(this->box_);
   }
 
+  sigc::signal<void(shapezx::Purchase)> signal_purchased() {
+    return this->purchased_;
+  }
+
   void update() {
     this->center_.set_label(
         std::format("Enlarge Task Center ({} coins)",
@@ -546,9 +1522,26 @@ public:
         [this, begin_game]() {
           auto last = this->global_state.last_played.value();
           auto const &p = this->global_state.saves[last];
-          std::ifstream f(p);
-          auto j = json::parse(f);
-          auto state = j.get<shapezx::State>();
+          // headless runs only update the save, the image may be stale
+          auto image = MainGame::image_path(p);
+          std::error_code ec;
+          auto fresh = std::filesystem::last_write_time(image, ec) >=
+                       std::filesystem::last_write_time(p, ec);
+          shapezx::trace::Span span("load");
+          auto state = (fresh ? shapezx::load_image(image) : std::nullopt)
+                           .or_else([&]() {
+                             std::ifstream f(p);
+                             auto j = [&]() {
+                               shapezx::memory::Staging staging(
+                                   shapezx::memory::Stage::StateLoad);
+                               return json::parse(f);
+                             }();
+                             return std::optional(j.get<shapezx::State>());
+                           })
+                           .value();
+          // the store may have raised the limits since the last session
+          state.map.grow(this->global_state.max_height,
+                         this->global_state.max_width);
 
           begin_game(std::move(state), p);
         }));
@@ -566,6 +1559,13 @@ public:
           begin_game(std::move(state), p);
         }));
 
+    this->conns.add(this->store_.signal_purchased().connect(
+        [this](shapezx::Purchase purchase) {
+          if (this->main_game_) {
+            this->main_game_->record(purchase);
+          }
+        }));
+
     this->conns.add(this->start_screen_.signal_open_store().connect(
         [this]() { this->store_.set_visible(); }));
 
@@ -591,5 +1591,10 @@ public:
 int main(int argc, char **argv) {
   auto app = Gtk::Application::create();
 
+  // a game a daemon runs, played through the socket it listens on
+  if (auto const *socket = std::getenv("SHAPEZX_CONNECT"); socket) {
+    return app->make_window_and_run<RemoteGame>(argc, argv,
+                                                std::string(socket));
+  }
   return app->make_window_and_run<App>(argc, argv);
 }
\ No newline at end of file
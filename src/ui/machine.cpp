@@ -1,7 +1,35 @@
 #include "machine.hpp"
 #include <memory>
+#include <string>
+#include <unordered_map>
 
 namespace shapezx::ui {
+// Icons are shared by every machine of a type, so placing many machines at
+// once does not decode the same file again for each of them.
+static std::unordered_map<std::string, Glib::RefPtr<Gdk::Pixbuf>> &
+icon_cache() {
+  static std::unordered_map<std::string, Glib::RefPtr<Gdk::Pixbuf>> cache;
+  return cache;
+}
+
+static Glib::RefPtr<Gdk::Pixbuf> load_pixbuf(const std::string &path) {
+  auto &pixbuf = icon_cache()[path];
+  if (!pixbuf) {
+    pixbuf = Gdk::Pixbuf::create_from_file(path);
+  }
+  return pixbuf;
+}
+
+std::uint64_t icon_cache_bytes() {
+  std::uint64_t res = 0;
+  for (auto const &[path, pixbuf] : icon_cache()) {
+    if (pixbuf) {
+      res += pixbuf->get_byte_length();
+    }
+  }
+  return res;
+}
+
 std::unique_ptr<Machine>
 Machine::create(BuildingType type, vec::Vec2<> pos, Direction d,
                 std::uint32_t id, UIState &ui_state, const shapezx::State &game_state,
@@ -9,26 +37,26 @@ Machine::create(BuildingType type, vec::Vec2<> pos, Direction d,
   switch (type) {
   case BuildingType::Miner:
     return std::make_unique<Machine>(
-        type, Gdk::Pixbuf::create_from_file("./assets/miner.png"), pos, d, id,
+        type, load_pixbuf("./assets/miner.png"), pos, d, id,
         ui_state, machine_removed);
   case BuildingType::TrashCan:
     return std::make_unique<Machine>(
-        type, Gdk::Pixbuf::create_from_file("./assets/trash.png"), pos, d, id,
+        type, load_pixbuf("./assets/trash.png"), pos, d, id,
         ui_state, machine_removed);
   case BuildingType::Belt:
     return std::make_unique<Machine>(
-        type, Gdk::Pixbuf::create_from_file("./assets/belt.png"), pos, d, id,
+        type, load_pixbuf("./assets/belt.png"), pos, d, id,
         ui_state, machine_removed);
   case BuildingType::Cutter:
     return std::make_unique<Machine>(
-        type, Gdk::Pixbuf::create_from_file("./assets/cutter_large.png"), pos,
+        type, load_pixbuf("./assets/cutter_large.png"), pos,
         d, id, ui_state, machine_removed);
   case BuildingType::TaskCenter:
     return std::make_unique<TaskCenter>(
-        Gdk::Pixbuf::create_from_file("./assets/task_center.png"), pos, d, id,
+        load_pixbuf("./assets/task_center.png"), pos, d, id,
         ui_state, game_state, machine_removed);
   default:
     std::unreachable();
   }
 }
-} // namespace shapezx::ui
\ No newline at end of file
+} // namespace shapezx::ui
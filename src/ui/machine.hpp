@@ -37,6 +37,21 @@ struct UIState {
   std::optional<BuildingType> machine_selected = std::nullopt;
   std::optional<Direction> direction = std::nullopt;
   bool machine_removing = false;
+  // shift is held: keep the selected machine and lay lines from last_placed
+  bool extending = false;
+  std::optional<vec::Vec2<>> last_placed = std::nullopt;
+  // while set, placements are collected here for a what-if run instead of
+  // being built
+  std::optional<Place> plan = std::nullopt;
+  // while copying, the first click marks a corner here and the second
+  // copies the buildings between the two into blueprint
+  bool copying = false;
+  std::optional<vec::Vec2<>> copy_from = std::nullopt;
+  std::optional<Blueprint> blueprint = std::nullopt;
+  // the next click pastes blueprint with its origin there
+  bool pasting = false;
+  // trace::now() of the click whose placement is not shown yet
+  std::optional<std::uint64_t> clicked_at = std::nullopt;
   size_t map_locked = 0;
 
   void lock_map() { this->map_locked += 1; }
@@ -125,6 +140,9 @@ public:
 
 class TaskCenter;
 
+// pixel data of the icons machines are created with
+std::uint64_t icon_cache_bytes();
+
 class Machine : public Gtk::Button {
 public:
   static std::unique_ptr<Machine>